@@ -7,6 +7,15 @@
 #define SNRF_OP_PAYLOAD 2
 #define SNRF_OP_COMPL 3
 #define SNRF_OP_DEBUG 4
+/* answered with the same op, compl.val is the state */
+#define SNRF_OP_SYNC 5
+/* set_multi.pairs, all checked then all applied in order. on */
+/* error none is applied and compl.val is the index of the pair. */
+/* SNRF_KEY_UART_BAUD is refused, only set by a single op_set */
+#define SNRF_OP_SET_MULTI 6
+/* payload_to, a payload sent to addr. the device programs */
+/* its tx address only when addr changes */
+#define SNRF_OP_PAYLOAD_TO 7
 
 #define SNRF_KEY_INFO 0
 #define SNRF_KEY_STATE 1
@@ -20,6 +29,9 @@
 #define SNRF_KEY_PAYLOAD_WIDTH 9
 #define SNRF_KEY_UART_FLAGS 10
 #define SNRF_KEY_NRF_CHIPSET 11
+#define SNRF_KEY_UART_BAUD 12
+#define SNRF_KEY_UART_NCORRUPT 13
+#define SNRF_KEY_NONE 0xff
 
 #define SNRF_CHIPSET_NRF24L01P 0
 #define SNRF_CHIPSET_NRF905 1
@@ -37,6 +49,15 @@
 #define SNRF_RATE_1MBPS 2
 #define SNRF_RATE_2MBPS 3
 
+/* uart rates, the raw baud value is used. a new rate must be */
+/* confirmed by getting SNRF_KEY_UART_BAUD within the probation */
+/* time, otherwise the device goes back to the default rate */
+#define SNRF_UART_BAUD_DEFAULT 9600
+#define SNRF_UART_BAUD_250K 250000
+#define SNRF_UART_BAUD_500K 500000
+#define SNRF_UART_BAUD_1M 1000000
+#define SNRF_UART_PROBATION_MS 500
+
 #define SNRF_TX_ACK_DISABLED 0
 #define SNRF_TX_ACK_ENABLED 1
 
@@ -47,8 +68,10 @@
 #define SNRF_ERR_VAL 4 
 #define SNRF_ERR_STATE 5
 
-#define SNRF_SYNC_BYTE 0xa5
-#define SNRF_SYNC_END 0x5a
+/* maximum number of host messages in flight. the device */
+/* buffers that many messages, the host never sends more */
+/* without waiting for completions. must be a power of 2 */
+#define SNRF_WINDOW_MAX 4
 
 typedef struct
 {
@@ -57,6 +80,10 @@ typedef struct
 
   uint8_t op;
 
+  /* set by the host, echoed back in the completion */
+  /* 0 for messages originating from the device */
+  uint8_t seq;
+
   union
   {
     struct
@@ -66,6 +93,13 @@ typedef struct
       uint8_t size;
     } __attribute__((packed)) payload;
 
+    struct
+    {
+      uint32_t addr;
+      uint8_t data[SNRF_MAX_PAYLOAD_WIDTH];
+      uint8_t size;
+    } __attribute__((packed)) payload_to;
+
     struct
     {
       uint8_t key;
@@ -77,6 +111,17 @@ typedef struct
       uint8_t key;
     } __attribute__((packed)) get;
 
+    struct
+    {
+      /* unused pairs have key SNRF_KEY_NONE */
+#define SNRF_SET_MULTI_MAX 8
+      struct
+      {
+	uint8_t key;
+	uint32_t val;
+      } __attribute__((packed)) pairs[SNRF_SET_MULTI_MAX];
+    } __attribute__((packed)) set_multi;
+
     struct
     {
       uint8_t err;
@@ -91,9 +136,6 @@ typedef struct
 
   } __attribute__((packed)) u;
 
-  /* 0xff if synchronization wanted */
-  uint8_t sync;
-
 } __attribute__((packed)) snrf_msg_t;
 
 
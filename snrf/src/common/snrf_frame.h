@@ -0,0 +1,279 @@
+#ifndef SNRF_FRAME_H_INCLUDED
+#define SNRF_FRAME_H_INCLUDED
+
+
+/* link framing, shared by the device and the host */
+/* a frame is the COBS encoding of a message body followed by */
+/* its crc16, then a 0x00 delimiter. since encoded bytes are */
+/* never 0x00, a receiver realigns on the next delimiter */
+
+#include <stdint.h>
+
+#define SNRF_FRAME_DELIM 0x00
+#define SNRF_CRC16_INIT 0xffff
+
+/* crc16 (2), cobs code (1) and delimiter (1) overhead */
+/* valid for bodies smaller than 254 bytes */
+#define SNRF_FRAME_OVERHEAD 4
+#define SNRF_FRAME_SIZE_MAX (sizeof(snrf_msg_t) + SNRF_FRAME_OVERHEAD)
+
+static inline uint16_t snrf_crc16_update(uint16_t crc, uint8_t x)
+{
+  /* crc-ccitt, reflected. same as avr-libc _crc_ccitt_update */
+
+  x ^= (uint8_t)crc;
+  x ^= x << 4;
+
+  return
+    ((((uint16_t)x << 8) | (crc >> 8)) ^ (uint8_t)(x >> 4) ^ ((uint16_t)x << 3));
+}
+
+static inline uint16_t snrf_crc16(const uint8_t* buf, uint8_t size)
+{
+  uint16_t crc = SNRF_CRC16_INIT;
+  for (; size; --size, ++buf) crc = snrf_crc16_update(crc, *buf);
+  return crc;
+}
+
+static inline uint8_t snrf_frame_encode
+(uint8_t* frame, const uint8_t* body, uint8_t size)
+{
+  /* frame must hold size + SNRF_FRAME_OVERHEAD bytes */
+  /* return the frame size, delimiter included */
+
+  const uint16_t crc = snrf_crc16(body, size);
+  uint8_t code_pos = 0;
+  uint8_t code = 1;
+  uint8_t pos = 1;
+  uint8_t i;
+  uint8_t x;
+
+  for (i = 0; i != (uint8_t)(size + 2); ++i)
+  {
+    if (i < size) x = body[i];
+    else if (i == size) x = (uint8_t)crc;
+    else x = (uint8_t)(crc >> 8);
+
+    if (x == 0x00)
+    {
+      frame[code_pos] = code;
+      code_pos = pos++;
+      code = 1;
+      continue ;
+    }
+
+    frame[pos++] = x;
+
+    if ((++code) == 0xff)
+    {
+      frame[code_pos] = code;
+      code_pos = pos++;
+      code = 1;
+    }
+  }
+
+  frame[code_pos] = code;
+  frame[pos++] = SNRF_FRAME_DELIM;
+
+  return pos;
+}
+
+static inline uint8_t snrf_frame_decode(uint8_t* buf, uint8_t size)
+{
+  /* buf the frame, delimiter excluded. decoded in place */
+  /* return the body size, 0 if the frame is corrupted */
+
+  uint8_t block;
+  uint8_t code;
+  uint8_t i = 0;
+  uint8_t n = 0;
+  uint16_t crc;
+
+  while (i != size)
+  {
+    block = buf[i++];
+    if (block == 0x00) return 0;
+
+    for (code = block; code != 1; --code)
+    {
+      if (i == size) return 0;
+      buf[n++] = buf[i++];
+    }
+
+    /* implicit zero, except after a full block or at the end */
+    if ((block != 0xff) && (i != size)) buf[n++] = 0x00;
+  }
+
+  if (n <= 2) return 0;
+  n -= 2;
+
+  crc = snrf_crc16(buf, n);
+  if ((buf[n] != (uint8_t)crc) || (buf[n + 1] != (uint8_t)(crc >> 8)))
+    return 0;
+
+  return n;
+}
+
+static inline uint8_t snrf_frame_decode_to
+(uint8_t* body, const uint8_t* frame, uint8_t size, uint8_t max)
+{
+  /* as snrf_frame_decode, but frame is left untouched and */
+  /* only the body, at most max bytes, is written to body. */
+  /* the last 2 decoded bytes are held back, the crc */
+
+  uint8_t block;
+  uint8_t code;
+  uint8_t i = 0;
+  uint8_t n = 0;
+  uint8_t k = 0;
+  uint8_t c0 = 0;
+  uint8_t c1 = 0;
+  uint8_t x;
+  uint16_t crc = SNRF_CRC16_INIT;
+
+#define SNRF_FRAME_PUSH(__x)				\
+  do {							\
+    if (k == 2)						\
+    {							\
+      if (n == max) return 0;				\
+      body[n++] = c0;					\
+      crc = snrf_crc16_update(crc, c0);			\
+    }							\
+    else ++k;						\
+    c0 = c1;						\
+    c1 = (__x);						\
+  } while (0)
+
+  while (i != size)
+  {
+    block = frame[i++];
+    if (block == 0x00) return 0;
+
+    for (code = block; code != 1; --code)
+    {
+      if (i == size) return 0;
+      x = frame[i++];
+      SNRF_FRAME_PUSH(x);
+    }
+
+    /* implicit zero, except after a full block or at the end */
+    if ((block != 0xff) && (i != size)) SNRF_FRAME_PUSH(0x00);
+  }
+
+#undef SNRF_FRAME_PUSH
+
+  if (n == 0) return 0;
+  if ((c0 != (uint8_t)crc) || (c1 != (uint8_t)(crc >> 8))) return 0;
+
+  return n;
+}
+
+/* a message travels as its op and seq, followed by the bytes */
+/* of its union member only. a payload carries its real bytes, */
+/* its size is given by the frame size */
+
+#define SNRF_MSG_HEADER_SIZE 2
+
+static inline uint8_t snrf_msg_size(const snrf_msg_t* msg)
+{
+  /* size of the message prefix sent in a frame */
+
+  switch (msg->op)
+  {
+  case SNRF_OP_SET:
+    return SNRF_MSG_HEADER_SIZE + sizeof(msg->u.set);
+
+  case SNRF_OP_GET:
+    return SNRF_MSG_HEADER_SIZE + sizeof(msg->u.get);
+
+  case SNRF_OP_PAYLOAD:
+    return SNRF_MSG_HEADER_SIZE + msg->u.payload.size;
+
+  case SNRF_OP_PAYLOAD_TO:
+    return SNRF_MSG_HEADER_SIZE + sizeof(msg->u.payload_to.addr) +
+      msg->u.payload_to.size;
+
+  case SNRF_OP_DEBUG:
+    return SNRF_MSG_HEADER_SIZE + sizeof(msg->u.debug);
+
+  case SNRF_OP_SET_MULTI:
+    {
+      uint8_t n;
+      for (n = 0; n != SNRF_SET_MULTI_MAX; ++n)
+      {
+	if (msg->u.set_multi.pairs[n].key == SNRF_KEY_NONE) break ;
+      }
+      return SNRF_MSG_HEADER_SIZE + n * sizeof(msg->u.set_multi.pairs[0]);
+    }
+
+  case SNRF_OP_COMPL:
+  case SNRF_OP_SYNC:
+  default:
+    return SNRF_MSG_HEADER_SIZE + sizeof(msg->u.compl);
+  }
+}
+
+static inline uint8_t snrf_frame_encode_msg
+(uint8_t* frame, const snrf_msg_t* msg)
+{
+  /* frame must hold SNRF_FRAME_SIZE_MAX bytes */
+  return snrf_frame_encode(frame, (const uint8_t*)msg, snrf_msg_size(msg));
+}
+
+static inline snrf_msg_t* snrf_msg_from_body(uint8_t* buf, uint8_t size)
+{
+  /* buf the size bytes of a message as sent on the link, it */
+  /* must hold sizeof(snrf_msg_t) bytes. the fields implied */
+  /* by the size are filled. return NULL if the size does not */
+  /* match */
+
+  snrf_msg_t* const msg = (snrf_msg_t*)buf;
+
+  if (size < SNRF_MSG_HEADER_SIZE) return NULL;
+
+  if (msg->op == SNRF_OP_PAYLOAD)
+  {
+    if (size > (SNRF_MSG_HEADER_SIZE + SNRF_MAX_PAYLOAD_WIDTH)) return NULL;
+    msg->u.payload.size = size - SNRF_MSG_HEADER_SIZE;
+    return msg;
+  }
+
+  if (msg->op == SNRF_OP_PAYLOAD_TO)
+  {
+    size -= SNRF_MSG_HEADER_SIZE;
+    if (size < sizeof(msg->u.payload_to.addr)) return NULL;
+    size -= sizeof(msg->u.payload_to.addr);
+    if (size > SNRF_MAX_PAYLOAD_WIDTH) return NULL;
+    msg->u.payload_to.size = size;
+    return msg;
+  }
+
+  if (msg->op == SNRF_OP_SET_MULTI)
+  {
+    /* the pair count is given by the frame size */
+    size -= SNRF_MSG_HEADER_SIZE;
+    if ((size == 0) || (size > sizeof(msg->u.set_multi))) return NULL;
+    if (size % sizeof(msg->u.set_multi.pairs[0])) return NULL;
+    size /= sizeof(msg->u.set_multi.pairs[0]);
+    for (; size != SNRF_SET_MULTI_MAX; ++size)
+      msg->u.set_multi.pairs[size].key = SNRF_KEY_NONE;
+    return msg;
+  }
+
+  if (size != snrf_msg_size(msg)) return NULL;
+
+  return msg;
+}
+
+static inline snrf_msg_t* snrf_frame_decode_msg(uint8_t* buf, uint8_t size)
+{
+  /* buf the frame, delimiter excluded. decoded in place, */
+  /* buf must hold sizeof(snrf_msg_t) bytes. return NULL */
+  /* if the frame is corrupted or its size does not match */
+
+  size = snrf_frame_decode(buf, size);
+  if (size == 0) return NULL;
+  return snrf_msg_from_body(buf, size);
+}
+
+#endif /* SNRF_FRAME_H_INCLUDED */
@@ -4,6 +4,7 @@
 #include <avr/sleep.h>
 #include <avr/interrupt.h>
 #include "../common/snrf_common.h"
+#include "../common/snrf_frame.h"
 #include "../../../src/uart.c"
 
 /* enable nrf905, enable softspi, define pins */
@@ -84,23 +85,30 @@ ISR(PCINT0_vect) {}
 ISR(PCINT1_vect) {}
 ISR(PCINT2_vect) {}
 
+static void write_msg(const snrf_msg_t* msg)
+{
+  /* encode and send a message, only its used bytes */
+
+  uint8_t frame[SNRF_FRAME_SIZE_MAX];
+  uint8_t size;
+
+  size = snrf_frame_encode_msg(frame, msg);
+  uart_write(frame, size);
+}
+
 static inline void write_payload_msg(const uint8_t* data, uint8_t size)
 {
-  /* write a payload message */
-  /* warning: rely on snrf_msg_t field ordering and packing */
-  /* use multiple uart_write to avoid memory copies */
+  /* write a payload message, not padded */
 
-  static const uint8_t op = SNRF_OP_PAYLOAD;
-  static const uint8_t sync = 0x00;
-  static const uint8_t pad = 0x2a;
+  snrf_msg_t msg;
   uint8_t i;
 
-  uart_write(&op, sizeof(uint8_t));
-  uart_write(data, size);
-  for (i = 0; i != (SNRF_MAX_PAYLOAD_WIDTH - size); ++i)
-    uart_write(&pad, sizeof(uint8_t));
-  uart_write(&size, sizeof(uint8_t));
-  uart_write(&sync, sizeof(uint8_t));
+  msg.op = SNRF_OP_PAYLOAD;
+  msg.seq = 0x00;
+  for (i = 0; i != size; ++i) msg.u.payload.data[i] = data[i];
+  msg.u.payload.size = size;
+
+  write_msg(&msg);
 }
 
 static uint8_t do_nrf(void)
@@ -136,8 +144,34 @@ static inline uint8_t uart_is_rx_empty(void)
   return (UCSR0A & (1 << RXC0)) == 0;
 }
 
-static volatile uint8_t uart_buf[sizeof(snrf_msg_t)];
+/* one frame slot per host message in flight. uart_head is */
+/* the count of slots filled by the interrupt handler, uart_tail */
+/* the count of slots released by the sequential part. the slot */
+/* count is a power of 2, so that the difference of the free */
+/* running counters is the number of filled slots. */
+
+#define UART_SLOT_MASK (SNRF_WINDOW_MAX - 1)
+static volatile uint8_t uart_buf[SNRF_WINDOW_MAX][SNRF_FRAME_SIZE_MAX];
+static volatile uint8_t uart_len[SNRF_WINDOW_MAX];
 static volatile uint8_t uart_pos = 0;
+static volatile uint8_t uart_head = 0;
+static volatile uint8_t uart_tail = 0;
+
+/* dropping bytes up to the next frame delimiter */
+static volatile uint8_t uart_skip = 0;
+
+/* a frame starting while all the slots are filled goes to the */
+/* sync slot, and is kept only if it is a SYNC. so the host can */
+/* resynchronize a device it overflowed. uart_sync_len is set */
+/* by the interrupt handler, cleared by the sequential part */
+static volatile uint8_t uart_sync_buf[SNRF_FRAME_SIZE_MAX];
+static volatile uint8_t uart_sync_len = 0;
+static volatile uint8_t uart_is_sync = 0;
+
+/* corrupted frames, dropped by the interrupt handler */
+/* or rejected by do_uart */
+static volatile uint16_t uart_nskip = 0;
+static uint16_t uart_ncrc = 0;
 
 #define UART_FLAG_MISS (1 << 0)
 #define UART_FLAG_ERR (1 << 1)
@@ -145,11 +179,14 @@ static volatile uint8_t uart_flags = 0;
 
 ISR(USART_RX_vect)
 {
-  /* warning: uart_pos must only be incremented. this allows */
-  /* the sequential part of the code to access its contents */
-  /* without disabling uart interrupts. especially, uart_pos */
-  /* must not be set to 0 here on error, and doing so is left */
-  /* to the sequential */
+  /* warning: uart_head must only be incremented here, and */
+  /* uart_tail only by the sequential part of the code. this */
+  /* allows both to access the slots without disabling uart */
+  /* interrupts. especially, uart_tail must not be modified */
+  /* here on error, and doing so is left to the sequential */
+
+  /* a corrupted or missed frame is dropped. the host misses */
+  /* its completion and sends it again */
 
   uint8_t err;
   uint8_t x;
@@ -158,28 +195,139 @@ ISR(USART_RX_vect)
   {
     err = uart_read_uint8(&x);
 
-    /* missed byte */
-    if (uart_pos == sizeof(snrf_msg_t))
-    {
-      uart_flags |= UART_FLAG_MISS;
-      return ;
-    }
-
     /* uart rx error */
     if (err)
     {
-      /* force synchronization */
       uart_flags |= UART_FLAG_ERR;
-      uart_pos = sizeof(snrf_msg_t);
-      uart_buf[offsetof(snrf_msg_t, sync)] = SNRF_SYNC_BYTE;
-      return ;
+      uart_skip = 1;
+      continue ;
     }
 
-    uart_buf[uart_pos++] = x;
+    /* end of frame, realign on the next byte */
+    if (x == SNRF_FRAME_DELIM)
+    {
+      if (uart_skip)
+      {
+	++uart_nskip;
+      }
+      else if (uart_pos == 0)
+      {
+	/* empty frame */
+      }
+      else if (uart_is_sync)
+      {
+	uart_sync_len = uart_pos;
+      }
+      else
+      {
+	uart_len[uart_head & UART_SLOT_MASK] = uart_pos;
+	++uart_head;
+      }
+
+      uart_pos = 0;
+      uart_skip = 0;
+
+      continue ;
+    }
+
+    if (uart_skip) continue ;
+
+    /* slots are only released while a frame is received */
+    if (uart_pos == 0)
+      uart_is_sync = ((uint8_t)(uart_head - uart_tail) == SNRF_WINDOW_MAX);
+
+    /* frame too long */
+    if (uart_pos == (SNRF_FRAME_SIZE_MAX - 1))
+    {
+      uart_skip = 1;
+      continue ;
+    }
+
+    if (uart_is_sync == 0)
+    {
+      uart_buf[uart_head & UART_SLOT_MASK][uart_pos++] = x;
+      continue ;
+    }
+
+    /* the first cobs block holds the op, unless it is 0x00 */
+    if ((uart_sync_len != 0) ||
+	((uart_pos == 1) &&
+	 ((uart_sync_buf[0] == 1) || (x != SNRF_OP_SYNC))))
+    {
+      /* missed frame, all the slots are filled */
+      uart_flags |= UART_FLAG_MISS;
+      uart_skip = 1;
+      continue ;
+    }
+
+    uart_sync_buf[uart_pos++] = x;
   }
 }
 
 
+/* uart baud rate switching. the new rate is applied once the */
+/* completion of the set message is sent. the host confirms it */
+/* by getting SNRF_KEY_UART_BAUD within the probation time, */
+/* otherwise timer1 expires and the default rate is restored */
+
+static uint32_t uart_baud = SNRF_UART_BAUD_DEFAULT;
+static uint32_t uart_next_baud = 0;
+static volatile uint8_t uart_probation_expired = 0;
+
+ISR(TIMER1_COMPA_vect)
+{
+  uart_probation_expired = 1;
+}
+
+static void probation_start(void)
+{
+  /* 16 bits timer1, CTC mode, prescaler set to 1024 */
+
+  TCCR1B = 0;
+  TCCR1A = 0;
+  OCR1A = (F_CPU / 1024UL) * SNRF_UART_PROBATION_MS / 1000UL - 1;
+  TCNT1 = 0;
+  TCCR1C = 0;
+  TIFR1 = 1 << OCF1A;
+  uart_probation_expired = 0;
+
+  /* interrupt on OCR1A match */
+  TIMSK1 = 1 << OCIE1A;
+  TCCR1B = (1 << WGM12) | (5 << 0);
+}
+
+static void probation_stop(void)
+{
+  TCCR1B = 0;
+  TIMSK1 = 0;
+  TIFR1 = 1 << OCF1A;
+  uart_probation_expired = 0;
+}
+
+static void uart_switch_baud(uint32_t baud)
+{
+  /* must be called with interrupts disabled */
+  /* bytes received at the previous rate are dropped */
+
+  if (baud == SNRF_UART_BAUD_DEFAULT)
+  {
+    set_baud_rate(baud);
+    UCSR0A &= ~(1 << U2X0);
+  }
+  else
+  {
+    set_baud_rate_x2(baud);
+  }
+
+  uart_baud = baud;
+
+  uart_flush_rx();
+  uart_pos = 0;
+  uart_skip = 0;
+  uart_tail = uart_head;
+}
+
+
 /* snrf global state */
 
 static uint8_t snrf_state;
@@ -215,31 +363,87 @@ static uint32_t buf_to_uint32(const uint8_t* buf)
   return x;
 }
 
-static void handle_set_msg(snrf_msg_t* msg)
+static uint8_t check_keyval(uint8_t state, uint8_t key, uint32_t val)
 {
-  /* capture before modifying */
-  const uint8_t key = msg->u.set.key;
-  const uint32_t val = le_to_uint32(msg->u.set.val);
+  /* return SNRF_ERR_xxx, without side effect */
+  /* state the one the pair is applied in */
+
+  /* the uart rate does not depend on the radio state */
+  if ((state != SNRF_STATE_CONF) &&
+      (key != SNRF_KEY_STATE) && (key != SNRF_KEY_UART_BAUD))
+    return SNRF_ERR_VAL;
 
-  if ((snrf_state != SNRF_STATE_CONF) && (key != SNRF_KEY_STATE))
+  switch (key)
   {
-    MAKE_COMPL_ERROR(msg, SNRF_ERR_VAL);
-    return ;
+  case SNRF_KEY_STATE:
+    if (val >= SNRF_STATE_MAX) return SNRF_ERR_VAL;
+    break ;
+
+  case SNRF_KEY_CRC:
+    if ((val != SNRF_CRC_DISABLED) &&
+	(val != SNRF_CRC_8) &&
+	(val != SNRF_CRC_16))
+      return SNRF_ERR_VAL;
+    break ;
+
+#if (NRF_CONFIG_NRF24L01P == 1)
+  case SNRF_KEY_RATE:
+    if ((val == 0) || (val > 3)) return SNRF_ERR_VAL;
+    break ;
+
+  case SNRF_KEY_CHAN:
+    break ;
+#endif
+
+  case SNRF_KEY_ADDR_WIDTH:
+    /* same ranges as nrf_set_addr_width */
+#if (NRF_CONFIG_NRF24L01P == 1)
+    if ((val < 3) || (val > 5)) return SNRF_ERR_VAL;
+#elif (NRF_CONFIG_NRF905 == 1)
+    if ((val < 1) || (val > 4)) return SNRF_ERR_VAL;
+#endif
+    break ;
+
+  case SNRF_KEY_RX_ADDR:
+  case SNRF_KEY_TX_ADDR:
+  case SNRF_KEY_UART_FLAGS:
+    break ;
+
+  case SNRF_KEY_TX_ACK:
+    if (val > 1) return SNRF_ERR_VAL;
+    break ;
+
+  case SNRF_KEY_PAYLOAD_WIDTH:
+    if (val > SNRF_MAX_PAYLOAD_WIDTH) return SNRF_ERR_VAL;
+    break ;
+
+  case SNRF_KEY_UART_BAUD:
+    if ((val != SNRF_UART_BAUD_DEFAULT) &&
+	(val != SNRF_UART_BAUD_250K) &&
+	(val != SNRF_UART_BAUD_500K) &&
+	(val != SNRF_UART_BAUD_1M))
+      return SNRF_ERR_VAL;
+    break ;
+
+  default:
+    return SNRF_ERR_KEY;
   }
 
-  /* completion sent back, assume success */
-  MAKE_COMPL_ERROR(msg, SNRF_ERR_SUCCESS);
+  return SNRF_ERR_SUCCESS;
+}
+
+/* last tx address programmed, cf. SNRF_OP_PAYLOAD_TO */
+static uint32_t tx_addr;
+static uint8_t tx_addr_is_set = 0;
+
+static void apply_keyval(uint8_t key, uint32_t val)
+{
+  /* checked by check_keyval */
 
   switch (key)
   {
   case SNRF_KEY_STATE:
     {
-      if (val >= SNRF_STATE_MAX)
-      {
-	MAKE_COMPL_ERROR(msg, SNRF_ERR_VAL);
-	break ;
-      }
-
       if (val == snrf_state)
       {
 	/* nothing */
@@ -263,8 +467,7 @@ static void handle_set_msg(snrf_msg_t* msg)
   case SNRF_KEY_CRC:
     if (val == SNRF_CRC_DISABLED) nrf_disable_crc();
     else if (val == SNRF_CRC_8) nrf_enable_crc8();
-    else if (val == SNRF_CRC_16) nrf_enable_crc16();
-    else MAKE_COMPL_ERROR(msg, SNRF_ERR_VAL);
+    else nrf_enable_crc16();
     break ;
 
 #if (NRF_CONFIG_NRF24L01P == 1)
@@ -277,14 +480,7 @@ static void handle_set_msg(snrf_msg_t* msg)
 	NRF24L01P_RATE_1MBPS,
 	NRF24L01P_RATE_2MBPS
       };
-      if ((val == 0) || (val >= ARRAY_COUNT(map)))
-      {
-	MAKE_COMPL_ERROR(msg, SNRF_ERR_VAL);
-      }
-      else
-      {
-	nrf24l01p_set_rate(map[val]);
-      }
+      nrf24l01p_set_rate(map[val]);
       break ;
     }
 #endif
@@ -296,7 +492,7 @@ static void handle_set_msg(snrf_msg_t* msg)
 #endif
 
   case SNRF_KEY_ADDR_WIDTH:
-    if (nrf_set_addr_width(val)) MAKE_COMPL_ERROR(msg, SNRF_ERR_VAL);
+    nrf_set_addr_width(val);
     break ;
 
   case SNRF_KEY_RX_ADDR:
@@ -305,31 +501,100 @@ static void handle_set_msg(snrf_msg_t* msg)
 
   case SNRF_KEY_TX_ADDR:
     nrf_set_tx_addr((uint8_t*)&val);
+    tx_addr = val;
+    tx_addr_is_set = 1;
     break ;
 
   case SNRF_KEY_TX_ACK:
-    /* disable tx ack */
     if (val == 0) nrf_disable_tx_ack();
-    /* enable tx ack */
-    else if (val == 1) nrf_enable_tx_ack();
-    else MAKE_COMPL_ERROR(msg, SNRF_ERR_VAL);
+    else nrf_enable_tx_ack();
     break ;
 
   case SNRF_KEY_PAYLOAD_WIDTH:
-    if (val > SNRF_MAX_PAYLOAD_WIDTH) MAKE_COMPL_ERROR(msg, SNRF_ERR_VAL);
-    else nrf_set_payload_width((uint8_t)val);
+    nrf_set_payload_width((uint8_t)val);
     break ;
 
   case SNRF_KEY_UART_FLAGS:
     uart_flags = (uint8_t)val;
     break ;
 
+  case SNRF_KEY_UART_BAUD:
+    /* applied once the completion is sent */
+    uart_next_baud = val;
+    break ;
+
   default:
-    MAKE_COMPL_ERROR(msg, SNRF_ERR_KEY);
     break ;
   }
 }
 
+static void handle_set_msg(snrf_msg_t* msg)
+{
+  /* capture before modifying */
+  const uint8_t key = msg->u.set.key;
+  const uint32_t val = le_to_uint32(msg->u.set.val);
+  const uint8_t err = check_keyval(snrf_state, key, val);
+
+  if (err != SNRF_ERR_SUCCESS)
+  {
+    MAKE_COMPL_ERROR(msg, err);
+    return ;
+  }
+
+  apply_keyval(key, val);
+
+  MAKE_COMPL_ERROR(msg, SNRF_ERR_SUCCESS);
+}
+
+static void handle_set_multi_msg(snrf_msg_t* msg)
+{
+  /* all the pairs are checked before any is applied. a state */
+  /* pair applies to the pairs that follow it, so that a frame */
+  /* can switch to conf, configure, and switch back to txrx. */
+  /* the uart rate is only set alone, as the host switches too */
+
+  uint8_t state = snrf_state;
+  uint8_t err;
+  uint8_t i;
+
+  for (i = 0; i != SNRF_SET_MULTI_MAX; ++i)
+  {
+    if (msg->u.set_multi.pairs[i].key == SNRF_KEY_NONE) break ;
+
+    if (msg->u.set_multi.pairs[i].key == SNRF_KEY_UART_BAUD)
+      err = SNRF_ERR_VAL;
+    else err = check_keyval
+    (
+     state,
+     msg->u.set_multi.pairs[i].key,
+     le_to_uint32(msg->u.set_multi.pairs[i].val)
+    );
+
+    if (err != SNRF_ERR_SUCCESS)
+    {
+      MAKE_COMPL_ERROR(msg, err);
+      msg->u.compl.val = uint32_to_le(i);
+      return ;
+    }
+
+    if (msg->u.set_multi.pairs[i].key == SNRF_KEY_STATE)
+      state = (uint8_t)le_to_uint32(msg->u.set_multi.pairs[i].val);
+  }
+
+  for (i = 0; i != SNRF_SET_MULTI_MAX; ++i)
+  {
+    if (msg->u.set_multi.pairs[i].key == SNRF_KEY_NONE) break ;
+
+    apply_keyval
+    (
+     msg->u.set_multi.pairs[i].key,
+     le_to_uint32(msg->u.set_multi.pairs[i].val)
+    );
+  }
+
+  MAKE_COMPL_ERROR(msg, SNRF_ERR_SUCCESS);
+}
+
 static void handle_get_msg(snrf_msg_t* msg)
 {
   /* capture before modifying */
@@ -351,16 +616,16 @@ static void handle_get_msg(snrf_msg_t* msg)
   case SNRF_KEY_RATE:
     {
 #if (NRF_CONFIG_NRF24L01P == 1)
+      /* the SNRF_RATE_xxx value set, not the register bits */
       const uint8_t x = nrf24l01p_read_reg8(NRF24L01P_REG_RF_SETUP);
-      static const uint8_t map[] =
-      {
-	NRF24L01P_RATE_1MBPS,
-	NRF24L01P_RATE_2MBPS,
-	NRF24L01P_RATE_250KBPS,
-	NRF24L01P_RATE_250KBPS,
-	NRF24L01P_RATE_250KBPS
-      };
-      msg->u.compl.val = uint32_to_le(map[(x >> 3) & 5]);
+      uint8_t rate;
+      if ((x & NRF24L01P_RATE_MASK) == NRF24L01P_RATE_1MBPS)
+	rate = SNRF_RATE_1MBPS;
+      else if ((x & NRF24L01P_RATE_MASK) == NRF24L01P_RATE_2MBPS)
+	rate = SNRF_RATE_2MBPS;
+      else
+	rate = SNRF_RATE_250KBPS;
+      msg->u.compl.val = uint32_to_le(rate);
 #elif (NRF_CONFIG_NRF905 == 1)
       msg->u.compl.val = uint32_to_le(SNRF_RATE_50KBPS);
 #endif
@@ -400,6 +665,18 @@ static void handle_get_msg(snrf_msg_t* msg)
     msg->u.compl.val = uint32_to_le((uint32_t)uart_flags);
     break ;
 
+  case SNRF_KEY_UART_NCORRUPT:
+    cli();
+    msg->u.compl.val = uint32_to_le((uint32_t)uart_nskip + uart_ncrc);
+    sei();
+    break ;
+
+  case SNRF_KEY_UART_BAUD:
+    /* the host confirms the current rate */
+    probation_stop();
+    msg->u.compl.val = uint32_to_le(uart_baud);
+    break ;
+
   case SNRF_KEY_NRF_CHIPSET:
 #if (NRF_CONFIG_NRF24L01P == 1)
     msg->u.compl.val = uint32_to_le(SNRF_CHIPSET_NRF24L01P);
@@ -417,7 +694,10 @@ static void handle_get_msg(snrf_msg_t* msg)
 static void handle_payload_msg(snrf_msg_t* msg)
 {
   /* send the message */
-  /* msg size and payload width assumed equal */
+  /* the radio sends payload width bytes, the host only */
+  /* sends the used ones */
+
+  uint8_t i;
 
   if (snrf_state != SNRF_STATE_TXRX)
   {
@@ -425,6 +705,9 @@ static void handle_payload_msg(snrf_msg_t* msg)
     return ;
   }
 
+  for (i = msg->u.payload.size; i != SNRF_MAX_PAYLOAD_WIDTH; ++i)
+    msg->u.payload.data[i] = 0x2a;
+
 #if (NRF_CONFIG_NRF24L01P == 1)
 
   /* assumed was in rx mode */
@@ -447,6 +730,44 @@ static void handle_payload_msg(snrf_msg_t* msg)
   MAKE_COMPL_ERROR(msg, SNRF_ERR_SUCCESS);
 }
 
+static void handle_payload_to_msg(snrf_msg_t* msg)
+{
+  /* the address is programmed only if it changed, without */
+  /* leaving the txrx state */
+
+  uint32_t addr = le_to_uint32(msg->u.payload_to.addr);
+  const uint8_t size = msg->u.payload_to.size;
+  uint8_t i;
+
+  if (snrf_state != SNRF_STATE_TXRX)
+  {
+    MAKE_COMPL_ERROR(msg, SNRF_ERR_STATE);
+    return ;
+  }
+
+  if ((tx_addr_is_set == 0) || (addr != tx_addr))
+  {
+    nrf_set_tx_addr((uint8_t*)&addr);
+    tx_addr = addr;
+    tx_addr_is_set = 1;
+  }
+
+  /* move to the payload layout, data moves down */
+  for (i = 0; i != size; ++i)
+    msg->u.payload.data[i] = msg->u.payload_to.data[i];
+  msg->u.payload.size = size;
+
+  handle_payload_msg(msg);
+}
+
+static void handle_sync_msg(snrf_msg_t* msg)
+{
+  /* the op is kept, so that the host recognizes the answer */
+
+  msg->u.compl.err = SNRF_ERR_SUCCESS;
+  msg->u.compl.val = uint32_to_le(snrf_state);
+}
+
 static void handle_msg(snrf_msg_t* msg)
 {
   switch (msg->op)
@@ -455,6 +776,10 @@ static void handle_msg(snrf_msg_t* msg)
     handle_set_msg(msg);
     break ;
 
+  case SNRF_OP_SET_MULTI:
+    handle_set_multi_msg(msg);
+    break ;
+
   case SNRF_OP_GET:
     handle_get_msg(msg);
     break ;
@@ -463,6 +788,14 @@ static void handle_msg(snrf_msg_t* msg)
     handle_payload_msg(msg);
     break ;
 
+  case SNRF_OP_PAYLOAD_TO:
+    handle_payload_to_msg(msg);
+    break ;
+
+  case SNRF_OP_SYNC:
+    handle_sync_msg(msg);
+    break ;
+
   default:
     MAKE_COMPL_ERROR(msg, SNRF_ERR_OP);
     break ;
@@ -473,60 +806,73 @@ static uint8_t do_uart(void)
 {
   /* return 0 if no msg processed, 1 otherwise */
 
-  /* note: commands comming from the host always */
-  /* require a form of ack, which implies that */
-  /* there wont be a uart rx burst from the dev */
-  /* point of view. thus, this routine can be */
-  /* slow to handle message without missing */
-  /* bytes, until the reply is sent. */
+  /* note: the host never has more than SNRF_WINDOW_MAX */
+  /* messages in flight, each one requiring a completion */
+  /* before a new one is sent. thus, there is always a free */
+  /* slot for an incoming message and this routine can be */
+  /* slow to handle a message without missing bytes. */
 
   /* no need to disable interrupts. cf USART_RX_vect comment. */
-  const uint8_t pos = uart_pos;
+  const uint8_t tail = uart_tail;
 
-  uint8_t x;
+  uint8_t frame[SNRF_FRAME_SIZE_MAX];
+  volatile uint8_t* buf;
+  snrf_msg_t* msg;
+  uint8_t size;
+  uint8_t i;
 
-  if (pos != sizeof(snrf_msg_t))
+  if (uart_head != tail)
+  {
+    /* copy the frame and release the slot, so that the */
+    /* interrupt handler can fill it while the message is */
+    /* handled and the completion sent */
+    buf = uart_buf[tail & UART_SLOT_MASK];
+    size = uart_len[tail & UART_SLOT_MASK];
+    for (i = 0; i != size; ++i) frame[i] = buf[i];
+    uart_tail = tail + 1;
+  }
+  else if (uart_sync_len)
+  {
+    /* after the slots filled before it */
+    size = uart_sync_len;
+    for (i = 0; i != size; ++i) frame[i] = uart_sync_buf[i];
+    uart_sync_len = 0;
+  }
+  else
   {
     /* not a full message available */
     return 0;
   }
 
-  /* synchronization procedure */
-  if (uart_buf[offsetof(snrf_msg_t, sync)] == SNRF_SYNC_BYTE)
+  /* decoded in place, snrf_msg_t is packed */
+  msg = snrf_frame_decode_msg(frame, size);
+  if (msg == NULL)
   {
-    /* disable interrupts before setting uart_pos */
-    /* with interrupts disabled, wait for SYNC_END */
-    cli();
-    uart_pos = 0;
-    while (1)
-    {
-      /* do not stop on error during sync */
-      if (uart_read_uint8(&x)) continue ;
-      if (x == SNRF_SYNC_END) break ;
-    }
-    sei();
-
-    /* set state to conf */
-    if (snrf_state != SNRF_STATE_CONF)
-    {
-      snrf_state = SNRF_STATE_CONF;
-      nrf_set_powerdown_mode();
-    }
-
+    /* the host misses the completion and sends again */
+    ++uart_ncrc;
     return 1;
   }
 
-  /* handle new message */
-  handle_msg((snrf_msg_t*)uart_buf);
+  /* handle new message. seq is left untouched, so that */
+  /* the host can match the completion */
+  handle_msg(msg);
 
-  /* warning: set uart_pos to 0 before sending */
-  /* the reply, since the host will start sending */
-  /* new packets and we do not want the interrupt */
-  /* handler to see uart_buf full */
-  uart_pos = 0;
+  /* send completion. uart_write returns once its last byte */
+  /* has left the shift register */
+  write_msg(msg);
+
+  /* switch rate after the completion is sent */
+  if (uart_next_baud)
+  {
+    cli();
+    uart_switch_baud(uart_next_baud);
+    sei();
+
+    if (uart_next_baud == SNRF_UART_BAUD_DEFAULT) probation_stop();
+    else probation_start();
 
-  /* send completion */
-  uart_write((uint8_t*)uart_buf, sizeof(snrf_msg_t));
+    uart_next_baud = 0;
+  }
 
   /* a message has been handled */
   return 1;
@@ -562,6 +908,15 @@ int main(void)
     /* and entering the handler perturbates the execution */
     nrf_disable_rx_irq();
 
+    /* rate not confirmed by the host, restore the default */
+    if (uart_probation_expired)
+    {
+      probation_stop();
+      cli();
+      uart_switch_baud(SNRF_UART_BAUD_DEFAULT);
+      sei();
+    }
+
     /* alternate do_{uart,nrf} to avoid starvation */
     while (1)
     {
@@ -583,7 +938,7 @@ int main(void)
 
     cli();
 
-    if ((uart_pos == sizeof(snrf_msg_t)) || nrf_peek_rx_irq())
+    if ((uart_head != uart_tail) || uart_sync_len || nrf_peek_rx_irq())
     {
       /* continue, do not sleep */
       sei();
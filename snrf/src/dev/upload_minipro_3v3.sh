@@ -1,5 +1,8 @@
 #!/usr/bin/env sh
 
+# main.hex is not versioned, build it from main.c first
+make -f minipro_3v3.mk hex || exit 1
+
 ARDUINO_DIR=/home/texane/repo/arduino/arduino-1.0.5
 
 if [ -x $ARDUINO_DIR/hardware/tools/avrdude ]; then
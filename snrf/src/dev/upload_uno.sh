@@ -1,2 +1,6 @@
 #!/usr/bin/env sh
+
+# main.hex is not versioned, build it from main.c first
+make hex || exit 1
+
 /home/texane/repo/arduino/arduino-0022/hardware/tools/avrdude -C/home/texane/repo/arduino/arduino-0022/hardware/tools/avrdude.conf -v -v -v -v -patmega328p -cstk500v1 -P/dev/ttyACM0 -b115200 -D -Uflash:w:main.hex:i
@@ -0,0 +1,192 @@
+#ifndef BENCH_H_INCLUDED
+#define BENCH_H_INCLUDED
+
+
+/* shared by the bench_xxx programs. common options: */
+/* -d target a device path, "pty" for the emulator served on */
+/* a pty (default), "emu" for the in process emulator */
+/* -n count iterations, by default 10000 for rtt, 1000 for */
+/* payload and sync, 200 for latency */
+/* -b baud uart rate, negotiated at open, 1000000 by default. */
+/* the emulator takes the uart time, the defaults run in a */
+/* few seconds */
+/* -l limit regression threshold, meaning given by each bench */
+/* the result is printed as one json object. the exit status */
+/* is 1 if the limit is crossed */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include "snrf.h"
+#include "snrf_emu.h"
+
+
+#define PERROR()				\
+do {						\
+fprintf(stderr, "[!] %s, %u\n", __FILE__, __LINE__);	\
+} while (0)
+
+typedef struct bench
+{
+  const char* target;
+  size_t count;
+  uint32_t baud;
+  /* rate in effect once opened, the device may refuse baud */
+  uint32_t open_baud;
+  double limit;
+  unsigned int is_limit;
+
+  /* emulator configuration, defaults unless the bench sets it */
+  snrf_emu_conf_t emu_conf;
+  snrf_emu_t emu;
+  unsigned int is_pty;
+  snrf_handle_t snrf;
+} bench_t;
+
+static inline uint64_t bench_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static inline int bench_parse(bench_t* b, int ac, char** av, size_t count)
+{
+  int c;
+
+  b->target = "pty";
+  b->count = count;
+  b->baud = SNRF_UART_BAUD_1M;
+  b->open_baud = 0;
+  b->limit = 0.0;
+  b->is_limit = 0;
+  snrf_emu_init_conf(&b->emu_conf);
+
+  while ((c = getopt(ac, av, "d:n:b:l:")) != -1)
+  {
+    switch (c)
+    {
+    case 'd': b->target = optarg; break ;
+    case 'n': b->count = (size_t)strtoul(optarg, NULL, 0); break ;
+    case 'b': b->baud = (uint32_t)strtoul(optarg, NULL, 0); break ;
+    case 'l': b->limit = strtod(optarg, NULL); b->is_limit = 1; break ;
+    default: return -1;
+    }
+  }
+
+  if (b->count == 0) return -1;
+
+  return 0;
+}
+
+static inline unsigned int bench_is_emu(const bench_t* b)
+{
+  return (strcmp(b->target, "pty") == 0) || (strcmp(b->target, "emu") == 0);
+}
+
+static inline int bench_open(bench_t* b, snrf_conf_t* conf)
+{
+  /* conf initialized by the caller */
+
+  const char* path = b->target;
+
+  b->is_pty = 0;
+  conf->uart_baud = b->baud;
+
+  if (bench_is_emu(b))
+  {
+    snrf_emu_init(&b->emu, &b->emu_conf);
+
+    if (strcmp(b->target, "emu") == 0)
+    {
+      conf->transport = &snrf_emu_transport;
+      conf->transport_opaque = &b->emu;
+    }
+    else
+    {
+      if (snrf_emu_start_pty(&b->emu))
+      {
+	PERROR();
+	return -1;
+      }
+      b->is_pty = 1;
+      path = b->emu.pty_path;
+    }
+  }
+
+  if (snrf_open_with_conf(&b->snrf, path, conf))
+  {
+    PERROR();
+    if (b->is_pty) snrf_emu_stop_pty(&b->emu);
+    return -1;
+  }
+
+  b->open_baud = b->snrf.uart_baud;
+
+  return 0;
+}
+
+static inline void bench_close(bench_t* b)
+{
+  snrf_close(&b->snrf);
+  if (b->is_pty) snrf_emu_stop_pty(&b->emu);
+}
+
+static inline int cmp_uint64(const void* a, const void* b)
+{
+  const uint64_t x = *(const uint64_t*)a;
+  const uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static inline double bench_percentile_us(uint64_t* ns, size_t n, unsigned int permille)
+{
+  /* ns sorted in place */
+
+  size_t i;
+
+  if (n == 0) return 0.0;
+
+  qsort(ns, n, sizeof(uint64_t), cmp_uint64);
+  i = (n * permille) / 1000;
+  if (i >= n) i = n - 1;
+
+  return (double)ns[i] / 1000.0;
+}
+
+static inline void bench_print_begin(const bench_t* b, const char* name)
+{
+  printf("{\"bench\": \"%s\", \"target\": \"%s\", \"count\": %zu, "
+	 "\"baud\": %u, ",
+	 name, b->target, b->count, b->open_baud);
+}
+
+static inline void bench_print_lats(const char* name, uint64_t* ns, size_t n)
+{
+  /* json members, no separator after */
+
+  printf("\"%s_p50_us\": %.2f, \"%s_p99_us\": %.2f, \"%s_p999_us\": %.2f, "
+	 "\"%s_max_us\": %.2f",
+	 name, bench_percentile_us(ns, n, 500),
+	 name, bench_percentile_us(ns, n, 990),
+	 name, bench_percentile_us(ns, n, 999),
+	 name, bench_percentile_us(ns, n, 1000));
+}
+
+static inline int bench_print_end(const bench_t* b, unsigned int is_pass)
+{
+  /* return the exit status */
+
+  if (b->is_limit) printf(", \"limit\": %.2f", b->limit);
+  printf(", \"pass\": %s}\n", is_pass ? "true" : "false");
+
+  return is_pass ? 0 : 1;
+}
+
+
+#endif /* BENCH_H_INCLUDED */
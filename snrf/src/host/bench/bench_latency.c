@@ -0,0 +1,130 @@
+#include "bench.h"
+
+
+/* latency from the radio receiving a payload to the */
+/* application reading it, with the library defaults, then in */
+/* low latency mode. the emulator peers send the payloads, at */
+/* half the uart capacity, each starting with its air time. */
+/* -l the maximum low latency p99, in us */
+
+static int measure(bench_t* b, snrf_conf_t* conf, uint64_t* ns, unsigned int* applied)
+{
+  uint8_t data[SNRF_MAX_PAYLOAD_WIDTH];
+  uint64_t air_ns;
+  size_t size;
+  size_t i;
+  size_t j;
+
+  if (bench_open(b, conf))
+  {
+    PERROR();
+    return -1;
+  }
+
+  *applied = b->snrf.low_latency;
+
+  /* the peers start sending */
+  if (snrf_set_keyval(&b->snrf, SNRF_KEY_STATE, SNRF_STATE_TXRX))
+  {
+    PERROR();
+    goto on_error;
+  }
+
+  for (i = 0; i != b->count; ++i)
+  {
+    size = sizeof(data);
+    if (snrf_read_payload(&b->snrf, data, &size) || (size < sizeof(air_ns)))
+    {
+      PERROR();
+      goto on_error;
+    }
+
+    ns[i] = bench_now_ns();
+
+    air_ns = 0;
+    for (j = 0; j != sizeof(air_ns); ++j)
+      air_ns |= (uint64_t)data[j] << (j * 8);
+
+    ns[i] -= air_ns;
+  }
+
+  snrf_set_keyval(&b->snrf, SNRF_KEY_STATE, SNRF_STATE_CONF);
+  bench_close(b);
+
+  return 0;
+
+ on_error:
+  bench_close(b);
+  return -1;
+}
+
+int main(int ac, char** av)
+{
+  snrf_conf_t conf;
+  bench_t b;
+  uint64_t* default_ns;
+  uint64_t* low_ns;
+  unsigned int applied;
+  double p99;
+  int err = -1;
+
+  if (bench_parse(&b, ac, av, 200))
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  /* the air time is only known to the emulator. about 32 */
+  /* bytes a payload frame, 10 bits a byte */
+  if (bench_is_emu(&b) == 0)
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  b.emu_conf.is_loopback = 0;
+  b.emu_conf.is_peer_ns = 1;
+  b.emu_conf.rx_rate = b.baud / (2 * 32 * 10);
+  if (b.emu_conf.rx_rate == 0) b.emu_conf.rx_rate = 1;
+
+  default_ns = malloc(2 * b.count * sizeof(uint64_t));
+  if (default_ns == NULL)
+  {
+    PERROR();
+    goto on_error_0;
+  }
+  low_ns = default_ns + b.count;
+
+  snrf_init_conf(&conf);
+  if (measure(&b, &conf, default_ns, &applied))
+  {
+    PERROR();
+    goto on_error_1;
+  }
+
+  snrf_init_conf(&conf);
+  conf.low_latency = SNRF_LOW_LATENCY_ALL;
+  if (measure(&b, &conf, low_ns, &applied))
+  {
+    PERROR();
+    goto on_error_1;
+  }
+
+  bench_print_begin(&b, "latency");
+  printf("\"rx_rate\": %u, ", b.emu_conf.rx_rate);
+  bench_print_lats("default", default_ns, b.count);
+  printf(", ");
+  bench_print_lats("low_latency", low_ns, b.count);
+  printf(", \"serial\": %s, \"rt_reader\": %s, \"busy_poll\": %s",
+	 (applied & SNRF_LOW_LATENCY_SERIAL) ? "true" : "false",
+	 (applied & SNRF_LOW_LATENCY_RT_READER) ? "true" : "false",
+	 (applied & SNRF_LOW_LATENCY_BUSY_POLL) ? "true" : "false");
+
+  p99 = bench_percentile_us(low_ns, b.count, 990);
+  err = bench_print_end(&b, (b.is_limit == 0) || (p99 <= b.limit));
+
+ on_error_1:
+  free(default_ns);
+ on_error_0:
+  return err;
+}
@@ -0,0 +1,157 @@
+#include "bench.h"
+
+
+/* payloads per second. -l the minimum write rate, window 1 */
+
+static int write_payloads(bench_t* b, size_t window, double* pps)
+{
+  uint8_t buf[SNRF_MAX_PAYLOAD_WIDTH];
+  uint64_t ns;
+  size_t i;
+
+  if (snrf_set_window(&b->snrf, window))
+  {
+    PERROR();
+    return -1;
+  }
+
+  memset(buf, 0x2a, sizeof(buf));
+
+  ns = bench_now_ns();
+
+  for (i = 0; i != b->count; ++i)
+  {
+    buf[0] = (uint8_t)i;
+    if (snrf_write_payload(&b->snrf, buf, sizeof(buf)))
+    {
+      PERROR();
+      return -1;
+    }
+  }
+
+  if (snrf_flush_payloads(&b->snrf) || snrf_set_window(&b->snrf, 1))
+  {
+    PERROR();
+    return -1;
+  }
+
+  ns = bench_now_ns() - ns;
+  *pps = ((double)b->count * 1000000000.0) / (double)ns;
+
+  return 0;
+}
+
+static void drain_payloads(bench_t* b)
+{
+  /* the sync answer comes after the payloads in flight */
+
+  snrf_msg_t msg;
+
+  snrf_sync(&b->snrf);
+  while (snrf_get_pending_msg(&b->snrf, &msg) == 0) ;
+}
+
+static int echo_payloads(bench_t* b, double* pps)
+{
+  /* return -2 if nothing is received back, no loopback */
+
+  uint8_t buf[SNRF_MAX_PAYLOAD_WIDTH];
+  struct timespec deadline;
+  uint64_t ns;
+  size_t size;
+  size_t i;
+
+  memset(buf, 0x2a, sizeof(buf));
+
+  ns = bench_now_ns();
+
+  for (i = 0; i != b->count; ++i)
+  {
+    if (snrf_write_payload(&b->snrf, buf, sizeof(buf)))
+    {
+      PERROR();
+      return -1;
+    }
+
+    snrf_get_deadline(&deadline, 1000000);
+    size = sizeof(buf);
+    if (snrf_read_payload_until(&b->snrf, buf, &size, &deadline))
+    {
+      if (i == 0) return -2;
+      PERROR();
+      return -1;
+    }
+  }
+
+  ns = bench_now_ns() - ns;
+  *pps = ((double)b->count * 1000000000.0) / (double)ns;
+
+  return 0;
+}
+
+int main(int ac, char** av)
+{
+  snrf_conf_t conf;
+  bench_t b;
+  double write_pps;
+  double window_pps;
+  double echo_pps;
+  int err;
+
+  if (bench_parse(&b, ac, av, 1000))
+  {
+    PERROR();
+    return -1;
+  }
+
+  /* the payloads received back are not read while writing */
+  snrf_init_conf(&conf);
+  conf.payload_ring_size = 2 * b.count;
+
+  if (bench_open(&b, &conf))
+  {
+    PERROR();
+    return -1;
+  }
+
+  if (snrf_set_keyval(&b.snrf, SNRF_KEY_STATE, SNRF_STATE_TXRX))
+  {
+    PERROR();
+    goto on_error;
+  }
+
+  if (write_payloads(&b, 1, &write_pps))
+  {
+    PERROR();
+    goto on_error;
+  }
+
+  if (write_payloads(&b, SNRF_WINDOW_MAX, &window_pps))
+  {
+    PERROR();
+    goto on_error;
+  }
+
+  drain_payloads(&b);
+
+  err = echo_payloads(&b, &echo_pps);
+  if (err == -1)
+  {
+    PERROR();
+    goto on_error;
+  }
+
+  bench_print_begin(&b, "payload");
+  printf("\"write_pps\": %.1f, \"write_window_pps\": %.1f, ",
+	 write_pps, window_pps);
+  if (err == -2) printf("\"echo_pps\": null");
+  else printf("\"echo_pps\": %.1f", echo_pps);
+
+  bench_close(&b);
+
+  return bench_print_end(&b, (b.is_limit == 0) || (write_pps >= b.limit));
+
+ on_error:
+  bench_close(&b);
+  return -1;
+}
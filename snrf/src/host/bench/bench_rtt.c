@@ -0,0 +1,87 @@
+#include "bench.h"
+
+
+/* get and set round trip times. -l the maximum get p99, in us */
+
+static int measure(bench_t* b, uint8_t op, uint64_t* ns)
+{
+  uint64_t t;
+  uint32_t val;
+  size_t i;
+  int err;
+
+  for (i = 0; i != b->count; ++i)
+  {
+    t = bench_now_ns();
+
+    /* the state is never cached, each call is a round trip */
+    if (op == SNRF_OP_GET)
+      err = snrf_get_keyval(&b->snrf, SNRF_KEY_STATE, &val);
+    else
+      err = snrf_set_keyval(&b->snrf, SNRF_KEY_STATE, SNRF_STATE_CONF);
+
+    if (err)
+    {
+      PERROR();
+      return -1;
+    }
+
+    ns[i] = bench_now_ns() - t;
+  }
+
+  return 0;
+}
+
+int main(int ac, char** av)
+{
+  snrf_conf_t conf;
+  bench_t b;
+  uint64_t* get_ns;
+  uint64_t* set_ns;
+  double p99;
+  int err = -1;
+
+  if (bench_parse(&b, ac, av, 10000))
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  get_ns = malloc(2 * b.count * sizeof(uint64_t));
+  if (get_ns == NULL)
+  {
+    PERROR();
+    goto on_error_0;
+  }
+  set_ns = get_ns + b.count;
+
+  snrf_init_conf(&conf);
+  if (bench_open(&b, &conf))
+  {
+    PERROR();
+    goto on_error_1;
+  }
+
+  if (snrf_set_keyval(&b.snrf, SNRF_KEY_STATE, SNRF_STATE_CONF) ||
+      measure(&b, SNRF_OP_GET, get_ns) ||
+      measure(&b, SNRF_OP_SET, set_ns))
+  {
+    PERROR();
+    goto on_error_2;
+  }
+
+  bench_print_begin(&b, "rtt");
+  bench_print_lats("get", get_ns, b.count);
+  printf(", ");
+  bench_print_lats("set", set_ns, b.count);
+
+  p99 = bench_percentile_us(get_ns, b.count, 990);
+  err = bench_print_end(&b, (b.is_limit == 0) || (p99 <= b.limit));
+
+ on_error_2:
+  bench_close(&b);
+ on_error_1:
+  free(get_ns);
+ on_error_0:
+  return err;
+}
@@ -0,0 +1,61 @@
+#include "bench.h"
+
+
+/* resynchronization cost. -l the maximum p99, in us */
+
+int main(int ac, char** av)
+{
+  snrf_conf_t conf;
+  bench_t b;
+  uint64_t* ns;
+  uint64_t t;
+  double p99;
+  size_t i;
+  int err = -1;
+
+  if (bench_parse(&b, ac, av, 1000))
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  ns = malloc(b.count * sizeof(uint64_t));
+  if (ns == NULL)
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  snrf_init_conf(&conf);
+  if (bench_open(&b, &conf))
+  {
+    PERROR();
+    goto on_error_1;
+  }
+
+  for (i = 0; i != b.count; ++i)
+  {
+    t = bench_now_ns();
+
+    if (snrf_sync(&b.snrf))
+    {
+      PERROR();
+      goto on_error_2;
+    }
+
+    ns[i] = bench_now_ns() - t;
+  }
+
+  bench_print_begin(&b, "sync");
+  bench_print_lats("sync", ns, b.count);
+
+  p99 = bench_percentile_us(ns, b.count, 990);
+  err = bench_print_end(&b, (b.is_limit == 0) || (p99 <= b.limit));
+
+ on_error_2:
+  bench_close(&b);
+ on_error_1:
+  free(ns);
+ on_error_0:
+  return err;
+}
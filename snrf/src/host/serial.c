@@ -4,6 +4,10 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/serial.h>
 #include "serial.h"
 
 
@@ -32,11 +36,15 @@ static void invalid_handle(serial_handle_t* h)
 }
 
 
-static speed_t conf_to_speed_t(const serial_conf_t* c)
+static speed_t conf_to_speed_t(const serial_conf_t* c, unsigned int* is_custom)
 {
+  /* is_custom set if the rate has no speed_t constant. the */
+  /* returned value then uses B38400, cf. set_custom_bauds */
+
   speed_t s;
 
   s = 0;
+  *is_custom = 0;
 
 #define CONF_BAUDS_CASE(n) case n: s |= B ## n; break
 
@@ -60,9 +68,25 @@ static speed_t conf_to_speed_t(const serial_conf_t* c)
       CONF_BAUDS_CASE(38400);
       CONF_BAUDS_CASE(57600);
       CONF_BAUDS_CASE(115200);
+#ifdef B230400
+      CONF_BAUDS_CASE(230400);
+#endif
+#ifdef B460800
+      CONF_BAUDS_CASE(460800);
+#endif
+#ifdef B500000
+      CONF_BAUDS_CASE(500000);
+#endif
+#ifdef B921600
+      CONF_BAUDS_CASE(921600);
+#endif
+#ifdef B1000000
+      CONF_BAUDS_CASE(1000000);
+#endif
 
     default:
-      goto on_error;
+      *is_custom = 1;
+      s |= B38400;
       break;
     }
 
@@ -168,6 +192,79 @@ static int speed_t_to_conf(speed_t s, serial_conf_t* c)
 
 
 
+#if defined(__linux__) && defined(TCGETS2)
+
+/* struct termios2 from asm/termbits.h, which cannot be */
+/* included along with termios.h. TCGETS2 refers to it */
+
+struct termios2
+{
+  tcflag_t c_iflag;
+  tcflag_t c_oflag;
+  tcflag_t c_cflag;
+  tcflag_t c_lflag;
+  cc_t c_line;
+  cc_t c_cc[19];
+  speed_t c_ispeed;
+  speed_t c_ospeed;
+};
+
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+
+static int set_custom_bauds(serial_handle_t* h, unsigned int bauds)
+{
+  struct termios2 termios2;
+
+  if (ioctl(h->fd, TCGETS2, &termios2) == -1)
+    {
+      DEBUG_ERROR("ioctl(TCGETS2) == %u\n", errno);
+      return -1;
+    }
+
+  termios2.c_cflag &= ~CBAUD;
+  termios2.c_cflag |= BOTHER;
+  termios2.c_ispeed = bauds;
+  termios2.c_ospeed = bauds;
+
+  if (ioctl(h->fd, TCSETS2, &termios2) == -1)
+    {
+      DEBUG_ERROR("ioctl(TCSETS2) == %u\n", errno);
+      return -1;
+    }
+
+  return 0;
+}
+
+#else
+
+static int set_custom_bauds(serial_handle_t* h, unsigned int bauds)
+{
+  DEBUG_ERROR("custom bauds not supported\n");
+  return -1;
+}
+
+#endif /* TCGETS2 */
+
+
+static int wait_writable(serial_handle_t* h)
+{
+  struct pollfd pfd;
+
+  pfd.fd = h->fd;
+  pfd.events = POLLOUT;
+
+  if (poll(&pfd, 1, -1) == -1)
+    {
+      DEBUG_ERROR("poll() == %u\n", errno);
+      return -1;
+    }
+
+  return 0;
+}
+
+
 /* exported
  */
 
@@ -245,11 +342,12 @@ int serial_flush_txrx(serial_handle_t* serial)
 int serial_set_conf(serial_handle_t* h, const serial_conf_t* c)
 {
   struct termios termios;
+  unsigned int is_custom;
 
 #if 1
   memset(&termios, 0, sizeof(struct termios));
   cfmakeraw(&termios);
-  if (!(termios.c_cflag = conf_to_speed_t(c)))
+  if (!(termios.c_cflag = conf_to_speed_t(c, &is_custom)))
     {
       DEBUG_ERROR("conf_to_speed_t()\n");
       goto on_error;
@@ -276,6 +374,12 @@ int serial_set_conf(serial_handle_t* h, const serial_conf_t* c)
       goto on_error;
     }
 
+  if (is_custom && set_custom_bauds(h, c->bauds))
+    {
+      DEBUG_ERROR("set_custom_bauds()\n");
+      goto on_error;
+    }
+
   return 0;
 
  on_error:
@@ -358,6 +462,9 @@ int serial_readn(serial_handle_t* h, void* buf, size_t size)
 
 int serial_writen(serial_handle_t* h, const void* buf, size_t size)
 {
+  /* bytes are queued in the tty, use serial_drain to wait */
+  /* for them to be transmitted */
+
   ssize_t n;
 
   while (size)
@@ -365,19 +472,44 @@ int serial_writen(serial_handle_t* h, const void* buf, size_t size)
     n = write(h->fd, buf, size);
     if (n < 0)
     {
+      if ((errno == EAGAIN) && (wait_writable(h) == 0)) continue ;
       perror("write()\n");
       return -1;
     }
-    else if (n)
+
+    size -= n;
+    buf = (unsigned char*)buf + n;
+  }
+
+  return 0;
+}
+
+
+int serial_writev(serial_handle_t* h, struct iovec* iov, int count)
+{
+  /* write all the buffers with as few syscalls as possible */
+  /* warning: iov contents are modified */
+
+  ssize_t n;
+
+  while (count)
+  {
+    n = writev(h->fd, iov, count);
+    if (n < 0)
     {
-      if (tcdrain(h->fd))
-      {
-	DEBUG_ERROR();
-	return -1;
-      }
+      if ((errno == EAGAIN) && (wait_writable(h) == 0)) continue ;
+      perror("writev()\n");
+      return -1;
+    }
 
-      size -= n;
-      buf = (unsigned char*)buf + n;
+    /* skip the buffers completely written */
+    for (; count && ((size_t)n >= iov->iov_len); ++iov, --count)
+      n -= iov->iov_len;
+
+    if (count)
+    {
+      iov->iov_base = (unsigned char*)iov->iov_base + n;
+      iov->iov_len -= n;
     }
   }
 
@@ -385,6 +517,28 @@ int serial_writen(serial_handle_t* h, const void* buf, size_t size)
 }
 
 
+int serial_writev_nowait
+(serial_handle_t* h, const struct iovec* iov, int count, size_t* nwritten)
+{
+  /* write what the tty accepts without blocking */
+
+  ssize_t n;
+
+  *nwritten = 0;
+
+  n = writev(h->fd, iov, count);
+  if (n == -1)
+  {
+    if (errno == EAGAIN) return 0;
+    DEBUG_ERROR("writev() == %u\n", errno);
+    return -1;
+  }
+
+  *nwritten = n;
+
+  return 0;
+}
+
 int serial_write
 (serial_handle_t* h, const void* buf, size_t size, size_t* nwritten)
 {
@@ -399,18 +553,133 @@ int serial_write
     return -1;
   }
 
+  *nwritten = n;
+
+  return 0;
+}
+
+
+int serial_drain(serial_handle_t* h)
+{
+  /* wait for the written bytes to be transmitted */
+
   if (tcdrain(h->fd))
   {
-    DEBUG_ERROR();
+    DEBUG_ERROR("tcdrain() == %u\n", errno);
     return -1;
   }
 
-  *nwritten = n;
+  return 0;
+}
+
+
+int serial_set_low_latency
+(serial_handle_t* h, unsigned int is_enabled, unsigned int* was_enabled)
+{
+  /* ASYNC_LOW_LATENCY, the driver pushes the received bytes */
+  /* at once. fails on ports without it, as ptys */
+
+  struct serial_struct ss;
+
+  if (ioctl(h->fd, TIOCGSERIAL, &ss) == -1)
+  {
+    DEBUG_ERROR("ioctl(TIOCGSERIAL) == %u\n", errno);
+    return -1;
+  }
+
+  if (was_enabled != NULL) *was_enabled = ((ss.flags & ASYNC_LOW_LATENCY) != 0);
+
+  if (is_enabled) ss.flags |= ASYNC_LOW_LATENCY;
+  else ss.flags &= ~ASYNC_LOW_LATENCY;
+
+  if (ioctl(h->fd, TIOCSSERIAL, &ss) == -1)
+  {
+    DEBUG_ERROR("ioctl(TIOCSSERIAL) == %u\n", errno);
+    return -1;
+  }
 
   return 0;
 }
 
 
+static int get_latency_timer_path(serial_handle_t* h, char* path, size_t size)
+{
+  /* usb serial adapters buffering the input, as ftdi_sio, */
+  /* expose their timer in the sysfs directory of the tty */
+
+  char fd_path[32];
+  char dev_path[256];
+  const char* name;
+  ssize_t n;
+
+  snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", h->fd);
+
+  n = readlink(fd_path, dev_path, sizeof(dev_path) - 1);
+  if (n <= 0) return -1;
+  dev_path[n] = 0;
+
+  name = strrchr(dev_path, '/');
+  name = (name == NULL) ? dev_path : name + 1;
+
+  n = snprintf(path, size, "/sys/class/tty/%s/device/latency_timer", name);
+  if ((n < 0) || ((size_t)n >= size)) return -1;
+
+  return access(path, R_OK | W_OK);
+}
+
+int serial_get_latency_timer(serial_handle_t* h, unsigned int* ms)
+{
+  char path[128];
+  char buf[16];
+  ssize_t n;
+  int fd;
+
+  if (get_latency_timer_path(h, path, sizeof(path))) return -1;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1) return -1;
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+
+  if (n <= 0) return -1;
+  buf[n] = 0;
+  *ms = (unsigned int)strtoul(buf, NULL, 10);
+
+  return 0;
+}
+
+int serial_set_latency_timer(serial_handle_t* h, unsigned int ms)
+{
+  /* in milliseconds, the ftdi default is 16 */
+
+  char path[128];
+  char buf[16];
+  ssize_t n;
+  int len;
+  int fd;
+
+  if (get_latency_timer_path(h, path, sizeof(path))) return -1;
+
+  fd = open(path, O_WRONLY);
+  if (fd == -1)
+  {
+    DEBUG_ERROR("open() == %u\n", errno);
+    return -1;
+  }
+
+  len = snprintf(buf, sizeof(buf), "%u\n", ms);
+  n = write(fd, buf, (size_t)len);
+  close(fd);
+
+  if (n != (ssize_t)len)
+  {
+    DEBUG_ERROR("write() == %u\n", errno);
+    return -1;
+  }
+
+  return 0;
+}
+
 #if  CONFIG_SERIAL_DEBUG
 
 void serial_print(serial_handle_t* h)
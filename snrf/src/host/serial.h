@@ -4,6 +4,7 @@
 
 
 #include <stdlib.h>
+#include <sys/uio.h>
 
 
 
@@ -62,7 +63,13 @@ int serial_read(serial_handle_t*, void*, size_t, size_t*);
 int serial_readn(serial_handle_t*, void*, size_t);
 int serial_write(serial_handle_t*, const void*, size_t, size_t*);
 int serial_writen(serial_handle_t*, const void*, size_t);
+int serial_writev(serial_handle_t*, struct iovec*, int);
+int serial_writev_nowait(serial_handle_t*, const struct iovec*, int, size_t*);
+int serial_drain(serial_handle_t*);
 int serial_flush_txrx(serial_handle_t*);
+int serial_set_low_latency(serial_handle_t*, unsigned int, unsigned int*);
+int serial_get_latency_timer(serial_handle_t*, unsigned int*);
+int serial_set_latency_timer(serial_handle_t*, unsigned int);
 
 #if CONFIG_SERIAL_DEBUG
 void serial_print(serial_handle_t*);
@@ -1,10 +1,18 @@
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
-#include <sys/select.h>
-#include <sys/time.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "snrf.h"
 #include "snrf_common.h"
 #include "serial.h"
@@ -26,27 +34,583 @@ if (!(__x)) printf("[!] %s, %u\n", __FILE__, __LINE__);	\
 #endif
 
 
-int snrf_open_with_path(snrf_handle_t* snrf, const char* path)
+/* monotonic time helpers */
+
+static inline void get_now(struct timespec* ts)
+{
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static inline uint64_t get_now_ns(void)
+{
+  struct timespec ts;
+  get_now(&ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static inline int64_t diff_ns(const struct timespec* a, const struct timespec* b)
+{
+  /* return a - b, in nanoseconds */
+  return (int64_t)(a->tv_sec - b->tv_sec) * 1000000000 + (a->tv_nsec - b->tv_nsec);
+}
+
+static void add_ns(struct timespec* ts, uint64_t ns)
+{
+  ns += ts->tv_nsec;
+  ts->tv_sec += ns / 1000000000;
+  ts->tv_nsec = ns % 1000000000;
+}
+
+void snrf_get_deadline(struct timespec* deadline, unsigned int us)
+{
+  /* absolute CLOCK_MONOTONIC deadline, us microseconds from now */
+  get_now(deadline);
+  add_ns(deadline, (uint64_t)us * 1000);
+}
+
+
+static size_t round_pow2(size_t x)
+{
+  size_t n;
+  for (n = 1; n < x; n <<= 1) ;
+  return n;
+}
+
+static void ring_init
+(snrf_ring_t* ring, snrf_msg_t* msgs, uint64_t* ns, size_t size)
+{
+  ring->msgs = msgs;
+  ring->ns = ns;
+  ring->size = size;
+  ring->head = 0;
+  ring->tail = 0;
+  ring->noverflow = 0;
+  ring->hwm = 0;
+}
+
+static inline size_t ring_count(const snrf_ring_t* ring)
+{
+  return ring->head - ring->tail;
+}
+
+static inline snrf_msg_t* ring_slot(snrf_ring_t* ring)
+{
+  /* the slot ring_commit adds, NULL if the ring is full */
+  if (ring_count(ring) == ring->size) return NULL;
+  return &ring->msgs[ring->head & (ring->size - 1)];
+}
+
+static inline void ring_commit(snrf_ring_t* ring, uint64_t ns)
+{
+  if (ring->ns != NULL) ring->ns[ring->head & (ring->size - 1)] = ns;
+  ++ring->head;
+  if (ring_count(ring) > ring->hwm) ring->hwm = ring_count(ring);
+}
+
+static int ring_put(snrf_ring_t* ring, const snrf_msg_t* msg, uint64_t ns)
+{
+  snrf_msg_t* const slot = ring_slot(ring);
+
+  if (slot == NULL)
+  {
+    ++ring->noverflow;
+    return -1;
+  }
+
+  memcpy(slot, msg, sizeof(snrf_msg_t));
+  ring_commit(ring, ns);
+
+  return 0;
+}
+
+static snrf_msg_t* ring_peek(snrf_ring_t* ring)
+{
+  /* the slot is not reused until ring_release */
+  if (ring_count(ring) == 0) return NULL;
+  return &ring->msgs[ring->tail & (ring->size - 1)];
+}
+
+static inline uint64_t ring_peek_ns(const snrf_ring_t* ring)
+{
+  /* receive time of the ring_peek message */
+  return ring->ns[ring->tail & (ring->size - 1)];
+}
+
+static inline void ring_release(snrf_ring_t* ring)
+{
+  ++ring->tail;
+}
+
+static int ring_get(snrf_ring_t* ring, snrf_msg_t* msg)
+{
+  if (ring_count(ring) == 0) return -1;
+
+  memcpy(msg, &ring->msgs[ring->tail & (ring->size - 1)], sizeof(snrf_msg_t));
+  ++ring->tail;
+
+  return 0;
+}
+
+
+/* metrics */
+
+static unsigned int hist_index(uint64_t x)
+{
+  unsigned int e;
+
+  if (x < (1 << SNRF_HIST_SUB_BITS)) return (unsigned int)x;
+
+  /* position of the highest bit, then the next SUB_BITS ones */
+  e = 63 - (unsigned int)__builtin_clzll(x);
+  if (e >= SNRF_HIST_MAX_BITS) return SNRF_HIST_BUCKET_COUNT - 1;
+
+  return ((e - SNRF_HIST_SUB_BITS + 1) << SNRF_HIST_SUB_BITS) |
+    (unsigned int)((x >> (e - SNRF_HIST_SUB_BITS)) &
+		   ((1 << SNRF_HIST_SUB_BITS) - 1));
+}
+
+static uint64_t hist_upper(unsigned int i)
+{
+  /* highest value of bucket i */
+
+  const unsigned int sub = i & ((1 << SNRF_HIST_SUB_BITS) - 1);
+  unsigned int shift;
+
+  if (i < (1 << SNRF_HIST_SUB_BITS)) return i;
+
+  shift = (i >> SNRF_HIST_SUB_BITS) - 1;
+  return ((((uint64_t)1 << SNRF_HIST_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+static void hist_add(snrf_hist_t* h, uint64_t x)
+{
+  ++h->counts[hist_index(x)];
+  if ((h->count == 0) || (x < h->min)) h->min = x;
+  if (x > h->max) h->max = x;
+  h->sum += x;
+  ++h->count;
+}
+
+static void hist_add_since(snrf_hist_t* h, const struct timespec* start)
+{
+  struct timespec now;
+  get_now(&now);
+  hist_add(h, (uint64_t)diff_ns(&now, start));
+}
+
+uint64_t snrf_hist_percentile(const snrf_hist_t* h, double q)
+{
+  /* value below which q percent of the samples are, */
+  /* within the bucket precision */
+
+  uint64_t target;
+  uint64_t n = 0;
+  uint64_t x;
+  unsigned int i;
+
+  if (h->count == 0) return 0;
+
+  target = (uint64_t)((q / 100.0) * (double)h->count + 0.5);
+  if (target == 0) target = 1;
+  if (target > h->count) target = h->count;
+
+  for (i = 0; i != SNRF_HIST_BUCKET_COUNT; ++i)
+  {
+    n += h->counts[i];
+    if (n >= target) break ;
+  }
+
+  x = hist_upper(i);
+  if (x > h->max) x = h->max;
+  if (x < h->min) x = h->min;
+  return x;
+}
+
+void snrf_get_stats(snrf_handle_t* snrf, snrf_stats_t* stats)
+{
+  /* counters owned by the reader thread are loosely read */
+
+  memcpy(stats, &snrf->stats, sizeof(snrf_stats_t));
+
+  stats->ncorrupt = __atomic_load_n(&snrf->rx_ncorrupt, __ATOMIC_RELAXED);
+  stats->ndrop = snrf->msg_ndrop;
+  stats->noverflow =
+    snrf->payload_ring.noverflow + snrf->compl_ring.noverflow +
+    snrf->debug_ring.noverflow +
+    __atomic_load_n(&snrf->reader_ring.noverflow, __ATOMIC_RELAXED);
+
+  stats->payload_ring_hwm = snrf->payload_ring.hwm;
+  stats->compl_ring_hwm = snrf->compl_ring.hwm;
+  stats->debug_ring_hwm = snrf->debug_ring.hwm;
+}
+
+void snrf_reset_stats(snrf_handle_t* snrf)
+{
+  /* ncorrupt, ndrop and noverflow keep counting since open */
+
+  memset(&snrf->stats, 0, sizeof(snrf_stats_t));
+  snrf->is_payload_tm = 0;
+
+  snrf->payload_ring.hwm = ring_count(&snrf->payload_ring);
+  snrf->compl_ring.hwm = ring_count(&snrf->compl_ring);
+  snrf->debug_ring.hwm = ring_count(&snrf->debug_ring);
+}
+
+
+/* serial port transport */
+
+static int poll_read(int, const struct timespec*);
+
+static int serial_tr_read(void* opaque, void* buf, size_t size, size_t* nread)
+{
+  if (serial_read(opaque, buf, size, nread))
+  {
+    *nread = 0;
+    if (errno == EAGAIN) return 0;
+    SNRF_PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+static int serial_tr_writev(void* opaque, struct iovec* iov, int count)
+{
+  return serial_writev(opaque, iov, count);
+}
+
+static int serial_tr_writev_nowait
+(void* opaque, const struct iovec* iov, int count, size_t* nwritten)
+{
+  return serial_writev_nowait(opaque, iov, count, nwritten);
+}
+
+static int serial_tr_wait(void* opaque, const struct timespec* deadline)
+{
+  return poll_read(serial_get_fd(opaque), deadline);
+}
+
+static int serial_tr_set_bauds(void* opaque, uint32_t bauds)
+{
+  serial_conf_t conf = { 9600, 8, SERIAL_PARITY_DISABLED, 1 };
+
+  conf.bauds = bauds;
+
+  /* complete the transmission at the previous rate */
+  if (serial_drain(opaque))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  if (serial_set_conf(opaque, &conf))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  if (serial_flush_txrx(opaque))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+static int serial_tr_get_fd(void* opaque)
+{
+  return serial_get_fd(opaque);
+}
+
+static void serial_tr_close(void* opaque)
+{
+  serial_close(opaque);
+}
+
+static const snrf_transport_ops_t serial_transport =
+{
+  serial_tr_read,
+  serial_tr_writev,
+  serial_tr_writev_nowait,
+  serial_tr_wait,
+  serial_tr_set_bauds,
+  serial_tr_get_fd,
+  serial_tr_close
+};
+
+static void set_serial_low_latency(snrf_handle_t* snrf)
+{
+  /* SNRF_LOW_LATENCY_SERIAL is in effect if either setting is. */
+  /* ptys have neither */
+
+  unsigned int is_timer = 0;
+  unsigned int ms;
+
+  if (serial_set_low_latency(&snrf->serial, 1, &snrf->was_async_low_latency) == 0)
+    snrf->is_async_low_latency = 1;
+
+  if (serial_get_latency_timer(&snrf->serial, &ms) == 0)
+  {
+    if (ms <= 1)
+    {
+      is_timer = 1;
+    }
+    else if (serial_set_latency_timer(&snrf->serial, 1) == 0)
+    {
+      snrf->latency_timer = (int)ms;
+      is_timer = 1;
+    }
+  }
+
+  if (snrf->is_async_low_latency || is_timer)
+    snrf->low_latency |= SNRF_LOW_LATENCY_SERIAL;
+}
+
+static void reset_serial_low_latency(snrf_handle_t* snrf)
+{
+  /* the settings outlive the fd, leave them as found */
+
+  if (snrf->is_async_low_latency && (snrf->was_async_low_latency == 0))
+    serial_set_low_latency(&snrf->serial, 0, NULL);
+
+  if (snrf->latency_timer != -1)
+    serial_set_latency_timer(&snrf->serial, (unsigned int)snrf->latency_timer);
+
+  snrf->is_async_low_latency = 0;
+  snrf->latency_timer = -1;
+}
+
+/* handles that locked the process memory */
+static pthread_mutex_t mlock_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t mlock_count = 0;
+
+static void lock_memory(snrf_handle_t* snrf)
+{
+  /* no page fault on the input path. best effort */
+
+  pthread_mutex_lock(&mlock_mutex);
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+  {
+    snrf->is_mlock = 1;
+    ++mlock_count;
+  }
+  pthread_mutex_unlock(&mlock_mutex);
+}
+
+static void unlock_memory(snrf_handle_t* snrf)
+{
+  /* once the last handle that locked it is closed */
+
+  if (snrf->is_mlock == 0) return ;
+
+  pthread_mutex_lock(&mlock_mutex);
+  if ((--mlock_count) == 0) munlockall();
+  pthread_mutex_unlock(&mlock_mutex);
+
+  snrf->is_mlock = 0;
+}
+
+static int set_serial_bauds(snrf_handle_t* snrf, uint32_t bauds)
+{
+  /* bytes received at the previous rate are dropped */
+
+  if (snrf->tr_ops->set_bauds(snrf->tr_opaque, bauds))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  snrf->rx_size = 0;
+  snrf->uart_baud = bauds;
+
+  return 0;
+}
+
+void snrf_init_conf(snrf_conf_t* conf)
 {
-  static const serial_conf_t conf = { 9600, 8, SERIAL_PARITY_DISABLED, 1 };
+  conf->payload_ring_size = 256;
+  conf->compl_ring_size = 16;
+  conf->debug_ring_size = 16;
+  conf->uart_baud = SNRF_UART_BAUD_DEFAULT;
+  conf->flush_policy = SNRF_FLUSH_IMMEDIATE;
+  conf->flush_us = 1000;
+  conf->reader_ring_size = 0;
+  conf->is_submit = 0;
+  conf->trace_path = NULL;
+  conf->trace_count = 65536;
+  conf->capture_path = NULL;
+  conf->transport = NULL;
+  conf->transport_opaque = NULL;
+  conf->low_latency = 0;
+  conf->reader_cpu = -1;
+  conf->reader_prio = 50;
+}
+
+/* reader and writer threads, cf. below */
+static int reader_start(snrf_handle_t*);
+static void reader_stop(snrf_handle_t*);
+static int writer_start(snrf_handle_t*);
+static void writer_stop(snrf_handle_t*);
+
+int snrf_open_with_conf
+(snrf_handle_t* snrf, const char* path, const snrf_conf_t* conf)
+{
+  snrf_conf_t default_conf;
+  size_t payload_size;
+  size_t compl_size;
+  size_t debug_size;
+  size_t reader_size;
+  snrf_msg_t* msgs;
+  uint64_t* ns;
+
+  if (conf == NULL)
+  {
+    snrf_init_conf(&default_conf);
+    conf = &default_conf;
+  }
 
-  if (serial_open(&snrf->serial, path))
+  /* all the rings share a single allocation, starting with */
+  /* the payload times */
+  payload_size = round_pow2(conf->payload_ring_size);
+  compl_size = round_pow2(conf->compl_ring_size);
+  debug_size = round_pow2(conf->debug_ring_size);
+  ns = malloc(payload_size * sizeof(uint64_t) +
+	      (payload_size + compl_size + debug_size) * sizeof(snrf_msg_t));
+  if (ns == NULL)
   {
     SNRF_PERROR();
     goto on_error_0;
   }
 
-  if (serial_set_conf(&snrf->serial, &conf))
+  msgs = (snrf_msg_t*)(ns + payload_size);
+  ring_init(&snrf->payload_ring, msgs, ns, payload_size);
+  msgs += payload_size;
+  ring_init(&snrf->compl_ring, msgs, NULL, compl_size);
+  msgs += compl_size;
+  ring_init(&snrf->debug_ring, msgs, NULL, debug_size);
+
+  /* the writer thread relies on the reader one */
+  reader_size = conf->reader_ring_size;
+  if (conf->is_submit && (reader_size == 0)) reader_size = payload_size;
+  if ((conf->low_latency & SNRF_LOW_LATENCY_RT_READER) && (reader_size == 0) &&
+      ((conf->transport == NULL) ||
+       (conf->transport->get_fd(conf->transport_opaque) != -1)))
+    reader_size = payload_size;
+
+  /* shared with the reader thread, on its own cache lines. */
+  /* the times come first, as above */
+  memset(&snrf->reader_ring, 0, sizeof(snrf->reader_ring));
+  if (reader_size)
+  {
+    snrf->reader_ring.size = round_pow2(reader_size);
+    if (posix_memalign((void**)&snrf->reader_ring.ns, SNRF_CACHE_LINE_SIZE,
+		       snrf->reader_ring.size *
+		       (sizeof(uint64_t) + sizeof(snrf_msg_t))))
+    {
+      SNRF_PERROR();
+      goto on_error_1;
+    }
+    snrf->reader_ring.msgs =
+      (snrf_msg_t*)(snrf->reader_ring.ns + snrf->reader_ring.size);
+  }
+
+  if (conf->transport != NULL)
+  {
+    snrf->tr_ops = conf->transport;
+    snrf->tr_opaque = conf->transport_opaque;
+  }
+  else if (serial_open(&snrf->serial, path))
   {
     SNRF_PERROR();
-    goto on_error_1;
+    goto on_error_2;
+  }
+  else
+  {
+    snrf->tr_ops = &serial_transport;
+    snrf->tr_opaque = &snrf->serial;
+  }
+
+  /* on a single cpu, spinning delays what it waits for */
+  snrf->low_latency = 0;
+  if ((conf->low_latency & SNRF_LOW_LATENCY_BUSY_POLL) &&
+      (sysconf(_SC_NPROCESSORS_ONLN) > 1))
+    snrf->low_latency |= SNRF_LOW_LATENCY_BUSY_POLL;
+  snrf->is_async_low_latency = 0;
+  snrf->latency_timer = -1;
+  if ((conf->low_latency & SNRF_LOW_LATENCY_SERIAL) &&
+      (snrf->tr_ops == &serial_transport))
+    set_serial_low_latency(snrf);
+
+  snrf->reader_prio = 0;
+  snrf->reader_cpu = -1;
+  snrf->is_mlock = 0;
+  if (conf->low_latency & SNRF_LOW_LATENCY_RT_READER)
+  {
+    snrf->reader_prio = conf->reader_prio;
+    snrf->reader_cpu = conf->reader_cpu;
+    lock_memory(snrf);
+  }
+
+  /* before any message, so that the open exchanges are traced */
+  snrf->is_trace = 0;
+  snrf->is_capture = 0;
+  if (conf->trace_path != NULL)
+  {
+    if (snrf_trace_create(&snrf->trace, conf->trace_path, conf->trace_count))
+    {
+      SNRF_PERROR();
+      goto on_error_3;
+    }
+    snrf->is_trace = 1;
+  }
+
+  if (conf->capture_path != NULL)
+  {
+    if (snrf_pcap_create(&snrf->capture, conf->capture_path))
+    {
+      SNRF_PERROR();
+      goto on_error_3;
+    }
+    snrf->is_capture = 1;
   }
 
   /* initialize before using messages */
-  snrf->msg_head = NULL;
-  snrf->msg_tail = NULL;
+  snrf->msg_ndrop = 0;
+  snrf->conf_mask = 0;
+  snrf->is_reader = 0;
+  snrf->is_submit = 0;
+
+  snrf->tx_count = 0;
+  snrf->tx_off = 0;
+  snrf->flush_policy = conf->flush_policy;
+  snrf->flush_us = conf->flush_us;
+
+  snrf->rx_size = 0;
+  snrf->rx_skip = 0;
+  snrf->rx_ncorrupt = 0;
+
+  snrf->sync_seq = 0;
+  snrf->sync_done = 0;
+  snrf->sync_count = 0;
+  snrf->sync_last_ns = 0;
+  snrf->sync_max_ns = 0;
+
+  memset(&snrf->stats, 0, sizeof(snrf->stats));
+  snrf->is_payload_tm = 0;
+
+  if (set_serial_bauds(snrf, SNRF_UART_BAUD_DEFAULT))
+  {
+    SNRF_PERROR();
+    goto on_error_3;
+  }
+
+  snrf->seq = 0;
 
-  snrf->msg_rpos = 0;
+  memset(snrf->window, 0, sizeof(snrf->window));
+  snrf->window_size = 1;
+  snrf->window_count = 0;
+  snrf->window_err = 0;
 
   if (snrf_get_keyval(snrf, SNRF_KEY_STATE, &snrf->state))
   {
@@ -56,18 +620,51 @@ int snrf_open_with_path(snrf_handle_t* snrf, const char* path)
     if (snrf_get_keyval(snrf, SNRF_KEY_STATE, &snrf->state))
     {
       SNRF_PERROR();
-      goto on_error_1;
+      goto on_error_3;
     }
   }
 
+  if (conf->uart_baud != snrf->uart_baud)
+  {
+    /* on failure, keep going at the default rate */
+    snrf_set_uart_baud(snrf, conf->uart_baud);
+  }
+
+  /* is_submit is constant while the reader thread runs */
+  if (conf->is_submit && writer_start(snrf))
+  {
+    SNRF_PERROR();
+    goto on_error_3;
+  }
+
+  if (reader_size && reader_start(snrf))
+  {
+    SNRF_PERROR();
+    if (snrf->is_submit) writer_stop(snrf);
+    goto on_error_3;
+  }
+
   return 0;
 
+ on_error_3:
+  if (snrf->is_capture) snrf_pcap_close(&snrf->capture);
+  if (snrf->is_trace) snrf_trace_close(&snrf->trace);
+  unlock_memory(snrf);
+  reset_serial_low_latency(snrf);
+  snrf->tr_ops->close(snrf->tr_opaque);
+ on_error_2:
+  free(snrf->reader_ring.ns);
  on_error_1:
-  snrf_close(snrf);
+  free(snrf->payload_ring.ns);
  on_error_0:
   return -1;
 }
 
+int snrf_open_with_path(snrf_handle_t* snrf, const char* path)
+{
+  return snrf_open_with_conf(snrf, path, NULL);
+}
+
 int snrf_open(snrf_handle_t* snrf)
 {
   return snrf_open_with_path(snrf, "/dev/ttyUSB0");
@@ -75,7 +672,22 @@ int snrf_open(snrf_handle_t* snrf)
 
 int snrf_close(snrf_handle_t* snrf)
 {
-  serial_close(&snrf->serial);
+  if (snrf->is_reader) reader_stop(snrf);
+  if (snrf->is_submit) writer_stop(snrf);
+
+  if (snrf->uart_baud != SNRF_UART_BAUD_DEFAULT)
+  {
+    /* leave the device at the default rate for the next user */
+    snrf_set_uart_baud(snrf, SNRF_UART_BAUD_DEFAULT);
+  }
+
+  if (snrf->is_capture) snrf_pcap_close(&snrf->capture);
+  if (snrf->is_trace) snrf_trace_close(&snrf->trace);
+  unlock_memory(snrf);
+  reset_serial_low_latency(snrf);
+  snrf->tr_ops->close(snrf->tr_opaque);
+  free(snrf->reader_ring.ns);
+  free(snrf->payload_ring.ns);
   return 0;
 }
 
@@ -89,209 +701,1883 @@ static inline uint32_t le_to_uint32(uint32_t x)
   return x;
 }
 
-static int write_msg(snrf_handle_t* snrf, snrf_msg_t* msg)
+static int get_tx_iov(snrf_handle_t* snrf, struct iovec* iov)
 {
-  if (serial_writen(&snrf->serial, (const void*)msg, sizeof(*msg)))
+  /* return the count of queued frames. the first one starts */
+  /* after the bytes already written */
+
+  size_t i;
+
+  for (i = 0; i != snrf->tx_count; ++i)
+  {
+    iov[i].iov_base = (void*)snrf->tx_frames[i];
+    iov[i].iov_len = snrf->tx_sizes[i];
+  }
+
+  if (i)
+  {
+    iov[0].iov_base = (uint8_t*)iov[0].iov_base + snrf->tx_off;
+    iov[0].iov_len -= snrf->tx_off;
+  }
+
+  return (int)i;
+}
+
+static int flush_tx(snrf_handle_t* snrf)
+{
+  /* send all the queued frames, do not wait for them */
+  /* to be transmitted */
+
+  struct iovec iov[SNRF_TX_MSG_COUNT];
+  const int count = get_tx_iov(snrf, iov);
+
+  snrf->tx_count = 0;
+  snrf->tx_off = 0;
+
+  if (count == 0) return 0;
+
+  if (snrf->tr_ops->writev(snrf->tr_opaque, iov, count))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+int snrf_flush_nowait(snrf_handle_t* snrf)
+{
+  /* send the queued frames the tty accepts without blocking */
+  /* return -2 if some are left, wait for the fd to be writable */
+
+  struct iovec iov[SNRF_TX_MSG_COUNT];
+  const int count = get_tx_iov(snrf, iov);
+  size_t nwritten;
+  size_t i;
+
+  if (count == 0) return 0;
+
+  if (snrf->tr_ops->writev_nowait(snrf->tr_opaque, iov, count, &nwritten))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  /* remove the frames completely written */
+  nwritten += snrf->tx_off;
+  for (i = 0; (i != snrf->tx_count) && (nwritten >= snrf->tx_sizes[i]); ++i)
+    nwritten -= snrf->tx_sizes[i];
+
+  snrf->tx_count -= i;
+  snrf->tx_off = nwritten;
+
+  if (snrf->tx_count == 0) return 0;
+
+  memmove(snrf->tx_frames[0], snrf->tx_frames[i],
+	  snrf->tx_count * sizeof(snrf->tx_frames[0]));
+  memmove(snrf->tx_sizes, snrf->tx_sizes + i,
+	  snrf->tx_count * sizeof(snrf->tx_sizes[0]));
+
+  return -2;
+}
+
+static inline void record_msg
+(snrf_handle_t* snrf, uint8_t dir, const snrf_msg_t* msg)
+{
+  /* trace and capture a frame, msg NULL if corrupted */
+
+  uint8_t size;
+
+  if ((snrf->is_trace | snrf->is_capture) == 0) return ;
+
+  size = (msg == NULL) ? 0 : snrf_msg_size(msg);
+
+  if (snrf->is_trace) snrf_trace_msg(&snrf->trace, dir, msg, size);
+
+  /* a corrupted frame has no message to capture */
+  if (snrf->is_capture && (msg != NULL))
+    snrf_pcap_write(&snrf->capture, dir, msg, size);
+}
+
+static void queue_tx(snrf_handle_t* snrf, const snrf_msg_t* msg)
+{
+  /* the queue must not be full */
+
+  snrf->tx_sizes[snrf->tx_count] =
+    snrf_frame_encode_msg(snrf->tx_frames[snrf->tx_count], msg);
+  record_msg(snrf, SNRF_TRACE_TX, msg);
+  if ((snrf->tx_count++) == 0) get_now(&snrf->tx_tm);
+  if (snrf->tx_count > snrf->stats.tx_hwm) snrf->stats.tx_hwm = snrf->tx_count;
+}
+
+static int write_msg(snrf_handle_t* snrf, const snrf_msg_t* msg)
+{
+  /* queue msg, then flush according to the policy. in any */
+  /* case, queued messages are flushed before waiting input */
+
+  struct timespec now;
+
+  if ((snrf->tx_count == SNRF_TX_MSG_COUNT) && flush_tx(snrf))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  queue_tx(snrf, msg);
+
+  switch (snrf->flush_policy)
+  {
+  case SNRF_FLUSH_LATENCY:
+    get_now(&now);
+    if (diff_ns(&now, &snrf->tx_tm) < ((int64_t)snrf->flush_us * 1000)) break ;
+    return flush_tx(snrf);
+
+  case SNRF_FLUSH_EXPLICIT:
+    break ;
+
+  case SNRF_FLUSH_IMMEDIATE:
+  default:
+    return flush_tx(snrf);
+  }
+
+  return 0;
+}
+
+static int poll_read(int fd, const struct timespec* deadline)
+{
+  /* deadline the absolute CLOCK_MONOTONIC deadline, or NULL */
+  /* return 1 if readable, 0 if deadline reached, -1 on error */
+
+  struct pollfd pfd;
+  struct timespec now;
+  struct timespec tm;
+  struct timespec* p;
+  int64_t ns;
+  int err;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  while (1)
+  {
+    p = NULL;
+
+    if (deadline != NULL)
+    {
+      get_now(&now);
+      ns = diff_ns(deadline, &now);
+      if (ns < 0) ns = 0;
+      tm.tv_sec = ns / 1000000000;
+      tm.tv_nsec = ns % 1000000000;
+      p = &tm;
+    }
+
+    err = ppoll(&pfd, 1, p, NULL);
+    if ((err == -1) && (errno == EINTR)) continue ;
+
+    return err;
+  }
+}
+
+static void next_seq(snrf_handle_t* snrf, snrf_msg_t* msg)
+{
+  /* 0 is reserved for device originated messages */
+  if ((++snrf->seq) == 0) snrf->seq = 1;
+  msg->seq = snrf->seq;
+}
+
+int snrf_post_msg(snrf_handle_t* snrf, snrf_msg_t* msg)
+{
+  /* queue msg with a new sequence number, never block. the */
+  /* frame is sent by snrf_flush_nowait, its completion read */
+  /* by snrf_read_msg. return -2 if the queue is full */
+
+  if (snrf->tx_count == SNRF_TX_MSG_COUNT) return -2;
+
+  next_seq(snrf, msg);
+  queue_tx(snrf, msg);
+
+  return 0;
+}
+
+static unsigned int retire_compl(snrf_handle_t* snrf, const snrf_msg_t* msg)
+{
+  /* return 1 if msg completes a windowed message, 0 otherwise */
+
+  snrf_window_entry_t* const w = snrf->window;
+  size_t i;
+
+  for (i = 0; i != SNRF_WINDOW_MAX; ++i)
+  {
+    if (w[i].is_used == 0) continue ;
+    if (w[i].msg.seq != msg->seq) continue ;
+
+    if (msg->u.compl.err != SNRF_ERR_SUCCESS) snrf->window_err = 1;
+    if (w[i].status != NULL) *w[i].status = msg->u.compl.err;
+
+    w[i].is_used = 0;
+    --snrf->window_count;
+
+    return 1;
+  }
+
+  return 0;
+}
+
+static void count_payload(snrf_handle_t* snrf)
+{
+  struct timespec now;
+
+  get_now(&now);
+  if (snrf->is_payload_tm)
+    hist_add(&snrf->stats.payload_gap, (uint64_t)diff_ns(&now, &snrf->payload_tm));
+  snrf->payload_tm = now;
+  snrf->is_payload_tm = 1;
+}
+
+static void dispatch_msg
+(snrf_handle_t* snrf, const snrf_msg_t* msg, uint64_t ns)
+{
+  /* put msg in the ring of its op class. ns its receive time */
+
+  snrf_ring_t* ring;
+
+  switch (msg->op)
+  {
+  case SNRF_OP_PAYLOAD:
+    count_payload(snrf);
+    ring = &snrf->payload_ring;
+    break ;
+
+  case SNRF_OP_COMPL:
+    if (retire_compl(snrf, msg)) return ;
+    ring = &snrf->compl_ring;
+    break ;
+
+  case SNRF_OP_DEBUG:
+    ring = &snrf->debug_ring;
+    break ;
+
+  case SNRF_OP_SYNC:
+    /* answer to a previous request, dropped */
+    if (msg->seq != snrf->sync_seq)
+    {
+      ++snrf->msg_ndrop;
+      return ;
+    }
+    snrf->state = le_to_uint32(msg->u.compl.val);
+    snrf->sync_done = 1;
+    return ;
+
+  default:
+    ++snrf->msg_ndrop;
+    return ;
+  }
+
+  ring_put(ring, msg, ns);
+}
+
+static snrf_msg_t* spsc_slot(snrf_spsc_t* q)
+{
+  /* producer only. the slot spsc_commit publishes, NULL if */
+  /* the ring is full */
+
+  const size_t head = q->head;
+
+  if ((head - q->tail_cache) == q->size)
+  {
+    q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+    if ((head - q->tail_cache) == q->size) return NULL;
+  }
+
+  return &q->msgs[head & (q->size - 1)];
+}
+
+static inline void spsc_commit(snrf_spsc_t* q, uint64_t ns)
+{
+  q->ns[q->head & (q->size - 1)] = ns;
+  __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+}
+
+static void spsc_put(snrf_spsc_t* q, const snrf_msg_t* msg, uint64_t ns)
+{
+  /* producer only */
+
+  snrf_msg_t* const slot = spsc_slot(q);
+
+  if (slot == NULL)
+  {
+    ++q->noverflow;
+    return ;
+  }
+
+  *slot = *msg;
+  spsc_commit(q, ns);
+}
+
+static int spsc_get(snrf_spsc_t* q, snrf_msg_t* msg, uint64_t* ns)
+{
+  /* consumer only, return -1 if empty */
+
+  const size_t tail = q->tail;
+
+  if (tail == q->head_cache)
+  {
+    q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    if (tail == q->head_cache) return -1;
+  }
+
+  *msg = q->msgs[tail & (q->size - 1)];
+  *ns = q->ns[tail & (q->size - 1)];
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+static inline void futex_wait(uint32_t* p, uint32_t x)
+{
+  syscall(SYS_futex, p, FUTEX_WAIT_PRIVATE, x, NULL, NULL, 0);
+}
+
+static inline void futex_wake(uint32_t* p)
+{
+  syscall(SYS_futex, p, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void wake_writer(snrf_handle_t* snrf)
+{
+  /* only if the writer thread sleeps, cf. writer_main */
+
+  const uint64_t one = 1;
+  ssize_t nwritten;
+
+  if (__atomic_exchange_n(&snrf->writer_is_idle, 0, __ATOMIC_SEQ_CST))
+  {
+    nwritten = write(snrf->writer_evfd, &one, sizeof(one));
+    (void)nwritten;
+  }
+}
+
+static void finish_submit(snrf_submit_t* sub, int err)
+{
+  /* the submitter may return and free sub once is_done set */
+
+  sub->err = err;
+  __atomic_store_n(&sub->is_done, 1, __ATOMIC_RELEASE);
+  futex_wake(&sub->is_done);
+}
+
+static unsigned int complete_submit(snrf_handle_t* snrf, const snrf_msg_t* msg)
+{
+  /* reader thread. return 1 if msg completes a submission */
+
+  snrf_submit_t* sub;
+
+  if (msg->op != SNRF_OP_COMPL) return 0;
+
+  /* the writer thread may take it back on timeout */
+  sub = __atomic_exchange_n(&snrf->submit_seq[msg->seq], NULL, __ATOMIC_ACQ_REL);
+  if (sub == NULL) return 0;
+
+  sub->msg = *msg;
+  finish_submit(sub, 0);
+
+  /* a window slot is available */
+  wake_writer(snrf);
+
+  return 1;
+}
+
+static snrf_msg_t* get_rx_slot(snrf_handle_t* snrf, const uint8_t* frame)
+{
+  /* the ring slot a frame is decoded to, so that it is not */
+  /* copied again. NULL if it goes through dispatch_msg. the */
+  /* op is the first cobs block, unless it is 0x00 */
+
+  if (snrf->is_reader) return spsc_slot(&snrf->reader_ring);
+
+  if ((frame[0] != 1) && (frame[1] == SNRF_OP_PAYLOAD))
+    return ring_slot(&snrf->payload_ring);
+
+  return NULL;
+}
+
+static int fill_rx(snrf_handle_t* snrf)
+{
+  /* read as many bytes as available, dispatch all the */
+  /* complete frames. return -2 if nothing available */
+
+  snrf_msg_t frame;
+  snrf_msg_t* slot;
+  const snrf_msg_t* msg;
+  uint8_t body_size;
+  uint8_t* buf;
+  uint8_t* delim;
+  uint64_t ns;
+  size_t size;
+  size_t nread;
+  size_t n;
+
+  if (snrf->tr_ops->read(snrf->tr_opaque, snrf->rx_buf + snrf->rx_size,
+			SNRF_RX_BUF_SIZE - snrf->rx_size, &nread))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  if (nread == 0) return -2;
+
+  /* receive time of the frames completed by this read */
+  ns = get_now_ns();
+
+  buf = snrf->rx_buf;
+  size = snrf->rx_size + nread;
+
+  while ((delim = memchr(buf, SNRF_FRAME_DELIM, size)) != NULL)
+  {
+    n = (size_t)(delim - buf);
+
+    if (snrf->rx_skip)
+    {
+      /* end of a dropped frame, realigned */
+      snrf->rx_skip = 0;
+      ++snrf->rx_ncorrupt;
+      record_msg(snrf, SNRF_TRACE_RX_CORRUPT, NULL);
+    }
+    else if (n == 0)
+    {
+      /* empty frame, used to terminate a partial one */
+    }
+    else if (n >= SNRF_FRAME_SIZE_MAX)
+    {
+      ++snrf->rx_ncorrupt;
+      record_msg(snrf, SNRF_TRACE_RX_CORRUPT, NULL);
+    }
+    else
+    {
+      /* decoded out of rx_buf, it may be shorter than a msg */
+      slot = get_rx_slot(snrf, buf);
+      msg = (slot == NULL) ? &frame : slot;
+      body_size = snrf_frame_decode_to
+	((uint8_t*)msg, buf, (uint8_t)n, sizeof(snrf_msg_t));
+      if (body_size) msg = snrf_msg_from_body((uint8_t*)msg, body_size);
+      else msg = NULL;
+      record_msg(snrf, (msg == NULL) ? SNRF_TRACE_RX_CORRUPT : SNRF_TRACE_RX, msg);
+      if (msg == NULL) ++snrf->rx_ncorrupt;
+      else if (snrf->is_submit && complete_submit(snrf, msg)) ;
+      else if (snrf->is_reader)
+      {
+	if (slot == NULL) spsc_put(&snrf->reader_ring, msg, ns);
+	else spsc_commit(&snrf->reader_ring, ns);
+      }
+      else if (slot == NULL) dispatch_msg(snrf, msg, ns);
+      else
+      {
+	count_payload(snrf);
+	ring_commit(&snrf->payload_ring, ns);
+      }
+    }
+
+    buf += n + 1;
+    size -= n + 1;
+  }
+
+  /* no delimiter in a frame worth of bytes, drop up to the next */
+  if (size >= SNRF_FRAME_SIZE_MAX)
+  {
+    snrf->rx_skip = 1;
+    size = 0;
+  }
+
+  /* keep the partial frame for the next read */
+  memmove(snrf->rx_buf, buf, size);
+  snrf->rx_size = size;
+
+  return 0;
+}
+
+
+/* reader thread */
+
+static void* reader_main(void* arg)
+{
+  /* drain the fd as soon as bytes arrive, so that the tty */
+  /* buffer never fills while the application is busy */
+
+  snrf_handle_t* const snrf = arg;
+  const uint64_t one = 1;
+  struct pollfd pfds[2];
+  ssize_t nwritten;
+  size_t head;
+  int err;
+
+  pfds[0].fd = snrf->tr_ops->get_fd(snrf->tr_opaque);
+  pfds[0].events = POLLIN;
+  pfds[1].fd = snrf->reader_stopfd;
+  pfds[1].events = POLLIN;
+
+  while (1)
+  {
+    if (__atomic_load_n(&snrf->is_reader_spin, __ATOMIC_RELAXED))
+      err = poll(pfds, 2, 0);
+    else
+      err = poll(pfds, 2, -1);
+
+    if (err == -1)
+    {
+      if (errno == EINTR) continue ;
+      SNRF_PERROR();
+      break ;
+    }
+
+    if (err == 0) continue ;
+
+    if (pfds[1].revents) return NULL;
+
+    if (pfds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+    {
+      SNRF_PERROR();
+      break ;
+    }
+
+    head = snrf->reader_ring.head;
+
+    if (fill_rx(snrf) == -1)
+    {
+      SNRF_PERROR();
+      break ;
+    }
+
+    /* one wakeup per read, not per message */
+    if (snrf->reader_ring.head != head)
+      nwritten = write(snrf->reader_evfd, &one, sizeof(one));
+  }
+
+  /* wake the application so that it sees the error */
+  __atomic_store_n(&snrf->reader_err, 1, __ATOMIC_RELEASE);
+  nwritten = write(snrf->reader_evfd, &one, sizeof(one));
+  (void)nwritten;
+
+  return NULL;
+}
+
+static size_t drain_reader(snrf_handle_t* snrf)
+{
+  /* dispatch the messages queued by the reader thread, in the */
+  /* application thread. return their count. no syscall */
+
+  snrf_msg_t msg;
+  uint64_t ns;
+  size_t n;
+
+  for (n = 0; spsc_get(&snrf->reader_ring, &msg, &ns) == 0; ++n)
+    dispatch_msg(snrf, &msg, ns);
+
+  if (n > snrf->stats.reader_ring_hwm) snrf->stats.reader_ring_hwm = n;
+
+  return n;
+}
+
+static void clear_reader_evfd(snrf_handle_t* snrf)
+{
+  /* a message queued after a drain leaves the counter set: */
+  /* the next wait returns at once, no wakeup is lost */
+
+  uint64_t x;
+  ssize_t nread;
+
+  nread = read(snrf->reader_evfd, &x, sizeof(x));
+  (void)nread;
+}
+
+static void set_reader_rt(snrf_handle_t* snrf)
+{
+  /* SNRF_LOW_LATENCY_RT_READER is in effect if SCHED_FIFO is, */
+  /* which needs CAP_SYS_NICE or an RLIMIT_RTPRIO */
+
+  struct sched_param sp;
+  cpu_set_t set;
+
+  snrf->low_latency &= ~SNRF_LOW_LATENCY_RT_READER;
+
+  if (snrf->reader_cpu != -1)
+  {
+    CPU_ZERO(&set);
+    CPU_SET(snrf->reader_cpu, &set);
+    pthread_setaffinity_np(snrf->reader_thread, sizeof(set), &set);
+  }
+
+  sp.sched_priority = snrf->reader_prio;
+  if (pthread_setschedparam(snrf->reader_thread, SCHED_FIFO, &sp) == 0)
+    snrf->low_latency |= SNRF_LOW_LATENCY_RT_READER;
+}
+
+static int reader_start(snrf_handle_t* snrf)
+{
+  if (snrf->tr_ops->get_fd(snrf->tr_opaque) == -1)
+  {
+    SNRF_PERROR();
+    goto on_error_0;
+  }
+
+  snrf->reader_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (snrf->reader_evfd == -1)
+  {
+    SNRF_PERROR();
+    goto on_error_0;
+  }
+
+  snrf->reader_stopfd = eventfd(0, EFD_CLOEXEC);
+  if (snrf->reader_stopfd == -1)
+  {
+    SNRF_PERROR();
+    goto on_error_1;
+  }
+
+  snrf->reader_err = 0;
+  snrf->is_reader = 1;
+  snrf->is_reader_spin = 0;
+
+  if (pthread_create(&snrf->reader_thread, NULL, reader_main, snrf))
+  {
+    SNRF_PERROR();
+    goto on_error_2;
+  }
+
+  if (snrf->reader_prio) set_reader_rt(snrf);
+
+  /* a SCHED_FIFO thread spinning on a shared cpu starves it */
+  if ((snrf->low_latency & SNRF_LOW_LATENCY_BUSY_POLL) &&
+      (((snrf->low_latency & SNRF_LOW_LATENCY_RT_READER) == 0) ||
+       (snrf->reader_cpu != -1)))
+    __atomic_store_n(&snrf->is_reader_spin, 1, __ATOMIC_RELAXED);
+
+  return 0;
+
+ on_error_2:
+  snrf->is_reader = 0;
+  close(snrf->reader_stopfd);
+ on_error_1:
+  close(snrf->reader_evfd);
+ on_error_0:
+  return -1;
+}
+
+static void reader_stop(snrf_handle_t* snrf)
+{
+  /* the queued messages are dispatched, the bytes of a */
+  /* partial frame are kept in rx_buf */
+
+  const uint64_t one = 1;
+  ssize_t nwritten;
+
+  nwritten = write(snrf->reader_stopfd, &one, sizeof(one));
+  (void)nwritten;
+  pthread_join(snrf->reader_thread, NULL);
+
+  snrf->is_reader = 0;
+  drain_reader(snrf);
+
+  close(snrf->reader_stopfd);
+  close(snrf->reader_evfd);
+}
+
+
+/* submission queue and writer thread */
+
+static void submit_push(snrf_handle_t* snrf, snrf_submit_t* sub)
+{
+  /* any thread, lock free */
+
+  snrf_submit_t* prev;
+
+  sub->next = NULL;
+  prev = __atomic_exchange_n(&snrf->submit_head, sub, __ATOMIC_ACQ_REL);
+  __atomic_store_n(&prev->next, sub, __ATOMIC_RELEASE);
+}
+
+static snrf_submit_t* submit_pop(snrf_handle_t* snrf)
+{
+  /* writer thread only. return NULL if empty, or if a */
+  /* producer is in the middle of a push */
+
+  snrf_submit_t* tail = snrf->submit_tail;
+  snrf_submit_t* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+  if (tail == &snrf->submit_stub)
+  {
+    if (next == NULL) return NULL;
+    snrf->submit_tail = next;
+    tail = next;
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  }
+
+  if (next != NULL)
+  {
+    snrf->submit_tail = next;
+    return tail;
+  }
+
+  if (tail != __atomic_load_n(&snrf->submit_head, __ATOMIC_ACQUIRE))
+    return NULL;
+
+  /* last one, put the stub back behind it */
+  submit_push(snrf, &snrf->submit_stub);
+
+  next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+  if (next == NULL) return NULL;
+
+  snrf->submit_tail = next;
+  return tail;
+}
+
+static int send_submit
+(snrf_handle_t* snrf, snrf_submit_t* sub, snrf_submit_slot_t* slot)
+{
+  /* writer thread. queue sub with a new seq, the frame is */
+  /* written with the others by flush_tx */
+
+  if (sub->ntries == 3)
+  {
+    finish_submit(sub, -1);
+    return -1;
+  }
+
+  ++sub->ntries;
+
+  next_seq(snrf, &sub->msg);
+  __atomic_store_n(&snrf->submit_seq[sub->msg.seq], sub, __ATOMIC_RELEASE);
+  queue_tx(snrf, &sub->msg);
+
+  slot->seq = sub->msg.seq;
+  snrf_get_deadline(&slot->deadline, SNRF_COMPL_MS * 1000);
+  slot->is_used = 1;
+
+  return 0;
+}
+
+static unsigned int is_writer_idle(snrf_handle_t* snrf)
+{
+  /* no completion to retire, and no room or no submission */
+
+  const snrf_submit_slot_t* const slots = snrf->submit_slots;
+  unsigned int is_full = 1;
+  size_t i;
+
+  for (i = 0; i != SNRF_WINDOW_MAX; ++i)
+  {
+    if (slots[i].is_used == 0)
+    {
+      is_full = 0;
+      continue ;
+    }
+
+    if (__atomic_load_n(&snrf->submit_seq[slots[i].seq], __ATOMIC_SEQ_CST) == NULL)
+      return 0;
+  }
+
+  if (is_full) return 1;
+
+  return __atomic_load_n(&snrf->submit_head, __ATOMIC_SEQ_CST) == snrf->submit_tail;
+}
+
+static void* writer_main(void* arg)
+{
+  /* pop submissions while the device window has room, write */
+  /* them with as few syscalls as possible, and resend the */
+  /* ones not completed in time */
+
+  snrf_handle_t* const snrf = arg;
+  snrf_submit_slot_t* const slots = snrf->submit_slots;
+  const struct timespec* deadline;
+  struct timespec now;
+  snrf_submit_t* sub;
+  uint64_t x;
+  ssize_t nread;
+  size_t i;
+
+  while (__atomic_load_n(&snrf->writer_is_done, __ATOMIC_ACQUIRE) == 0)
+  {
+    get_now(&now);
+
+    for (i = 0; i != SNRF_WINDOW_MAX; ++i)
+    {
+      if (slots[i].is_used == 0) continue ;
+
+      /* completed by the reader thread */
+      if (__atomic_load_n(&snrf->submit_seq[slots[i].seq], __ATOMIC_ACQUIRE) == NULL)
+      {
+	slots[i].is_used = 0;
+	continue ;
+      }
+
+      if (diff_ns(&slots[i].deadline, &now) > 0) continue ;
+
+      /* timed out, unless the completion races with us */
+      slots[i].is_used = 0;
+      sub = __atomic_exchange_n
+	(&snrf->submit_seq[slots[i].seq], NULL, __ATOMIC_ACQ_REL);
+      if (sub != NULL) send_submit(snrf, sub, &slots[i]);
+    }
+
+    for (i = 0; i != SNRF_WINDOW_MAX; ++i)
+    {
+      if (slots[i].is_used) continue ;
+      sub = submit_pop(snrf);
+      if (sub == NULL) break ;
+      sub->ntries = 0;
+      send_submit(snrf, sub, &slots[i]);
+    }
+
+    if (snrf->tx_count && flush_tx(snrf))
+    {
+      SNRF_PERROR();
+    }
+
+    /* sleep unless there is work left. the flag is set before */
+    /* checking, producers and the reader thread exchange it */
+    /* after their update, so that no wakeup is lost */
+    __atomic_store_n(&snrf->writer_is_idle, 1, __ATOMIC_SEQ_CST);
+
+    if (is_writer_idle(snrf))
+    {
+      /* until the nearest completion deadline */
+      deadline = NULL;
+      for (i = 0; i != SNRF_WINDOW_MAX; ++i)
+      {
+	if (slots[i].is_used == 0) continue ;
+	if ((deadline == NULL) || (diff_ns(&slots[i].deadline, deadline) < 0))
+	  deadline = &slots[i].deadline;
+      }
+
+      poll_read(snrf->writer_evfd, deadline);
+      nread = read(snrf->writer_evfd, &x, sizeof(x));
+      (void)nread;
+    }
+
+    __atomic_store_n(&snrf->writer_is_idle, 0, __ATOMIC_SEQ_CST);
+  }
+
+  return NULL;
+}
+
+static int writer_start(snrf_handle_t* snrf)
+{
+  snrf->writer_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (snrf->writer_evfd == -1)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  snrf->submit_stub.next = NULL;
+  snrf->submit_head = &snrf->submit_stub;
+  snrf->submit_tail = &snrf->submit_stub;
+  memset(snrf->submit_seq, 0, sizeof(snrf->submit_seq));
+  memset(snrf->submit_slots, 0, sizeof(snrf->submit_slots));
+  snrf->writer_is_idle = 0;
+  snrf->writer_is_done = 0;
+  snrf->is_submit = 1;
+
+  if (pthread_create(&snrf->writer_thread, NULL, writer_main, snrf))
+  {
+    SNRF_PERROR();
+    snrf->is_submit = 0;
+    close(snrf->writer_evfd);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void writer_stop(snrf_handle_t* snrf)
+{
+  /* the submissions left fail */
+
+  const uint64_t one = 1;
+  snrf_submit_t* sub;
+  ssize_t nwritten;
+  size_t i;
+
+  __atomic_store_n(&snrf->writer_is_done, 1, __ATOMIC_RELEASE);
+  nwritten = write(snrf->writer_evfd, &one, sizeof(one));
+  (void)nwritten;
+  pthread_join(snrf->writer_thread, NULL);
+
+  for (i = 0; i != 256; ++i)
+  {
+    sub = __atomic_exchange_n(&snrf->submit_seq[i], NULL, __ATOMIC_ACQ_REL);
+    if (sub != NULL) finish_submit(sub, -1);
+  }
+
+  while ((sub = submit_pop(snrf)) != NULL) finish_submit(sub, -1);
+
+  snrf->is_submit = 0;
+  close(snrf->writer_evfd);
+}
+
+int snrf_submit(snrf_handle_t* snrf, snrf_msg_t* msg)
+{
+  /* thread safe. queue msg for the writer thread, then wait */
+  /* for its completion, returned in msg */
+
+  snrf_submit_t sub;
+
+  sub.msg = *msg;
+  sub.is_done = 0;
+
+  submit_push(snrf, &sub);
+  wake_writer(snrf);
+
+  while (__atomic_load_n(&sub.is_done, __ATOMIC_ACQUIRE) == 0)
+    futex_wait(&sub.is_done, 0);
+
+  if (sub.err)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  *msg = sub.msg;
+
+  return 0;
+}
+
+static int spin_reader(snrf_handle_t* snrf, const struct timespec* deadline)
+{
+  /* wait_reader without sleeping, no syscall until the reader */
+  /* thread queues a message. reader_evfd is left set */
+
+  struct timespec start;
+  struct timespec now;
+
+  get_now(&start);
+
+  while (1)
+  {
+    if (drain_reader(snrf)) break ;
+
+    if (__atomic_load_n(&snrf->reader_err, __ATOMIC_ACQUIRE))
+    {
+      SNRF_PERROR();
+      return -1;
+    }
+
+    get_now(&now);
+    if ((deadline != NULL) && (diff_ns(deadline, &now) <= 0))
+    {
+      hist_add_since(&snrf->stats.read_wait, &start);
+      return -2;
+    }
+  }
+
+  hist_add_since(&snrf->stats.read_wait, &start);
+
+  return 0;
+}
+
+static int busy_wait(snrf_handle_t* snrf, const struct timespec* deadline)
+{
+  /* tr_ops->wait without sleeping, polled with an expired */
+  /* deadline. same return values */
+
+  struct timespec now;
+  int err;
+
+  while (1)
+  {
+    get_now(&now);
+
+    err = snrf->tr_ops->wait(snrf->tr_opaque, &now);
+    if (err) return err;
+
+    if ((deadline != NULL) && (diff_ns(deadline, &now) <= 0)) return 0;
+  }
+
+  /* not reached */
+  return 0;
+}
+
+static int wait_reader(snrf_handle_t* snrf, const struct timespec* deadline)
+{
+  /* read_input when the reader thread runs */
+
+  struct timespec start;
+  int err;
+
+  if (drain_reader(snrf)) return 0;
+
+  if (__atomic_load_n(&snrf->reader_err, __ATOMIC_ACQUIRE))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  if (snrf->low_latency & SNRF_LOW_LATENCY_BUSY_POLL)
+    return spin_reader(snrf, deadline);
+
+  get_now(&start);
+  err = poll_read(snrf->reader_evfd, deadline);
+  hist_add_since(&snrf->stats.read_wait, &start);
+  if (err < 0)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+  else if (err == 0)
+  {
+    /* timeout */
+    return -2;
+  }
+
+  clear_reader_evfd(snrf);
+  drain_reader(snrf);
+
+  return 0;
+}
+
+static int read_input(snrf_handle_t* snrf, const struct timespec* deadline)
+{
+  /* wait for input until deadline, then read and dispatch it */
+  /* return -2 on timeout */
+
+  struct timespec start;
+  int err;
+
+  /* the input may be the completion of a queued message */
+  if (flush_tx(snrf))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  if (snrf->is_reader) return wait_reader(snrf, deadline);
+
+  get_now(&start);
+  if (snrf->low_latency & SNRF_LOW_LATENCY_BUSY_POLL)
+    err = busy_wait(snrf, deadline);
+  else
+    err = snrf->tr_ops->wait(snrf->tr_opaque, deadline);
+  hist_add_since(&snrf->stats.read_wait, &start);
+  if (err < 0)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+  else if (err == 0)
+  {
+    /* timeout */
+    return -2;
+  }
+
+  if (fill_rx(snrf) == -1)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+static int wait_msg
+(
+ snrf_handle_t* snrf, uint8_t op, uint8_t seq, snrf_msg_t* msg,
+ const struct timespec* deadline
+)
+{
+  /* deadline the absolute deadline, or NULL to wait forever */
+  /* seq only matched for completions */
+
+  snrf_ring_t* ring;
+  int err;
+
+  if (op == SNRF_OP_PAYLOAD) ring = &snrf->payload_ring;
+  else if (op == SNRF_OP_COMPL) ring = &snrf->compl_ring;
+  else ring = &snrf->debug_ring;
+
+  while (1)
+  {
+    while (ring_get(ring, msg) == 0)
+    {
+      if ((op != SNRF_OP_COMPL) || (msg->seq == seq)) return 0;
+
+      /* stale completion of a message that timed out */
+      ++snrf->msg_ndrop;
+    }
+
+    err = read_input(snrf, deadline);
+
+    if (err == -1)
+    {
+      SNRF_PERROR();
+      return -1;
+    }
+    else if (err == -2)
+    {
+      /* timeout, expected by the xxx_until callers */
+      return -2;
+    }
+  }
+
+  /* not reached */
+  return 0;
+}
+
+static int restore_state(snrf_handle_t* snrf, uint8_t state)
+{
+  /* resynchronize and restore previous state, which the */
+  /* device keeps unless it was reset */
+
+  if (snrf_sync(snrf))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  if ((snrf->state != state) &&
+      snrf_set_keyval(snrf, SNRF_KEY_STATE, state))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+static int window_resend(snrf_handle_t* snrf)
+{
+  /* resend all the messages whose completion is missing */
+
+  snrf_window_entry_t* const w = snrf->window;
+  size_t i;
+
+  for (i = 0; i != SNRF_WINDOW_MAX; ++i)
+  {
+    if (w[i].is_used == 0) continue ;
+
+    if (write_msg(snrf, &w[i].msg))
+    {
+      SNRF_PERROR();
+      return -1;
+    }
+
+    snrf_get_deadline(&w[i].deadline, SNRF_COMPL_MS * 1000);
+    ++snrf->stats.nretry;
+  }
+
+  return 0;
+}
+
+static int write_wait_msg(snrf_handle_t* snrf, snrf_msg_t* msg)
+{
+  /* resynchronize if needed */
+
+  struct timespec deadline;
+  struct timespec start;
+  snrf_msg_t saved_msg;
+  unsigned int n = 0;
+  int err;
+
+  if (snrf->is_submit) return snrf_submit(snrf, msg);
+
+  next_seq(snrf, msg);
+  memcpy(&saved_msg, msg, sizeof(snrf_msg_t));
+
+  get_now(&start);
+
+ redo_msg:
+  if ((++n) == 4)
+  {
+    ++snrf->stats.nfail;
+    SNRF_PERROR();
+    return -1;
+  }
+
+  if (write_msg(snrf, msg))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  snrf_get_deadline(&deadline, SNRF_COMPL_MS * 1000);
+  err = wait_msg(snrf, SNRF_OP_COMPL, msg->seq, msg, &deadline);
+  if (err == -1)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+  else if (err == -2)
+  {
+    ++snrf->stats.ntimeout;
+
+    if (restore_state(snrf, snrf->state))
+    {
+      SNRF_PERROR();
+      return -1;
+    }
+
+    /* the completions still missing are sent again */
+    if (window_resend(snrf))
+    {
+      SNRF_PERROR();
+      return -1;
+    }
+
+    /* restore message contents to redo */
+    memcpy(msg, &saved_msg, sizeof(snrf_msg_t));
+
+    ++snrf->stats.nretry;
+    goto redo_msg;
+  }
+
+  hist_add_since(&snrf->stats.rtt, &start);
+
+  return 0;
+}
+
+static int window_wait(snrf_handle_t* snrf, size_t count)
+{
+  /* wait until at most count messages are in flight */
+
+  /* a missing completion means the device lost the message */
+  /* or its completion. in both cases, the link is resynced. */
+  /* the device handles the SYNC after the messages buffered */
+  /* before it, whose completions are discarded with the input */
+  /* up to its answer. all the messages whose completion is */
+  /* missing are then sent again, so a message whose completion */
+  /* only was lost is handled twice: a payload goes on air */
+  /* twice. delivery is at least once. messages already */
+  /* completed are never sent again. */
+
+  snrf_window_entry_t* const w = snrf->window;
+  snrf_window_entry_t* oldest;
+  struct timespec now;
+  unsigned int n = 0;
+  size_t i;
+
+  while (snrf->window_count > count)
+  {
+    oldest = NULL;
+    for (i = 0; i != SNRF_WINDOW_MAX; ++i)
+    {
+      if (w[i].is_used == 0) continue ;
+      if ((oldest == NULL) || (diff_ns(&w[i].deadline, &oldest->deadline) < 0))
+	oldest = &w[i];
+    }
+
+    /* wait until the oldest message times out */
+    get_now(&now);
+    if (diff_ns(&oldest->deadline, &now) > 0)
+    {
+      if (read_input(snrf, &oldest->deadline) == -1)
+      {
+	SNRF_PERROR();
+	return -1;
+      }
+
+      continue ;
+    }
+
+    /* oldest message timed out */
+
+    ++snrf->stats.ntimeout;
+
+    if ((++n) == 4)
+    {
+      ++snrf->stats.nfail;
+      SNRF_PERROR();
+      return -1;
+    }
+
+    if (restore_state(snrf, snrf->state))
+    {
+      SNRF_PERROR();
+      return -1;
+    }
+
+    if (window_resend(snrf))
+    {
+      SNRF_PERROR();
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int write_window_msg(snrf_handle_t* snrf, snrf_msg_t* msg, int* status)
+{
+  /* send msg without waiting for its completion */
+  /* status, if not NULL, set once completed */
+
+  snrf_window_entry_t* const w = snrf->window;
+  size_t i;
+
+  if (window_wait(snrf, snrf->window_size - 1))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  for (i = 0; w[i].is_used; ++i) ;
+
+  next_seq(snrf, msg);
+  memcpy(&w[i].msg, msg, sizeof(snrf_msg_t));
+
+  if (write_msg(snrf, &w[i].msg))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  snrf_get_deadline(&w[i].deadline, SNRF_COMPL_MS * 1000);
+  w[i].status = status;
+  w[i].is_used = 1;
+  ++snrf->window_count;
+  if (snrf->window_count > snrf->stats.window_hwm)
+    snrf->stats.window_hwm = snrf->window_count;
+
+  return 0;
+}
+
+static int write_payload_msg(snrf_handle_t* snrf, snrf_msg_t* msg)
+{
+  /* in windowed mode, return once the payload is sent. an error */
+  /* reported by its completion is returned by a later call or */
+  /* by snrf_flush_payloads */
+
+  /* the writer thread has its own window */
+  if ((snrf->window_size > 1) && (snrf->is_submit == 0))
+  {
+    if (write_window_msg(snrf, msg, NULL))
+    {
+      SNRF_PERROR();
+      return -1;
+    }
+
+    if (snrf->window_err)
+    {
+      snrf->window_err = 0;
+      SNRF_PERROR();
+      return -1;
+    }
+
+    return 0;
+  }
+
+  if (write_wait_msg(snrf, msg))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  if (msg->u.compl.err != SNRF_ERR_SUCCESS)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+int snrf_write_payload(snrf_handle_t* snrf, const uint8_t* buf, size_t size)
+{
+  snrf_msg_t msg;
+
+  SNRF_ASSUME(size <= SNRF_MAX_PAYLOAD_WIDTH);
+
+  msg.op = SNRF_OP_PAYLOAD;
+  memcpy(msg.u.payload.data, buf, size);
+  msg.u.payload.size = (uint8_t)size;
+
+  return write_payload_msg(snrf, &msg);
+}
+
+int snrf_write_payload_to
+(snrf_handle_t* snrf, uint32_t addr, const uint8_t* buf, size_t size)
+{
+  /* send to addr, without going through the conf state. the */
+  /* device keeps addr as its tx address */
+
+  snrf_msg_t msg;
+
+  SNRF_ASSUME(size <= SNRF_MAX_PAYLOAD_WIDTH);
+
+  msg.op = SNRF_OP_PAYLOAD_TO;
+  msg.u.payload_to.addr = uint32_to_le(addr);
+  memcpy(msg.u.payload_to.data, buf, size);
+  msg.u.payload_to.size = (uint8_t)size;
+
+  /* the shadowed tx address is no longer known */
+  snrf->conf_mask &= ~((uint32_t)1 << SNRF_KEY_TX_ADDR);
+
+  return write_payload_msg(snrf, &msg);
+}
+
+static int submit_payloads
+(snrf_handle_t* snrf, const struct iovec* iov, size_t count, int* status)
+{
+  /* snrf_write_payloads with the writer thread, which has */
+  /* its own window and flush policy. all the payloads are */
+  /* queued at once, then waited for */
+
+  snrf_submit_t* subs;
+  snrf_submit_t* sub;
+  size_t i;
+  int err = 0;
+
+  for (i = 0; i != count; ++i) status[i] = -1;
+
+  if (count == 0) return 0;
+
+  subs = malloc(count * sizeof(snrf_submit_t));
+  if (subs == NULL)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  for (i = 0; i != count; ++i)
+  {
+    sub = &subs[i];
+
+    if (iov[i].iov_len > SNRF_MAX_PAYLOAD_WIDTH)
+    {
+      SNRF_PERROR();
+      sub->err = -1;
+      sub->is_done = 1;
+      continue ;
+    }
+
+    sub->msg.op = SNRF_OP_PAYLOAD;
+    memcpy(sub->msg.u.payload.data, iov[i].iov_base, iov[i].iov_len);
+    sub->msg.u.payload.size = (uint8_t)iov[i].iov_len;
+    sub->is_done = 0;
+
+    submit_push(snrf, sub);
+  }
+
+  wake_writer(snrf);
+
+  for (i = 0; i != count; ++i)
+  {
+    sub = &subs[i];
+
+    while (__atomic_load_n(&sub->is_done, __ATOMIC_ACQUIRE) == 0)
+      futex_wait(&sub->is_done, 0);
+
+    if (sub->err == 0) status[i] = sub->msg.u.compl.err;
+    if (status[i] != SNRF_ERR_SUCCESS) err = -1;
+  }
+
+  free(subs);
+
+  return err;
+}
+
+int snrf_write_payloads
+(snrf_handle_t* snrf, const struct iovec* iov, size_t count, int* status)
+{
+  /* send count payloads, as many in flight as the device */
+  /* window allows. frames are queued and written together */
+  /* each time completions free window slots. status[i] is */
+  /* set to the completion error of iov[i], or -1 if none */
+  /* return 0 if all the payloads completed successfully */
+
+  const unsigned int flush_policy = snrf->flush_policy;
+  const size_t window_size = snrf->window_size;
+  unsigned int window_err;
+  snrf_msg_t msg;
+  size_t i;
+  int err = 0;
+
+  if (snrf->is_submit) return submit_payloads(snrf, iov, count, status);
+
+  for (i = 0; i != count; ++i) status[i] = -1;
+
+  /* keep the status of previous payloads apart */
+  if (window_wait(snrf, 0))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  window_err = snrf->window_err;
+
+  snrf->flush_policy = SNRF_FLUSH_EXPLICIT;
+  snrf->window_size = SNRF_WINDOW_MAX;
+
+  for (i = 0; i != count; ++i)
+  {
+    if (iov[i].iov_len > SNRF_MAX_PAYLOAD_WIDTH)
+    {
+      SNRF_PERROR();
+      err = -1;
+      continue ;
+    }
+
+    msg.op = SNRF_OP_PAYLOAD;
+    memcpy(msg.u.payload.data, iov[i].iov_base, iov[i].iov_len);
+    msg.u.payload.size = (uint8_t)iov[i].iov_len;
+
+    if (write_window_msg(snrf, &msg, &status[i]))
+    {
+      SNRF_PERROR();
+      err = -1;
+      break ;
+    }
+  }
+
+  if (window_wait(snrf, 0))
+  {
+    SNRF_PERROR();
+    err = -1;
+  }
+
+  /* on error, entries may be left pointing to status */
+  for (i = 0; i != SNRF_WINDOW_MAX; ++i) snrf->window[i].status = NULL;
+
+  snrf->window_err = window_err;
+  snrf->window_size = window_size;
+  snrf->flush_policy = flush_policy;
+
+  for (i = 0; i != count; ++i)
+  {
+    if (status[i] != SNRF_ERR_SUCCESS) err = -1;
+  }
+
+  return err;
+}
+
+int snrf_flush_payloads(snrf_handle_t* snrf)
+{
+  /* wait for all the windowed payloads to complete */
+
+  if (window_wait(snrf, 0))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  if (snrf->window_err)
+  {
+    snrf->window_err = 0;
+    SNRF_PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+int snrf_set_window(snrf_handle_t* snrf, size_t size)
+{
+  /* size the maximum count of payloads in flight */
+  /* 1 to wait for each payload completion */
+
+  if ((size == 0) || (size > SNRF_WINDOW_MAX))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  if (window_wait(snrf, 0))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  snrf->window_size = size;
+
+  return 0;
+}
+
+int snrf_peek_payload_until
+(
+ snrf_handle_t* snrf, const uint8_t** data, size_t* size,
+ const struct timespec* deadline
+)
+{
+  /* data points into the payload ring, valid until */
+  /* snrf_release_payload is called. fill_rx decodes a */
+  /* payload from the receive buffer straight to its slot. */
+  /* with the reader thread, the slot of the reader ring is */
+  /* copied once more, by drain_reader in this thread */
+  /* deadline the absolute CLOCK_MONOTONIC deadline, or NULL */
+  /* return -2 if the deadline is reached */
+
+  const snrf_msg_t* msg;
+  int err;
+
+  while ((msg = ring_peek(&snrf->payload_ring)) == NULL)
+  {
+    err = read_input(snrf, deadline);
+    if (err == -1)
+    {
+      SNRF_PERROR();
+      return -1;
+    }
+    else if (err == -2)
+    {
+      /* not an error, but do not retry */
+      return -2;
+    }
+  }
+
+  if (msg->u.payload.size > SNRF_MAX_PAYLOAD_WIDTH)
+  {
+    ring_release(&snrf->payload_ring);
+    SNRF_PERROR();
+    return -1;
+  }
+
+  *data = msg->u.payload.data;
+  *size = msg->u.payload.size;
+
+  return 0;
+}
+
+int snrf_peek_payload(snrf_handle_t* snrf, const uint8_t** data, size_t* size)
+{
+  return snrf_peek_payload_until(snrf, data, size, NULL);
+}
+
+void snrf_release_payload(snrf_handle_t* snrf)
+{
+  ring_release(&snrf->payload_ring);
+}
+
+int snrf_read_payload_until
+(
+ snrf_handle_t* snrf, uint8_t* buf, size_t* size,
+ const struct timespec* deadline
+)
+{
+  /* assume buf size <= SNRF_MAX_PAYLOAD_WIDTH */
+  /* deadline the absolute CLOCK_MONOTONIC deadline, or NULL */
+  /* return -2 if the deadline is reached */
+
+  const uint8_t* data;
+  int err;
+
+  err = snrf_peek_payload_until(snrf, &data, size, deadline);
+  if (err == -1)
   {
     SNRF_PERROR();
     return -1;
   }
+  else if (err == -2)
+  {
+    /* not an error, but do not retry */
+    return -2;
+  }
+
+  memcpy(buf, data, *size);
+  snrf_release_payload(snrf);
 
   return 0;
 }
 
-static int select_read(int fd, struct timeval* tm)
+int snrf_read_payload(snrf_handle_t* snrf, uint8_t* buf, size_t* size)
+{
+  return snrf_read_payload_until(snrf, buf, size, NULL);
+}
+
+int snrf_read_payloads_until
+(
+ snrf_handle_t* snrf, snrf_payload_t* payloads, size_t count, size_t* n,
+ const struct timespec* deadline
+)
 {
-  /* ms the timeout in milliseconds */
+  /* wait for at least one payload until deadline, then return */
+  /* all the payloads available without waiting, up to count */
 
-  struct timeval tm_start;
-  struct timeval tm_stop;
-  struct timeval tm_diff;
-  fd_set set;
+  const snrf_msg_t* msg;
+  const uint8_t* data;
+  size_t size;
   int err;
 
-  FD_ZERO(&set);
-  FD_SET(fd, &set);
+  *n = 0;
 
-  gettimeofday(&tm_start, NULL);
-  err = select(fd + 1, &set, NULL, NULL, tm);
-  gettimeofday(&tm_stop, NULL);
+  if (count == 0) return 0;
 
-  /* update timer */
-  if (tm != NULL)
+  err = snrf_peek_payload_until(snrf, &data, &size, deadline);
+  if (err == -1)
   {
-    timersub(&tm_stop, &tm_start, &tm_diff);
-
-    if (timercmp(&tm_diff, tm, >))
-    {
-      tm_diff.tv_sec = tm->tv_sec;
-      tm_diff.tv_usec = tm->tv_usec;
-    }
-
-    /* use tm_start as a tmp result */
-    timersub(tm, &tm_diff, &tm_start);
-    tm->tv_sec = tm_start.tv_sec;
-    tm->tv_usec = tm_start.tv_usec;
+    SNRF_PERROR();
+    return -1;
+  }
+  else if (err == -2)
+  {
+    return -2;
   }
 
-  return err;
-}
-
-static int read_msg(snrf_handle_t* snrf, snrf_msg_t* msg, struct timeval* tm)
-{
-  uint8_t* buf;
-  size_t size;
-  size_t nread;
-  int err;
-
-  buf = (uint8_t*)msg;
-  size = sizeof(snrf_msg_t);
-
-  while (size)
+  while ((msg = ring_peek(&snrf->payload_ring)) != NULL)
   {
-    err = select_read(serial_get_fd(&snrf->serial), tm);
-    if (err < 0)
+    if (msg->u.payload.size > SNRF_MAX_PAYLOAD_WIDTH)
     {
+      ring_release(&snrf->payload_ring);
       SNRF_PERROR();
       return -1;
     }
-    else if (err == 0)
-    {
-      /* timeout */
-      return -2;
-    }
-    /* else */
 
-    if (serial_read(&snrf->serial, buf, size, &nread))
-    {
-      SNRF_PERROR();
-      return -1;
-    }
+    memcpy(payloads[*n].data, msg->u.payload.data, msg->u.payload.size);
+    payloads[*n].size = msg->u.payload.size;
+    payloads[*n].ns = ring_peek_ns(&snrf->payload_ring);
+    ring_release(&snrf->payload_ring);
 
-    buf += nread;
-    size -= nread;
+    if ((++*n) == count) break ;
   }
 
   return 0;
 }
 
-static int wait_msg
-(snrf_handle_t* snrf, uint8_t op, snrf_msg_t* msg, unsigned int ms)
+int snrf_read_payloads
+(snrf_handle_t* snrf, snrf_payload_t* payloads, size_t count, size_t* n)
 {
-  /* ms the timeout in milliseconds or -1 */
+  return snrf_read_payloads_until(snrf, payloads, count, n, NULL);
+}
 
-  snrf_msg_node_t* node;
-  int err;
-  struct timeval tm;
-  struct timeval* p;
+static unsigned int is_cached_key(const snrf_handle_t* snrf, uint8_t key)
+{
+  /* keys only changed by the host, whose get returns the */
+  /* value set. the others are counters, flags or state the */
+  /* device changes, or tracked apart. are not cached either: */
+  /* rate, returned as register bits by older firmwares. the */
+  /* addr width, off by one in the nrf24l01p get. the rx and */
+  /* tx addrs, only addr width bytes returned */
 
-  p = NULL;
-  if (ms != (unsigned int)-1)
-  {
-    tm.tv_sec = ms / 1000;
-    tm.tv_usec = (ms % 1000) * 1000;
-    p = &tm;
-  }
+  /* the writer thread completions are not serialized */
+  if (snrf->is_submit) return 0;
 
-  while (1)
+  switch (key)
   {
-    err = read_msg(snrf, msg, p);
-
-    if (err < 0)
-    {
-      SNRF_PERROR();
-      return err;
-    }
-
-    if (msg->op == op)
-    {
-      return 0;
-    }
+  case SNRF_KEY_CRC:
+  case SNRF_KEY_CHAN:
+  case SNRF_KEY_TX_ACK:
+  case SNRF_KEY_PAYLOAD_WIDTH:
+  case SNRF_KEY_NRF_CHIPSET:
+    return 1;
+
+  default:
+    return 0;
+  }
+}
 
-    /* put in msg queue, append at tail */
-    node = malloc(sizeof(snrf_msg_node_t));
-    if (node == NULL)
-    {
-      SNRF_PERROR();
-      return -1;
-    }
+static void cache_keyval(snrf_handle_t* snrf, uint8_t key, uint32_t val)
+{
+  if (key == SNRF_KEY_STATE) snrf->state = (uint8_t)val;
 
-    memcpy(&node->msg, msg, sizeof(snrf_msg_t));
-    node->next = NULL;
-    if (snrf->msg_head == NULL) snrf->msg_head = node;
-    else snrf->msg_tail->next = node;
-    snrf->msg_tail = node;
-  }
+  if (is_cached_key(snrf, key) == 0) return ;
 
-  /* not reached */
-  return 0;
+  snrf->conf_vals[key] = val;
+  snrf->conf_mask |= (uint32_t)1 << key;
 }
 
-static int write_wait_msg(snrf_handle_t* snrf, snrf_msg_t* msg)
+int snrf_set_keyval(snrf_handle_t* snrf, uint8_t key, uint32_t val)
 {
-  /* resynchronize if needed */
-
-  snrf_msg_t saved_msg;
-  unsigned int n = 0;
-  int err;
+  /* device must be in conf mode. the uart rate is only set */
+  /* by snrf_set_uart_baud, which switches the host too */
 
-  memcpy(&saved_msg, msg, sizeof(snrf_msg_t));
+  snrf_msg_t msg;
 
- redo_msg:
-  if ((++n) == 4)
+  if (key == SNRF_KEY_UART_BAUD)
   {
     SNRF_PERROR();
     return -1;
   }
 
-  if (write_msg(snrf, msg))
+  msg.op = SNRF_OP_SET;
+  msg.u.set.key = key;
+  msg.u.set.val = uint32_to_le(val);
+
+  if (write_wait_msg(snrf, &msg))
   {
     SNRF_PERROR();
     return -1;
   }
 
-  err = wait_msg(snrf, SNRF_OP_COMPL, msg, 1000);
-  if (err == -1)
+  if (msg.u.compl.err != SNRF_ERR_SUCCESS)
   {
     SNRF_PERROR();
     return -1;
   }
-  else if (err == -2)
+
+  cache_keyval(snrf, key, val);
+
+  return 0;
+}
+
+int snrf_set_keyvals(snrf_handle_t* snrf, const snrf_keyval_t* kvs, size_t n)
+{
+  /* set up to SNRF_SET_MULTI_MAX keys in one message. the */
+  /* device checks all of them before applying any, in order. */
+  /* a state key applies to the keys that follow it. the uart */
+  /* rate is only set by snrf_set_uart_baud */
+
+  snrf_msg_t msg;
+  size_t i;
+
+  if ((n == 0) || (n > SNRF_SET_MULTI_MAX))
   {
-    const uint8_t saved_state = snrf->state;
+    SNRF_PERROR();
+    return -1;
+  }
 
-    if (snrf_sync(snrf))
+  for (i = 0; i != n; ++i)
+  {
+    if (kvs[i].key == SNRF_KEY_UART_BAUD)
     {
       SNRF_PERROR();
       return -1;
     }
+  }
 
-    /* restore previous state */
-    if (snrf_set_keyval(snrf, SNRF_KEY_STATE, saved_state))
+  msg.op = SNRF_OP_SET_MULTI;
+  for (i = 0; i != SNRF_SET_MULTI_MAX; ++i)
+  {
+    if (i < n)
     {
-      SNRF_PERROR();
-      return -1;
+      msg.u.set_multi.pairs[i].key = kvs[i].key;
+      msg.u.set_multi.pairs[i].val = uint32_to_le(kvs[i].val);
+    }
+    else
+    {
+      msg.u.set_multi.pairs[i].key = SNRF_KEY_NONE;
     }
+  }
 
-    /* restore message contents to redo */
-    memcpy(msg, &saved_msg, sizeof(snrf_msg_t));
+  if (write_wait_msg(snrf, &msg))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
 
-    goto redo_msg;
+  if (msg.u.compl.err != SNRF_ERR_SUCCESS)
+  {
+    /* none applied, compl.val the index of the faulty pair */
+    SNRF_PERROR();
+    return -1;
   }
 
+  for (i = 0; i != n; ++i) cache_keyval(snrf, kvs[i].key, kvs[i].val);
+
   return 0;
 }
 
-int snrf_write_payload(snrf_handle_t* snrf, const uint8_t* buf, size_t size)
+int snrf_get_keyval(snrf_handle_t* snrf, uint8_t key, uint32_t* val)
 {
+  /* answered from the configuration shadow if known */
+
   snrf_msg_t msg;
 
-  SNRF_ASSUME(size <= SNRF_MAX_PAYLOAD_WIDTH);
+  if (is_cached_key(snrf, key) && (snrf->conf_mask & ((uint32_t)1 << key)))
+  {
+    *val = snrf->conf_vals[key];
+    return 0;
+  }
 
-  msg.op = SNRF_OP_PAYLOAD;
-  memcpy(msg.u.payload.data, buf, size);
-  msg.u.payload.size = (uint8_t)size;
-  msg.sync = 0x00;
+  msg.op = SNRF_OP_GET;
+  msg.u.set.key = key;
 
   if (write_wait_msg(snrf, &msg))
   {
@@ -299,172 +2585,269 @@ int snrf_write_payload(snrf_handle_t* snrf, const uint8_t* buf, size_t size)
     return -1;
   }
 
-  if (msg.u.compl.err != SNRF_ERR_SUCCESS)
+  if (msg.u.compl.err)
   {
     SNRF_PERROR();
     return -1;
   }
 
+  *val = le_to_uint32(msg.u.compl.val);
+
+  cache_keyval(snrf, key, *val);
+
   return 0;
 }
 
-int snrf_read_payload(snrf_handle_t* snrf, uint8_t* buf, size_t* size)
+static int set_uart_baud(snrf_handle_t* snrf, uint32_t baud)
 {
-  /* assume buf size <= SNRF_MAX_PAYLOAD_WIDTH */
-
-  snrf_msg_node_t* node;
-  snrf_msg_node_t* prev;
+  /* switch the device, then the host, to the new rate, and */
+  /* confirm it. on failure, both sides go back to the default */
+  /* rate and the link is resynchronized */
+
+  const uint32_t state = snrf->state;
+  const uint32_t prev_baud = snrf->uart_baud;
+  struct timespec probation;
+  struct timespec deadline;
   snrf_msg_t msg;
+  int err;
 
-  /* look in msg queue, start at head */
-  node = snrf->msg_head;
-  prev = NULL;
-  while (node != NULL)
+  if (window_wait(snrf, 0))
   {
-    if (node->msg.op == SNRF_OP_PAYLOAD) break ;
-    prev = node;
-    node = node->next;
+    SNRF_PERROR();
+    return -1;
   }
 
-  /* msg found in list */
-  if (node != NULL)
+  /* not write_wait_msg, which resyncs at the previous rate */
+  msg.op = SNRF_OP_SET;
+  msg.u.set.key = SNRF_KEY_UART_BAUD;
+  msg.u.set.val = uint32_to_le(baud);
+  next_seq(snrf, &msg);
+
+  if (write_msg(snrf, &msg))
   {
-    if (node == snrf->msg_head) snrf->msg_head = node->next;
-    else prev->next = node->next;
-    if (node == snrf->msg_tail) snrf->msg_tail = node->next;
-    memcpy(&msg, &node->msg, sizeof(msg));
-    free(node);
+    SNRF_PERROR();
+    return -1;
   }
-  else
+
+  snrf_get_deadline(&deadline, SNRF_COMPL_MS * 1000);
+  err = wait_msg(snrf, SNRF_OP_COMPL, msg.seq, &msg, &deadline);
+  if (err == -1)
   {
-    const int err = wait_msg(snrf, SNRF_OP_PAYLOAD, &msg, (unsigned int)-1);
-    if (err == -1)
-    {
-      SNRF_PERROR();
-      return -1;
-    }
-    else if (err == -2)
-    {
-      /* not an error, but do not retry */
-      return -2;
-    }
+    SNRF_PERROR();
+    return -1;
   }
 
-  if (msg.u.payload.size > SNRF_MAX_PAYLOAD_WIDTH)
+  /* the device switched before completing the set, or may */
+  /* have if the completion is lost */
+  snrf_get_deadline(&probation, SNRF_UART_PROBATION_MS * 1000);
+
+  if (err == -2)
+  {
+    ++snrf->stats.ntimeout;
+    SNRF_PERROR();
+    goto on_fallback;
+  }
+
+  if (msg.u.compl.err != SNRF_ERR_SUCCESS)
   {
+    /* rate refused, the device kept the previous one */
     SNRF_PERROR();
     return -1;
   }
 
-  memcpy(buf, msg.u.payload.data, msg.u.payload.size);
-  *size = msg.u.payload.size;
+  if (set_serial_bauds(snrf, baud))
+  {
+    SNRF_PERROR();
+    goto on_fallback;
+  }
 
-  return 0;
-}
+  /* confirm within the probation time, do not retry */
+  msg.op = SNRF_OP_GET;
+  msg.u.get.key = SNRF_KEY_UART_BAUD;
+  next_seq(snrf, &msg);
 
-int snrf_set_keyval(snrf_handle_t* snrf, uint8_t key, uint32_t val)
-{
-  /* device must be in conf mode */
+  if (write_msg(snrf, &msg))
+  {
+    SNRF_PERROR();
+    goto on_fallback;
+  }
 
-  snrf_msg_t msg;
+  snrf_get_deadline(&deadline, SNRF_COMPL_MS * 1000);
+  err = wait_msg(snrf, SNRF_OP_COMPL, msg.seq, &msg, &deadline);
+  if (err || (msg.u.compl.err != SNRF_ERR_SUCCESS) ||
+      (le_to_uint32(msg.u.compl.val) != baud))
+  {
+    SNRF_PERROR();
+    goto on_fallback;
+  }
 
-  msg.op = SNRF_OP_SET;
-  msg.u.set.key = key;
-  msg.u.set.val = uint32_to_le(val);
-  msg.sync = 0x00;
+  return 0;
 
-  if (write_wait_msg(snrf, &msg))
+ on_fallback:
+  /* drain the link until the device probation expires */
+  while ((err = read_input(snrf, &probation)) == 0) ;
+  if (err == -1)
   {
     SNRF_PERROR();
     return -1;
   }
 
-  if (msg.u.compl.err != SNRF_ERR_SUCCESS)
+  if (set_serial_bauds(snrf, SNRF_UART_BAUD_DEFAULT))
   {
     SNRF_PERROR();
     return -1;
   }
 
-  if (key == SNRF_KEY_STATE) snrf->state = (uint8_t)val;
+  if (restore_state(snrf, state) == 0) return -1;
 
-  return 0;
+  /* a lost set leaves the device at the previous rate */
+  if (prev_baud != SNRF_UART_BAUD_DEFAULT)
+  {
+    if (set_serial_bauds(snrf, prev_baud))
+    {
+      SNRF_PERROR();
+      return -1;
+    }
+
+    restore_state(snrf, state);
+  }
+
+  return -1;
 }
 
-int snrf_get_keyval(snrf_handle_t* snrf, uint8_t key, uint32_t* val)
+int snrf_set_uart_baud(snrf_handle_t* snrf, uint32_t baud)
 {
-  snrf_msg_t msg;
+  /* the reader thread must not read while the rate changes */
 
-  msg.op = SNRF_OP_GET;
-  msg.u.set.key = key;
-  msg.sync = 0x00;
+  const unsigned int is_reader = snrf->is_reader;
+  int err;
 
-  if (write_wait_msg(snrf, &msg))
+  /* the writer thread owns the transmission */
+  if (snrf->is_submit)
   {
     SNRF_PERROR();
     return -1;
   }
 
-  if (msg.u.compl.err)
+  if (is_reader) reader_stop(snrf);
+
+  err = set_uart_baud(snrf, baud);
+
+  if (is_reader && reader_start(snrf))
   {
     SNRF_PERROR();
     return -1;
   }
 
-  *val = le_to_uint32(msg.u.compl.val);
-
-  return 0;
+  return err;
 }
 
 int snrf_sync(snrf_handle_t* snrf)
 {
-  static const uint8_t sync_byte = SNRF_SYNC_BYTE;
-  static const uint8_t end_byte = SNRF_SYNC_END;
-
-  size_t i;
+  /* terminate any partial frame the device is receiving, */
+  /* then send a sync request and discard the input up to its */
+  /* answer, which carries the device state. the device keeps */
+  /* its state, the radio is not stopped */
+
+  uint8_t buf[1 + SNRF_FRAME_SIZE_MAX];
+  struct timespec deadline;
+  struct timespec start;
+  struct timespec now;
+  struct iovec iov;
+  snrf_msg_t msg;
+  size_t size;
+  uint64_t ns;
 
-  for (i = 0; i < (4 * sizeof(snrf_msg_t)); ++i)
+  /* the writer thread owns the transmission */
+  if (snrf->is_submit)
   {
-    usleep(100);
-    if (serial_writen(&snrf->serial, &sync_byte, 1))
-    {
-      SNRF_PERROR();
-      return -1;
-    }
+    SNRF_PERROR();
+    return -1;
   }
 
-  /* delay required beftore flushing and writing end byte */
-  usleep(10000);
+  get_now(&start);
+
+  /* queued messages are lost, they are sent again by the */
+  /* caller if needed */
+  snrf->tx_count = 0;
+  snrf->tx_off = 0;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.op = SNRF_OP_SYNC;
+  next_seq(snrf, &msg);
 
-  if (serial_flush_txrx(&snrf->serial))
+  snrf->sync_seq = msg.seq;
+  snrf->sync_done = 0;
+
+  /* the device may have been reset */
+  snrf->conf_mask = 0;
+
+  buf[0] = SNRF_FRAME_DELIM;
+  size = 1 + snrf_frame_encode_msg(buf + 1, &msg);
+  record_msg(snrf, SNRF_TRACE_TX, &msg);
+
+  iov.iov_base = buf;
+  iov.iov_len = size;
+  if (snrf->tr_ops->writev(snrf->tr_opaque, &iov, 1))
   {
     SNRF_PERROR();
     return -1;
   }
 
-  if (serial_writen(&snrf->serial, &end_byte, 1))
+  snrf_get_deadline(&deadline, SNRF_COMPL_MS * 1000);
+
+  while (snrf->sync_done == 0)
   {
-    SNRF_PERROR();
-    return -1;
+    if (read_input(snrf, &deadline))
+    {
+      SNRF_PERROR();
+      return -1;
+    }
   }
 
-  snrf->state = SNRF_STATE_CONF;
+  get_now(&now);
+  ns = (uint64_t)diff_ns(&now, &start);
+  ++snrf->sync_count;
+  ++snrf->stats.nsync;
+  snrf->sync_last_ns = ns;
+  if (ns > snrf->sync_max_ns) snrf->sync_max_ns = ns;
 
   return 0;
 }
 
-int snrf_get_pending_msg(snrf_handle_t* snrf, snrf_msg_t* msg)
+int snrf_set_flush_policy
+(snrf_handle_t* snrf, unsigned int policy, unsigned int us)
 {
-  snrf_msg_node_t* const node = snrf->msg_head;
+  /* SNRF_FLUSH_IMMEDIATE: each message is sent when written */
+  /* SNRF_FLUSH_LATENCY: messages are sent once the oldest */
+  /* one was queued for more than us microseconds */
+  /* SNRF_FLUSH_EXPLICIT: messages are sent by snrf_flush */
+  /* in all cases, messages are sent when the queue is full */
+  /* or before waiting for a completion */
+
+  if (policy > SNRF_FLUSH_EXPLICIT)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
 
-  if (snrf->msg_head == NULL) return -1;
+  snrf->flush_policy = policy;
+  snrf->flush_us = us;
 
-  if (snrf->msg_head == snrf->msg_tail) snrf->msg_tail = NULL;
-  snrf->msg_head = node->next;
+  return flush_tx(snrf);
+}
 
-  memcpy(msg, &node->msg, sizeof(snrf_msg_t));
-  free(node);
+int snrf_flush(snrf_handle_t* snrf)
+{
+  return flush_tx(snrf);
+}
 
-  return 0;
+int snrf_get_pending_msg(snrf_handle_t* snrf, snrf_msg_t* msg)
+{
+  if (ring_get(&snrf->payload_ring, msg) == 0) return 0;
+  if (ring_get(&snrf->debug_ring, msg) == 0) return 0;
+  if (ring_get(&snrf->compl_ring, msg) == 0) return 0;
+  return -1;
 }
 
 int snrf_read_msg(snrf_handle_t* snrf, snrf_msg_t* msg)
@@ -473,27 +2856,32 @@ int snrf_read_msg(snrf_handle_t* snrf, snrf_msg_t* msg)
   /* return -1 if there was a read error */
   /* return -2 if read success, but no message */
 
-  const size_t size = sizeof(snrf_msg_t) - snrf->msg_rpos;
-  uint8_t* const buf = snrf->msg_rbuf + snrf->msg_rpos;
-  size_t nread;
-
-  if (serial_read(&snrf->serial, buf, size, &nread))
+  if (snrf->is_reader)
+  {
+    /* no syscall while messages are queued */
+    drain_reader(snrf);
+    if (snrf_get_pending_msg(snrf, msg) == 0) return 0;
+
+    /* select on snrf_get_fd must not return at once */
+    clear_reader_evfd(snrf);
+    if ((drain_reader(snrf) == 0) &&
+	__atomic_load_n(&snrf->reader_err, __ATOMIC_ACQUIRE))
+    {
+      SNRF_PERROR();
+      return -1;
+    }
+  }
+  else if (fill_rx(snrf) == -1)
   {
     SNRF_PERROR();
     return -1;
   }
 
-  snrf->msg_rpos += nread;
-
-  if (snrf->msg_rpos != sizeof(snrf_msg_t))
+  if (snrf_get_pending_msg(snrf, msg))
   {
     /* full message not yet available */
     return -2;
   }
 
-  /* full message available, copy in msg */
-  snrf->msg_rpos = 0;
-  memcpy(msg, snrf->msg_rbuf, sizeof(snrf_msg_t));
-
   return 0;
 }
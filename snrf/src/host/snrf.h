@@ -3,47 +3,374 @@
 
 
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include "serial.h"
+#include "snrf_transport.h"
 #include "snrf_common.h"
+#include "snrf_frame.h"
+#include "snrf_trace.h"
+#include "snrf_pcap.h"
 
-typedef struct snrf_msg_node
+/* completion timeout, in milliseconds. also used by snrf_loop */
+#define SNRF_COMPL_MS 1000
+
+typedef struct snrf_ring
+{
+  /* fixed capacity message ring, allocated at open time */
+  snrf_msg_t* msgs;
+  /* CLOCK_MONOTONIC receive time of each message, in ns. */
+  /* payload ring only, NULL otherwise */
+  uint64_t* ns;
+  /* capacity, power of 2 */
+  size_t size;
+  /* free running counters */
+  size_t head;
+  size_t tail;
+  /* messages lost because the ring was full */
+  size_t noverflow;
+  /* highest count reached */
+  size_t hwm;
+} snrf_ring_t;
+
+#define SNRF_CACHE_LINE_SIZE 64
+
+typedef struct snrf_spsc
+{
+  /* lock free single producer, single consumer ring. each */
+  /* side owns a counter on its own cache line, and caches */
+  /* the other one to avoid sharing lines on every access */
+
+  /* producer side */
+  size_t head __attribute__((aligned(SNRF_CACHE_LINE_SIZE)));
+  size_t tail_cache;
+  /* messages lost because the ring was full */
+  size_t noverflow;
+
+  /* consumer side */
+  size_t tail __attribute__((aligned(SNRF_CACHE_LINE_SIZE)));
+  size_t head_cache;
+
+  /* constant once initialized, size a power of 2. ns the */
+  /* receive time of each message, cf. snrf_ring_t */
+  snrf_msg_t* msgs __attribute__((aligned(SNRF_CACHE_LINE_SIZE)));
+  uint64_t* ns;
+  size_t size;
+} snrf_spsc_t;
+
+typedef struct snrf_submit
+{
+  /* a message submitted by any thread, on the submitter stack */
+
+  /* intrusive multi producer, single consumer queue link */
+  struct snrf_submit* next;
+  /* the message, then its completion */
+  snrf_msg_t msg;
+  unsigned int ntries;
+  int err;
+  /* set once completed, futex word */
+  uint32_t is_done;
+} snrf_submit_t;
+
+typedef struct snrf_submit_slot
+{
+  /* message in flight, writer thread only */
+  uint8_t seq;
+  struct timespec deadline;
+  unsigned int is_used;
+} snrf_submit_slot_t;
+
+typedef struct snrf_keyval
+{
+  uint8_t key;
+  uint32_t val;
+} snrf_keyval_t;
+
+typedef struct snrf_payload
+{
+  uint8_t data[SNRF_MAX_PAYLOAD_WIDTH];
+  size_t size;
+  /* CLOCK_MONOTONIC time the bytes were read, in ns. by the */
+  /* reader thread if any, so not delayed by the application */
+  uint64_t ns;
+} snrf_payload_t;
+
+typedef struct snrf_conf
+{
+  /* ring capacities, rounded up to a power of 2 */
+  size_t payload_ring_size;
+  size_t compl_ring_size;
+  size_t debug_ring_size;
+  /* uart rate negotiated at open time */
+  uint32_t uart_baud;
+  /* snrf_flush_xxx, cf. snrf_set_flush_policy */
+#define SNRF_FLUSH_IMMEDIATE 0
+#define SNRF_FLUSH_LATENCY 1
+#define SNRF_FLUSH_EXPLICIT 2
+  unsigned int flush_policy;
+  /* SNRF_FLUSH_LATENCY bound, in microseconds */
+  unsigned int flush_us;
+  /* if not 0, a thread reads the fd continuously and queues */
+  /* the messages in a ring of this capacity */
+  size_t reader_ring_size;
+  /* if not 0, a writer thread sends the messages submitted by */
+  /* any thread. implies a reader thread */
+  unsigned int is_submit;
+  /* if not NULL, every frame is recorded in this file, a */
+  /* circular trace of trace_count records */
+  const char* trace_path;
+  size_t trace_count;
+  /* if not NULL, the link traffic is captured in this pcap file */
+  const char* capture_path;
+  /* if not NULL, used instead of the serial port at path */
+  const snrf_transport_ops_t* transport;
+  void* transport_opaque;
+  /* snrf_low_latency_xxx, latency traded for cpu time. each is */
+  /* best effort, cf. snrf_handle_t.low_latency for those applied */
+  /* serial: ASYNC_LOW_LATENCY and a 1ms usb serial latency */
+  /* timer, restored at close. ignored with another transport */
+#define SNRF_LOW_LATENCY_SERIAL (1 << 0)
+  /* rt_reader: the reader thread runs SCHED_FIFO at reader_prio, */
+  /* pinned to reader_cpu if not -1. it is started if not */
+  /* configured and the transport has an fd. the process memory */
+  /* is locked until the last handle locking it is closed, then */
+  /* unlocked even if the application locked it too */
+#define SNRF_LOW_LATENCY_RT_READER (1 << 1)
+  /* busy_poll: the input is waited for without sleeping, if */
+  /* several cpus are online. a SCHED_FIFO reader thread only */
+  /* spins if pinned to a cpu */
+#define SNRF_LOW_LATENCY_BUSY_POLL (1 << 2)
+#define SNRF_LOW_LATENCY_ALL \
+  (SNRF_LOW_LATENCY_SERIAL | SNRF_LOW_LATENCY_RT_READER | SNRF_LOW_LATENCY_BUSY_POLL)
+  unsigned int low_latency;
+  int reader_cpu;
+  int reader_prio;
+} snrf_conf_t;
+
+typedef struct snrf_hist
+{
+  /* durations in nanoseconds, hdr style: 16 linear buckets */
+  /* per power of 2, a value is known within 1/16. values */
+  /* above 2^40 ns (18 minutes) fall in the last bucket */
+#define SNRF_HIST_SUB_BITS 4
+#define SNRF_HIST_MAX_BITS 40
+#define SNRF_HIST_BUCKET_COUNT \
+  ((SNRF_HIST_MAX_BITS - SNRF_HIST_SUB_BITS + 1) << SNRF_HIST_SUB_BITS)
+  uint32_t counts[SNRF_HIST_BUCKET_COUNT];
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  uint64_t sum;
+} snrf_hist_t;
+
+typedef struct snrf_stats
+{
+  /* updated by the thread using the handle, the submission */
+  /* path (is_submit) is not measured */
+
+  /* write_wait_msg, from the first send to the completion */
+  snrf_hist_t rtt;
+  /* between two received payloads, as dispatched */
+  snrf_hist_t payload_gap;
+  /* blocked waiting for input in select_read */
+  snrf_hist_t read_wait;
+
+  /* resynchronizations */
+  size_t nsync;
+  /* completions not received in time */
+  size_t ntimeout;
+  /* messages sent again after a timeout */
+  size_t nretry;
+  /* messages given up after retries */
+  size_t nfail;
+  /* frames dropped, cf. rx_ncorrupt */
+  size_t ncorrupt;
+  /* messages dropped, cf. msg_ndrop */
+  size_t ndrop;
+  /* messages lost because a ring was full */
+  size_t noverflow;
+
+  /* high water marks */
+  size_t tx_hwm;
+  size_t window_hwm;
+  size_t payload_ring_hwm;
+  size_t compl_ring_hwm;
+  size_t debug_ring_hwm;
+  /* messages drained from the reader ring at once */
+  size_t reader_ring_hwm;
+
+} snrf_stats_t;
+
+typedef struct snrf_window_entry
 {
   snrf_msg_t msg;
-  struct snrf_msg_node* next;
-} snrf_msg_node_t;
+  /* CLOCK_MONOTONIC deadline of the completion */
+  struct timespec deadline;
+  /* if not NULL, set to the completion error */
+  int* status;
+  unsigned int is_used;
+} snrf_window_entry_t;
 
 typedef struct snrf_handle
 {
   serial_handle_t serial;
+  /* &serial unless snrf_conf_t.transport is set */
+  const snrf_transport_ops_t* tr_ops;
+  void* tr_opaque;
 
-  /* list of pending received messages */
-  snrf_msg_node_t* msg_head;
-  snrf_msg_node_t* msg_tail;
+  /* pending received messages, one ring per op class */
+  snrf_ring_t payload_ring;
+  snrf_ring_t compl_ring;
+  snrf_ring_t debug_ring;
+  /* messages dropped, unknown op or stale completion */
+  size_t msg_ndrop;
 
   /* snrf_state_xxx */
   uint32_t state;
 
-  /* message rx buffer */
-  uint8_t msg_rbuf[sizeof(snrf_msg_t)];
-  size_t msg_rpos;
+  /* current uart rate */
+  uint32_t uart_baud;
+
+  /* shadow of the device configuration, one bit per key */
+  /* in conf_mask once known. cleared by snrf_sync */
+#define SNRF_CONF_KEY_COUNT 16
+  uint32_t conf_vals[SNRF_CONF_KEY_COUNT];
+  uint32_t conf_mask;
+
+  /* last sequence number used */
+  uint8_t seq;
+
+  /* payload messages in flight, waiting for completion */
+  snrf_window_entry_t window[SNRF_WINDOW_MAX];
+  size_t window_size;
+  size_t window_count;
+  /* a windowed payload completed with an error */
+  unsigned int window_err;
+
+  /* frames queued for transmission, sent with one writev */
+#define SNRF_TX_MSG_COUNT 16
+  uint8_t tx_frames[SNRF_TX_MSG_COUNT][SNRF_FRAME_SIZE_MAX];
+  uint8_t tx_sizes[SNRF_TX_MSG_COUNT];
+  size_t tx_count;
+  /* bytes of the first frame already written */
+  size_t tx_off;
+  /* CLOCK_MONOTONIC time the first message was queued */
+  struct timespec tx_tm;
+  unsigned int flush_policy;
+  unsigned int flush_us;
+
+  /* bytes read but not yet parsed as frames */
+#define SNRF_RX_BUF_SIZE 4096
+  uint8_t rx_buf[SNRF_RX_BUF_SIZE];
+  size_t rx_size;
+  /* discarding input up to the next frame delimiter */
+  unsigned int rx_skip;
+  /* frames dropped, bad crc or encoding, or too long */
+  size_t rx_ncorrupt;
+
+  /* reader thread, running if is_reader. it owns the rx_xxx */
+  /* fields and signals reader_evfd once messages are queued */
+  unsigned int is_reader;
+  unsigned int reader_err;
+  pthread_t reader_thread;
+  int reader_evfd;
+  int reader_stopfd;
+  snrf_spsc_t reader_ring;
+
+  /* snrf_low_latency_xxx in effect */
+  unsigned int low_latency;
+  /* SCHED_FIFO priority of the reader thread, 0 for none */
+  int reader_prio;
+  int reader_cpu;
+  /* the reader thread polls the fd without sleeping */
+  unsigned int is_reader_spin;
+  /* counted in the handles that locked the process memory */
+  unsigned int is_mlock;
+  /* serial settings changed by SNRF_LOW_LATENCY_SERIAL, to be */
+  /* restored. latency_timer -1 if unchanged */
+  unsigned int is_async_low_latency;
+  unsigned int was_async_low_latency;
+  int latency_timer;
+
+  /* submission queue, running if is_submit. producers push */
+  /* to submit_head, the writer thread pops from submit_tail */
+  unsigned int is_submit;
+  snrf_submit_t* submit_head __attribute__((aligned(SNRF_CACHE_LINE_SIZE)));
+  snrf_submit_t* submit_tail __attribute__((aligned(SNRF_CACHE_LINE_SIZE)));
+  snrf_submit_t submit_stub;
+  /* in flight, indexed by seq. completed by the reader thread */
+  snrf_submit_t* submit_seq[256];
+  snrf_submit_slot_t submit_slots[SNRF_WINDOW_MAX];
+  pthread_t writer_thread;
+  int writer_evfd;
+  unsigned int writer_is_idle;
+  unsigned int writer_is_done;
+
+  /* frame trace, recording if is_trace */
+  unsigned int is_trace;
+  snrf_trace_t trace;
+  /* pcap capture, writing if is_capture */
+  unsigned int is_capture;
+  snrf_pcap_t capture;
+
+  /* metrics, cf. snrf_get_stats */
+  snrf_stats_t stats;
+  struct timespec payload_tm;
+  unsigned int is_payload_tm;
+
+  /* synchronization answered, count and cost */
+  uint8_t sync_seq;
+  unsigned int sync_done;
+  size_t sync_count;
+  uint64_t sync_last_ns;
+  uint64_t sync_max_ns;
 
 } snrf_handle_t;
 
+void snrf_init_conf(snrf_conf_t*);
+int snrf_open_with_conf(snrf_handle_t*, const char*, const snrf_conf_t*);
 int snrf_open_with_path(snrf_handle_t*, const char*);
 int snrf_open(snrf_handle_t*);
 int snrf_close(snrf_handle_t*);
 int snrf_sync(snrf_handle_t*);
+int snrf_set_flush_policy(snrf_handle_t*, unsigned int, unsigned int);
+int snrf_flush(snrf_handle_t*);
 int snrf_write_payload(snrf_handle_t*, const uint8_t*, size_t);
+int snrf_write_payload_to(snrf_handle_t*, uint32_t, const uint8_t*, size_t);
+int snrf_write_payloads(snrf_handle_t*, const struct iovec*, size_t, int*);
 int snrf_read_payload(snrf_handle_t*, uint8_t*, size_t*);
+int snrf_read_payloads(snrf_handle_t*, snrf_payload_t*, size_t, size_t*);
+int snrf_peek_payload(snrf_handle_t*, const uint8_t**, size_t*);
+int snrf_peek_payload_until
+(snrf_handle_t*, const uint8_t**, size_t*, const struct timespec*);
+void snrf_release_payload(snrf_handle_t*);
+int snrf_read_payload_until
+(snrf_handle_t*, uint8_t*, size_t*, const struct timespec*);
+int snrf_read_payloads_until
+(snrf_handle_t*, snrf_payload_t*, size_t, size_t*, const struct timespec*);
+void snrf_get_deadline(struct timespec*, unsigned int);
+int snrf_set_window(snrf_handle_t*, size_t);
+int snrf_flush_payloads(snrf_handle_t*);
 int snrf_set_keyval(snrf_handle_t*, uint8_t, uint32_t);
 int snrf_get_keyval(snrf_handle_t*, uint8_t, uint32_t*);
+int snrf_set_keyvals(snrf_handle_t*, const snrf_keyval_t*, size_t);
+int snrf_set_uart_baud(snrf_handle_t*, uint32_t);
+int snrf_submit(snrf_handle_t*, snrf_msg_t*);
+int snrf_post_msg(snrf_handle_t*, snrf_msg_t*);
+int snrf_flush_nowait(snrf_handle_t*);
+void snrf_get_stats(snrf_handle_t*, snrf_stats_t*);
+void snrf_reset_stats(snrf_handle_t*);
+uint64_t snrf_hist_percentile(const snrf_hist_t*, double);
 int snrf_get_pending_msg(snrf_handle_t*, snrf_msg_t*);
 int snrf_read_msg(snrf_handle_t*, snrf_msg_t*);
 
 static inline int snrf_get_fd(snrf_handle_t* snrf)
 {
-  return snrf->serial.fd;
+  /* readable when messages are available */
+  if (snrf->is_reader) return snrf->reader_evfd;
+  return snrf->tr_ops->get_fd(snrf->tr_opaque);
 }
 
 
@@ -0,0 +1,513 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include "snrf_client.h"
+
+
+#define CONFIG_DEBUG 1
+#if CONFIG_DEBUG
+#include <stdio.h>
+#define SNRF_PERROR()					\
+do {							\
+printf("[!] %s, %u\n", __FILE__, __LINE__);		\
+} while (0)
+#else
+#define SNRF_PERROR()
+#endif
+
+
+static int recv_hello(int sock_fd, snrf_client_hello_t* hello, int* fds)
+{
+  /* the hello message carries the ring and wake fds */
+
+  char cbuf[CMSG_SPACE(2 * sizeof(int))];
+  struct cmsghdr* cmsg;
+  struct msghdr mh;
+  struct iovec iov;
+  ssize_t n;
+
+  iov.iov_base = hello;
+  iov.iov_len = sizeof(snrf_client_hello_t);
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = cbuf;
+  mh.msg_controllen = sizeof(cbuf);
+
+  n = recvmsg(sock_fd, &mh, MSG_CMSG_CLOEXEC);
+  if (n != (ssize_t)sizeof(snrf_client_hello_t))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  cmsg = CMSG_FIRSTHDR(&mh);
+  if ((cmsg == NULL) ||
+      (cmsg->cmsg_level != SOL_SOCKET) ||
+      (cmsg->cmsg_type != SCM_RIGHTS) ||
+      (cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+
+  return 0;
+}
+
+static int map_ring(snrf_client_t* client, int fd)
+{
+  const snrf_client_ring_header_t* h;
+  struct stat st;
+  size_t size;
+  void* p;
+
+  if (fstat(fd, &st) ||
+      ((size_t)st.st_size < sizeof(snrf_client_ring_header_t)))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  /* sealed, a writable mapping is refused */
+  p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  client->header = p;
+  client->recs = (snrf_client_rec_t*)(client->header + 1);
+  client->map_size = (size_t)st.st_size;
+
+  h = client->header;
+  size = sizeof(snrf_client_ring_header_t) +
+    (size_t)h->rec_count * sizeof(snrf_client_rec_t);
+
+  if ((h->magic != SNRF_CLIENT_MAGIC) ||
+      (h->version != SNRF_CLIENT_VERSION) ||
+      (h->rec_size != sizeof(snrf_client_rec_t)) ||
+      (h->rec_count == 0) ||
+      (h->rec_count & (h->rec_count - 1)) ||
+      (size > client->map_size))
+  {
+    SNRF_PERROR();
+    munmap(p, client->map_size);
+    return -1;
+  }
+
+  client->mask = h->rec_count - 1;
+
+  return 0;
+}
+
+static int map_wake(snrf_client_t* client, int fd)
+{
+  struct stat st;
+  void* p;
+
+  if (fstat(fd, &st) || ((size_t)st.st_size < sizeof(snrf_client_wake_t)))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  p = mmap(NULL, sizeof(snrf_client_wake_t), PROT_READ | PROT_WRITE,
+	   MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  client->wake = p;
+
+  return 0;
+}
+
+static int send_req
+(snrf_client_t* client, snrf_client_req_t* req, uint32_t* seq)
+{
+  /* blocks while the daemon lags, which throttles the client */
+  /* seq set to the request one, can be NULL */
+
+  ssize_t n;
+
+  req->seq = ++client->seq;
+  if (seq != NULL) *seq = req->seq;
+
+  do n = send(client->sock_fd, req, sizeof(snrf_client_req_t), 0);
+  while ((n == -1) && (errno == EINTR));
+
+  if (n != (ssize_t)sizeof(snrf_client_req_t))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+static int wait_ring
+(snrf_client_t* client, uint32_t wake, const struct timespec* deadline)
+{
+  /* sleep until wake changes or the CLOCK_MONOTONIC deadline */
+  /* return -2 at the deadline */
+
+  snrf_client_wake_t* const w = client->wake;
+  struct timespec now;
+  struct timespec rel;
+  struct timespec* relp = NULL;
+  long err;
+
+  if (deadline != NULL)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    rel.tv_sec = deadline->tv_sec - now.tv_sec;
+    rel.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (rel.tv_nsec < 0)
+    {
+      rel.tv_nsec += 1000000000;
+      --rel.tv_sec;
+    }
+
+    if (rel.tv_sec < 0) return -2;
+    relp = &rel;
+  }
+
+  /* shared between processes, not FUTEX_PRIVATE_FLAG */
+  err = syscall(SYS_futex, &w->wake, FUTEX_WAIT, wake, relp, NULL, 0);
+  if ((err == -1) && (errno == ETIMEDOUT)) return -2;
+
+  /* woken, interrupted, or wake already changed */
+  return 0;
+}
+
+
+/* exported */
+
+int snrf_client_open(snrf_client_t* client, const char* path)
+{
+  /* path NULL for SNRF_CLIENT_PATH_DEFAULT. the payloads */
+  /* received from now on are readable */
+
+  struct sockaddr_un sa;
+  snrf_client_hello_t hello;
+  int fds[2];
+
+  if (path == NULL) path = SNRF_CLIENT_PATH_DEFAULT;
+
+  if (strlen(path) >= sizeof(sa.sun_path))
+  {
+    SNRF_PERROR();
+    goto on_error_0;
+  }
+
+  client->sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (client->sock_fd == -1)
+  {
+    SNRF_PERROR();
+    goto on_error_0;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, path);
+
+  if (connect(client->sock_fd, (const struct sockaddr*)&sa, sizeof(sa)))
+  {
+    SNRF_PERROR();
+    goto on_error_1;
+  }
+
+  if (recv_hello(client->sock_fd, &hello, fds))
+  {
+    SNRF_PERROR();
+    goto on_error_1;
+  }
+
+  if ((hello.magic != SNRF_CLIENT_MAGIC) ||
+      (hello.version != SNRF_CLIENT_VERSION) ||
+      (hello.id >= SNRF_CLIENT_MAX))
+  {
+    SNRF_PERROR();
+    goto on_error_2;
+  }
+
+  if (map_ring(client, fds[0]))
+  {
+    SNRF_PERROR();
+    goto on_error_2;
+  }
+
+  if (map_wake(client, fds[1]))
+  {
+    SNRF_PERROR();
+    goto on_error_3;
+  }
+
+  /* the mappings hold the files */
+  close(fds[0]);
+  close(fds[1]);
+
+  client->bit = (uint64_t)1 << hello.id;
+  client->cursor = __atomic_load_n(&client->header->head, __ATOMIC_ACQUIRE);
+  client->nlost = 0;
+  client->seq = 0;
+
+  return 0;
+
+ on_error_3:
+  munmap((void*)client->header, client->map_size);
+ on_error_2:
+  close(fds[0]);
+  close(fds[1]);
+ on_error_1:
+  close(client->sock_fd);
+ on_error_0:
+  return -1;
+}
+
+void snrf_client_close(snrf_client_t* client)
+{
+  munmap(client->wake, sizeof(snrf_client_wake_t));
+  munmap((void*)client->header, client->map_size);
+  close(client->sock_fd);
+}
+
+void snrf_client_init_filter(snrf_client_filter_t* filter)
+{
+  memset(filter, 0, sizeof(snrf_client_filter_t));
+}
+
+int snrf_client_add_rule
+(
+ snrf_client_filter_t* filter, size_t off,
+ const uint8_t* val, const uint8_t* mask, size_t size
+)
+{
+  /* mask NULL to compare all the bits */
+
+  snrf_client_rule_t* rule;
+  size_t i;
+
+  if ((filter->nrules == SNRF_CLIENT_RULE_MAX) ||
+      (size == 0) || (size > SNRF_CLIENT_RULE_SIZE_MAX) ||
+      ((off + size) > SNRF_MAX_PAYLOAD_WIDTH))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  rule = &filter->rules[filter->nrules++];
+  rule->off = (uint8_t)off;
+  rule->size = (uint8_t)size;
+
+  for (i = 0; i != size; ++i)
+  {
+    rule->mask[i] = (mask == NULL) ? 0xff : mask[i];
+    rule->val[i] = val[i] & rule->mask[i];
+  }
+
+  return 0;
+}
+
+int snrf_client_set_filter
+(snrf_client_t* client, const snrf_client_filter_t* filter, uint32_t* seq)
+{
+  /* applies to the payloads received once the daemon reads it, */
+  /* which its completion tells */
+
+  snrf_client_req_t req;
+
+  memset(&req, 0, sizeof(req));
+  req.op = SNRF_CLIENT_OP_FILTER;
+  req.u.filter = *filter;
+
+  return send_req(client, &req, seq);
+}
+
+int snrf_client_write_payload
+(snrf_client_t* client, const uint8_t* buf, size_t size, uint32_t* seq)
+{
+  snrf_client_req_t req;
+
+  if (size > SNRF_MAX_PAYLOAD_WIDTH)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.op = SNRF_CLIENT_OP_WRITE;
+  req.size = (uint8_t)size;
+  memcpy(req.u.data, buf, size);
+
+  return send_req(client, &req, seq);
+}
+
+int snrf_client_write_payload_to
+(
+ snrf_client_t* client, uint32_t addr,
+ const uint8_t* buf, size_t size, uint32_t* seq
+)
+{
+  snrf_client_req_t req;
+
+  if (size > SNRF_MAX_PAYLOAD_WIDTH)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.op = SNRF_CLIENT_OP_WRITE_TO;
+  req.size = (uint8_t)size;
+  req.addr = addr;
+  memcpy(req.u.data, buf, size);
+
+  return send_req(client, &req, seq);
+}
+
+int snrf_client_read_payload_until
+(
+ snrf_client_t* client, uint8_t* buf, size_t* size, uint64_t* ns,
+ const struct timespec* deadline
+)
+{
+  /* next payload matching the filter, copied from the ring. */
+  /* ns its receive time, can be NULL. deadline NULL to wait */
+  /* forever. return -2 at the deadline */
+
+  const snrf_client_ring_header_t* const h = client->header;
+  snrf_client_wake_t* const w = client->wake;
+  const snrf_client_rec_t* rec;
+  snrf_client_rec_t copy;
+  uint64_t head;
+  uint64_t seq;
+  uint32_t wake;
+  int err;
+
+  while (1)
+  {
+    /* read wake first, a matching publication after it */
+    /* changes it */
+    wake = __atomic_load_n(&w->wake, __ATOMIC_ACQUIRE);
+    head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+
+    if (client->cursor == head)
+    {
+      __atomic_store_n(&w->nwaiters, 1, __ATOMIC_SEQ_CST);
+      err = wait_ring(client, wake, deadline);
+      __atomic_store_n(&w->nwaiters, 0, __ATOMIC_SEQ_CST);
+      if (err) return err;
+      continue ;
+    }
+
+    /* overtaken, skip to the oldest record kept */
+    if ((head - client->cursor) > (client->mask + 1))
+    {
+      client->nlost += (size_t)(head - client->cursor - (client->mask + 1));
+      client->cursor = head - (client->mask + 1);
+    }
+
+    rec = &client->recs[client->cursor & client->mask];
+
+    seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+    memcpy(&copy, rec, sizeof(copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    /* rewritten while copied */
+    if ((seq != (client->cursor + 1)) ||
+	(__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != seq))
+    {
+      ++client->nlost;
+      ++client->cursor;
+      continue ;
+    }
+
+    ++client->cursor;
+
+    if ((copy.mask & client->bit) == 0) continue ;
+    if (copy.size > SNRF_MAX_PAYLOAD_WIDTH) continue ;
+
+    memcpy(buf, copy.data, copy.size);
+    *size = copy.size;
+    if (ns != NULL) *ns = copy.ns;
+
+    return 0;
+  }
+
+  /* not reached */
+  return 0;
+}
+
+int snrf_client_read_compl_until
+(
+ snrf_client_t* client, snrf_client_compl_t* compl,
+ const struct timespec* deadline
+)
+{
+  /* next completion, in the order the requests were sent. */
+  /* deadline NULL to wait forever. return -2 at the deadline */
+
+  struct pollfd pfd;
+  struct timespec now;
+  int64_t ns;
+  int ms = -1;
+  ssize_t n;
+  int err;
+
+  while (1)
+  {
+    n = recv(client->sock_fd, compl, sizeof(snrf_client_compl_t), MSG_DONTWAIT);
+    if (n == (ssize_t)sizeof(snrf_client_compl_t)) return 0;
+
+    /* hung up, or not a completion */
+    if ((n >= 0) || ((errno != EAGAIN) && (errno != EINTR)))
+    {
+      SNRF_PERROR();
+      return -1;
+    }
+
+    if (deadline != NULL)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      ns = (int64_t)(deadline->tv_sec - now.tv_sec) * 1000000000 +
+	(deadline->tv_nsec - now.tv_nsec);
+      if (ns <= 0) return -2;
+
+      /* rounded up, not to spin before the deadline */
+      ns = (ns + 999999) / 1000000;
+      ms = (ns > INT_MAX) ? INT_MAX : (int)ns;
+    }
+
+    pfd.fd = client->sock_fd;
+    pfd.events = POLLIN;
+    err = poll(&pfd, 1, ms);
+    if ((err == -1) && (errno != EINTR))
+    {
+      SNRF_PERROR();
+      return -1;
+    }
+  }
+
+  /* not reached */
+  return 0;
+}
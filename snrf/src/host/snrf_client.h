@@ -0,0 +1,185 @@
+#ifndef SNRF_CLIENT_H_INCLUDED
+#define SNRF_CLIENT_H_INCLUDED
+
+
+/* client of snrfd, the daemon owning the bridge. requests go */
+/* over a unix seqpacket socket, one per packet, and are sent */
+/* to the device in the order the daemon reads them. each is */
+/* answered by a completion on the same socket. received */
+/* payloads are published once in a shared memory ring, passed */
+/* at connection time. each client reads it at its own cursor */
+/* and skips the records its filter does not match. the ring */
+/* is sealed read only, a client only writes its own wake word */
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "snrf_common.h"
+
+#define SNRF_CLIENT_PATH_DEFAULT "/tmp/snrfd.sock"
+
+#define SNRF_CLIENT_MAGIC 0x44524e53
+#define SNRF_CLIENT_VERSION 2
+
+/* clients served at once, one bit each in the records */
+#define SNRF_CLIENT_MAX 64
+
+typedef struct snrf_client_ring_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t rec_size;
+  /* capacity, power of 2 */
+  uint32_t rec_count;
+  /* records published since creation, free running. only */
+  /* the daemon writes it, after the record */
+  uint64_t head;
+  uint8_t pad[40];
+} __attribute__((packed)) snrf_client_ring_header_t;
+
+typedef struct snrf_client_wake
+{
+  /* one per client, in its own writable mapping. futex word, */
+  /* incremented after each record the client filter matches */
+  uint32_t wake;
+  /* set while the client sleeps on wake */
+  uint32_t nwaiters;
+} __attribute__((packed)) snrf_client_wake_t;
+
+typedef struct snrf_client_rec
+{
+  /* index + 1, written last. a reader finding another value */
+  /* was overtaken by the daemon */
+  uint64_t seq;
+  /* bit n set if the filter of client n matches */
+  uint64_t mask;
+  /* CLOCK_MONOTONIC receive time, in nanoseconds */
+  uint64_t ns;
+  uint8_t size;
+  uint8_t data[SNRF_MAX_PAYLOAD_WIDTH];
+  uint8_t pad[7];
+} __attribute__((packed)) snrf_client_rec_t;
+
+typedef struct snrf_client_rule
+{
+  /* (data[off + i] & mask[i]) == val[i], for i < size */
+  uint8_t off;
+  uint8_t size;
+#define SNRF_CLIENT_RULE_SIZE_MAX 4
+  uint8_t mask[SNRF_CLIENT_RULE_SIZE_MAX];
+  uint8_t val[SNRF_CLIENT_RULE_SIZE_MAX];
+} __attribute__((packed)) snrf_client_rule_t;
+
+typedef struct snrf_client_filter
+{
+  /* all the rules match. no rule matches any payload. the */
+  /* radio does not tell the sender address, an address filter */
+  /* is a rule on the bytes the application puts it in */
+#define SNRF_CLIENT_RULE_MAX 4
+  uint8_t nrules;
+  snrf_client_rule_t rules[SNRF_CLIENT_RULE_MAX];
+} __attribute__((packed)) snrf_client_filter_t;
+
+typedef struct snrf_client_req
+{
+  /* chosen by the client, returned in the completion */
+  uint32_t seq;
+  /* snrf_client_op_xxx */
+#define SNRF_CLIENT_OP_WRITE 0
+#define SNRF_CLIENT_OP_WRITE_TO 1
+#define SNRF_CLIENT_OP_FILTER 2
+  uint8_t op;
+  uint8_t size;
+  uint32_t addr;
+  union
+  {
+    uint8_t data[SNRF_MAX_PAYLOAD_WIDTH];
+    snrf_client_filter_t filter;
+  } u;
+} __attribute__((packed)) snrf_client_req_t;
+
+typedef struct snrf_client_compl
+{
+  /* answer to the request of the same seq */
+  uint32_t seq;
+  /* snrf_client_status_xxx */
+#define SNRF_CLIENT_STATUS_SUCCESS 0
+  /* the device completed the payload with err */
+#define SNRF_CLIENT_STATUS_DEVICE 1
+  /* the device did not complete the payload in time */
+#define SNRF_CLIENT_STATUS_TIMEOUT 2
+  /* the request is invalid, the daemon hangs up */
+#define SNRF_CLIENT_STATUS_MALFORMED 3
+  uint8_t status;
+  /* snrf_err_xxx, for SNRF_CLIENT_STATUS_DEVICE */
+  uint8_t err;
+} __attribute__((packed)) snrf_client_compl_t;
+
+typedef struct snrf_client_hello
+{
+  /* sent by the daemon with the ring fd, then the wake fd */
+  uint32_t magic;
+  uint32_t version;
+  /* bit of the client in snrf_client_rec_t.mask */
+  uint32_t id;
+} __attribute__((packed)) snrf_client_hello_t;
+
+typedef struct snrf_client
+{
+  int sock_fd;
+
+  const snrf_client_ring_header_t* header;
+  const snrf_client_rec_t* recs;
+  size_t mask;
+  size_t map_size;
+  snrf_client_wake_t* wake;
+
+  /* seq of the last request */
+  uint32_t seq;
+
+  uint64_t bit;
+  uint64_t cursor;
+  /* records overwritten before being read, matching or not */
+  size_t nlost;
+} snrf_client_t;
+
+
+int snrf_client_open(snrf_client_t*, const char*);
+void snrf_client_close(snrf_client_t*);
+void snrf_client_init_filter(snrf_client_filter_t*);
+int snrf_client_add_rule
+(snrf_client_filter_t*, size_t, const uint8_t*, const uint8_t*, size_t);
+int snrf_client_set_filter
+(snrf_client_t*, const snrf_client_filter_t*, uint32_t*);
+int snrf_client_write_payload
+(snrf_client_t*, const uint8_t*, size_t, uint32_t*);
+int snrf_client_write_payload_to
+(snrf_client_t*, uint32_t, const uint8_t*, size_t, uint32_t*);
+int snrf_client_read_payload_until
+(snrf_client_t*, uint8_t*, size_t*, uint64_t*, const struct timespec*);
+int snrf_client_read_compl_until
+(snrf_client_t*, snrf_client_compl_t*, const struct timespec*);
+
+static inline unsigned int snrf_client_match
+(const snrf_client_filter_t* filter, const uint8_t* data, size_t size)
+{
+  const snrf_client_rule_t* rule;
+  size_t i;
+  size_t j;
+
+  for (i = 0; i != filter->nrules; ++i)
+  {
+    rule = &filter->rules[i];
+    if (((size_t)rule->off + rule->size) > size) return 0;
+
+    for (j = 0; j != rule->size; ++j)
+    {
+      if ((data[rule->off + j] & rule->mask[j]) != rule->val[j]) return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+#endif /* SNRF_CLIENT_H_INCLUDED */
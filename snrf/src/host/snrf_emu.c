@@ -0,0 +1,901 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include "snrf_emu.h"
+
+
+#define CONFIG_DEBUG 1
+#if CONFIG_DEBUG
+#include <stdio.h>
+#define SNRF_PERROR()					\
+do {							\
+printf("[!] %s, %u\n", __FILE__, __LINE__);		\
+} while (0)
+#else
+#define SNRF_PERROR()
+#endif
+
+#define OUT_MASK (SNRF_EMU_OUT_COUNT - 1)
+
+
+/* time and randomness */
+
+static inline uint64_t get_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned int is_lost(snrf_emu_t* emu, uint32_t ppm)
+{
+  /* xorshift32 */
+
+  uint32_t x = emu->rand_state;
+
+  if (ppm == 0) return 0;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  emu->rand_state = x;
+
+  return (x % 1000000) < ppm;
+}
+
+
+/* frames to the host */
+
+static inline uint64_t get_uart_ns(uint32_t baud, size_t size)
+{
+  /* start, 8 data and stop bits a byte */
+  return (uint64_t)size * 10 * 1000000000 / baud;
+}
+
+static uint64_t get_tx_ns(const snrf_emu_t* emu, const snrf_emu_frame_t* f)
+{
+  /* time the last byte of f is sent, once ready and once the */
+  /* previous frame is sent */
+
+  const uint64_t ns = (f->ns > emu->tx_ns) ? f->ns : emu->tx_ns;
+  return ns + get_uart_ns(f->baud, f->size);
+}
+
+static void push_msg(snrf_emu_t* emu, uint64_t ns, const snrf_msg_t* msg)
+{
+  /* insert in time order. a partially read frame stays first */
+
+  const size_t first = emu->out_head + (emu->out_off ? 1 : 0);
+  snrf_emu_frame_t* f;
+  size_t i;
+
+  if (is_lost(emu, emu->conf.uart_loss_ppm)) return ;
+
+  /* the host does not read, as a full tty buffer */
+  if ((emu->out_tail - emu->out_head) == SNRF_EMU_OUT_COUNT) return ;
+
+  for (i = emu->out_tail; i != first; --i)
+  {
+    if (emu->out[(i - 1) & OUT_MASK].ns <= ns) break ;
+    emu->out[i & OUT_MASK] = emu->out[(i - 1) & OUT_MASK];
+  }
+
+  f = &emu->out[i & OUT_MASK];
+  f->ns = ns;
+  f->baud = emu->baud;
+  f->size = snrf_frame_encode_msg(f->buf, msg);
+  ++emu->out_tail;
+}
+
+static void push_payload(snrf_emu_t* emu, uint64_t ns, const uint8_t* data)
+{
+  /* the radio receives payload width bytes */
+
+  snrf_msg_t msg;
+
+  if (is_lost(emu, emu->conf.radio_loss_ppm)) return ;
+
+  msg.op = SNRF_OP_PAYLOAD;
+  msg.seq = 0x00;
+  msg.u.payload.size = (uint8_t)emu->vals[SNRF_KEY_PAYLOAD_WIDTH];
+  memcpy(msg.u.payload.data, data, msg.u.payload.size);
+
+  push_msg(emu, ns, &msg);
+}
+
+static void push_peers(snrf_emu_t* emu, uint64_t now)
+{
+  /* payloads sent by peers up to now */
+
+  uint8_t data[SNRF_MAX_PAYLOAD_WIDTH];
+  size_t i;
+
+  if ((emu->conf.rx_rate == 0) || (emu->state != SNRF_STATE_TXRX)) return ;
+
+  for (; emu->peer_ns <= now; emu->peer_ns += 1000000000 / emu->conf.rx_rate)
+  {
+    memset(data, emu->peer_count++, sizeof(data));
+    if (emu->conf.is_peer_ns)
+    {
+      for (i = 0; i != sizeof(uint64_t); ++i)
+	data[i] = (uint8_t)(emu->peer_ns >> (i * 8));
+    }
+    push_payload(emu, emu->peer_ns, data);
+  }
+}
+
+
+/* message handlers, as in dev/main.c */
+
+#define MAKE_COMPL_ERROR(__m, __e)		\
+do {						\
+  (__m)->op = SNRF_OP_COMPL;			\
+  (__m)->u.compl.err = __e;			\
+  (__m)->u.compl.val = 0;			\
+} while (0)
+
+static uint64_t get_airtime_ns(const snrf_emu_t* emu)
+{
+  /* settling, then preamble, address, payload and crc */
+
+  static const uint32_t bps[] = { 50000, 250000, 1000000, 2000000 };
+  uint64_t nbits;
+  uint64_t settle_ns;
+  uint32_t rate;
+
+  nbits = 8 * (1 + emu->vals[SNRF_KEY_ADDR_WIDTH] + emu->vals[SNRF_KEY_PAYLOAD_WIDTH]);
+  nbits += 8 * emu->vals[SNRF_KEY_CRC];
+
+  if (emu->conf.chipset == SNRF_CHIPSET_NRF905)
+  {
+    rate = SNRF_RATE_50KBPS;
+    settle_ns = 650000;
+  }
+  else
+  {
+    /* packet control field */
+    nbits += 9;
+    rate = emu->vals[SNRF_KEY_RATE];
+    settle_ns = 130000;
+  }
+
+  return settle_ns + (nbits * 1000000000) / bps[rate & 3];
+}
+
+static uint8_t check_keyval
+(const snrf_emu_t* emu, uint32_t state, uint8_t key, uint32_t val)
+{
+  const unsigned int is_nrf905 = (emu->conf.chipset == SNRF_CHIPSET_NRF905);
+
+  if ((state != SNRF_STATE_CONF) &&
+      (key != SNRF_KEY_STATE) && (key != SNRF_KEY_UART_BAUD))
+    return SNRF_ERR_VAL;
+
+  switch (key)
+  {
+  case SNRF_KEY_STATE:
+    if (val >= SNRF_STATE_MAX) return SNRF_ERR_VAL;
+    break ;
+
+  case SNRF_KEY_CRC:
+    if (val > SNRF_CRC_16) return SNRF_ERR_VAL;
+    break ;
+
+  case SNRF_KEY_RATE:
+    if (is_nrf905) return SNRF_ERR_KEY;
+    if ((val == 0) || (val > 3)) return SNRF_ERR_VAL;
+    break ;
+
+  case SNRF_KEY_CHAN:
+    if (is_nrf905) return SNRF_ERR_KEY;
+    break ;
+
+  case SNRF_KEY_ADDR_WIDTH:
+    if (is_nrf905 && ((val < 1) || (val > 4))) return SNRF_ERR_VAL;
+    if (!is_nrf905 && ((val < 3) || (val > 5))) return SNRF_ERR_VAL;
+    break ;
+
+  case SNRF_KEY_RX_ADDR:
+  case SNRF_KEY_TX_ADDR:
+  case SNRF_KEY_UART_FLAGS:
+    break ;
+
+  case SNRF_KEY_TX_ACK:
+    if (val > 1) return SNRF_ERR_VAL;
+    break ;
+
+  case SNRF_KEY_PAYLOAD_WIDTH:
+    if (val > SNRF_MAX_PAYLOAD_WIDTH) return SNRF_ERR_VAL;
+    break ;
+
+  case SNRF_KEY_UART_BAUD:
+    if ((val != SNRF_UART_BAUD_DEFAULT) &&
+	(val != SNRF_UART_BAUD_250K) &&
+	(val != SNRF_UART_BAUD_500K) &&
+	(val != SNRF_UART_BAUD_1M))
+      return SNRF_ERR_VAL;
+    break ;
+
+  default:
+    return SNRF_ERR_KEY;
+  }
+
+  return SNRF_ERR_SUCCESS;
+}
+
+static void apply_keyval(snrf_emu_t* emu, uint8_t key, uint32_t val, uint64_t ns)
+{
+  /* checked by check_keyval. the uart rate is applied by */
+  /* handle_frame, the probation is not emulated */
+
+  if (key == SNRF_KEY_STATE)
+  {
+    /* peers are heard from now on */
+    if ((val == SNRF_STATE_TXRX) && (emu->state != SNRF_STATE_TXRX) &&
+	emu->conf.rx_rate)
+      emu->peer_ns = ns + 1000000000 / emu->conf.rx_rate;
+    emu->state = val;
+  }
+
+  emu->vals[key] = val;
+}
+
+static void handle_set_msg(snrf_emu_t* emu, snrf_msg_t* msg, uint64_t ns)
+{
+  const uint8_t key = msg->u.set.key;
+  const uint32_t val = le32toh(msg->u.set.val);
+  const uint8_t err = check_keyval(emu, emu->state, key, val);
+
+  if (err != SNRF_ERR_SUCCESS)
+  {
+    MAKE_COMPL_ERROR(msg, err);
+    return ;
+  }
+
+  apply_keyval(emu, key, val, ns);
+
+  MAKE_COMPL_ERROR(msg, SNRF_ERR_SUCCESS);
+}
+
+static void handle_set_multi_msg(snrf_emu_t* emu, snrf_msg_t* msg, uint64_t ns)
+{
+  uint32_t state = emu->state;
+  uint8_t err;
+  uint8_t i;
+
+  for (i = 0; i != SNRF_SET_MULTI_MAX; ++i)
+  {
+    if (msg->u.set_multi.pairs[i].key == SNRF_KEY_NONE) break ;
+
+    /* the uart rate is only set alone, as the host switches too */
+    if (msg->u.set_multi.pairs[i].key == SNRF_KEY_UART_BAUD)
+      err = SNRF_ERR_VAL;
+    else err = check_keyval
+      (emu, state, msg->u.set_multi.pairs[i].key, le32toh(msg->u.set_multi.pairs[i].val));
+
+    if (err != SNRF_ERR_SUCCESS)
+    {
+      MAKE_COMPL_ERROR(msg, err);
+      msg->u.compl.val = htole32(i);
+      return ;
+    }
+
+    if (msg->u.set_multi.pairs[i].key == SNRF_KEY_STATE)
+      state = le32toh(msg->u.set_multi.pairs[i].val);
+  }
+
+  for (i = 0; i != SNRF_SET_MULTI_MAX; ++i)
+  {
+    if (msg->u.set_multi.pairs[i].key == SNRF_KEY_NONE) break ;
+    apply_keyval
+      (emu, msg->u.set_multi.pairs[i].key, le32toh(msg->u.set_multi.pairs[i].val), ns);
+  }
+
+  MAKE_COMPL_ERROR(msg, SNRF_ERR_SUCCESS);
+}
+
+static void handle_get_msg(snrf_emu_t* emu, snrf_msg_t* msg)
+{
+  const uint8_t key = msg->u.get.key;
+
+  MAKE_COMPL_ERROR(msg, SNRF_ERR_SUCCESS);
+
+  switch (key)
+  {
+  case SNRF_KEY_RATE:
+    if (emu->conf.chipset == SNRF_CHIPSET_NRF905)
+      msg->u.compl.val = htole32(SNRF_RATE_50KBPS);
+    else
+      msg->u.compl.val = htole32(emu->vals[key]);
+    break ;
+
+  case SNRF_KEY_CHAN:
+    if (emu->conf.chipset == SNRF_CHIPSET_NRF905)
+      MAKE_COMPL_ERROR(msg, SNRF_ERR_KEY);
+    else
+      msg->u.compl.val = htole32(emu->vals[key]);
+    break ;
+
+  case SNRF_KEY_STATE:
+  case SNRF_KEY_CRC:
+  case SNRF_KEY_ADDR_WIDTH:
+  case SNRF_KEY_RX_ADDR:
+  case SNRF_KEY_TX_ADDR:
+  case SNRF_KEY_TX_ACK:
+  case SNRF_KEY_PAYLOAD_WIDTH:
+  case SNRF_KEY_UART_FLAGS:
+  case SNRF_KEY_UART_BAUD:
+  case SNRF_KEY_NRF_CHIPSET:
+    msg->u.compl.val = htole32(emu->vals[key]);
+    break ;
+
+  case SNRF_KEY_UART_NCORRUPT:
+    msg->u.compl.val = htole32(emu->ncorrupt);
+    break ;
+
+  default:
+    MAKE_COMPL_ERROR(msg, SNRF_ERR_KEY);
+    break ;
+  }
+}
+
+static uint64_t handle_payload_msg(snrf_emu_t* emu, snrf_msg_t* msg, uint64_t ns)
+{
+  /* return the time the radio is done */
+
+  uint8_t data[SNRF_MAX_PAYLOAD_WIDTH];
+
+  if (emu->state != SNRF_STATE_TXRX)
+  {
+    MAKE_COMPL_ERROR(msg, SNRF_ERR_STATE);
+    return ns;
+  }
+
+  memset(data, 0x2a, sizeof(data));
+  memcpy(data, msg->u.payload.data, msg->u.payload.size);
+
+  ns += get_airtime_ns(emu);
+
+  if (emu->conf.is_loopback) push_payload(emu, ns, data);
+
+  MAKE_COMPL_ERROR(msg, SNRF_ERR_SUCCESS);
+
+  return ns;
+}
+
+static uint64_t handle_payload_to_msg(snrf_emu_t* emu, snrf_msg_t* msg, uint64_t ns)
+{
+  const uint32_t addr = le32toh(msg->u.payload_to.addr);
+  const uint8_t size = msg->u.payload_to.size;
+
+  if (emu->state != SNRF_STATE_TXRX)
+  {
+    MAKE_COMPL_ERROR(msg, SNRF_ERR_STATE);
+    return ns;
+  }
+
+  emu->vals[SNRF_KEY_TX_ADDR] = addr;
+
+  memmove(msg->u.payload.data, msg->u.payload_to.data, size);
+  msg->u.payload.size = size;
+
+  return handle_payload_msg(emu, msg, ns);
+}
+
+static uint64_t handle_msg(snrf_emu_t* emu, snrf_msg_t* msg, uint64_t ns)
+{
+  /* msg replaced by its answer. return the answer time */
+
+  switch (msg->op)
+  {
+  case SNRF_OP_SET:
+    handle_set_msg(emu, msg, ns);
+    break ;
+
+  case SNRF_OP_SET_MULTI:
+    handle_set_multi_msg(emu, msg, ns);
+    break ;
+
+  case SNRF_OP_GET:
+    handle_get_msg(emu, msg);
+    break ;
+
+  case SNRF_OP_PAYLOAD:
+    return handle_payload_msg(emu, msg, ns);
+
+  case SNRF_OP_PAYLOAD_TO:
+    return handle_payload_to_msg(emu, msg, ns);
+
+  case SNRF_OP_SYNC:
+    /* the op is kept, so that the host recognizes the answer */
+    msg->u.compl.err = SNRF_ERR_SUCCESS;
+    msg->u.compl.val = htole32(emu->state);
+    break ;
+
+  default:
+    MAKE_COMPL_ERROR(msg, SNRF_ERR_OP);
+    break ;
+  }
+
+  return ns;
+}
+
+static void handle_frame(snrf_emu_t* emu, uint64_t now)
+{
+  /* as do_uart. a frame arriving while all the device slots */
+  /* are filled is missed, unless it is a SYNC and the sync */
+  /* slot is free */
+
+  snrf_msg_t* msg;
+  uint64_t* slot;
+  uint64_t ns;
+  size_t i;
+
+  if (is_lost(emu, emu->conf.uart_loss_ppm))
+  {
+    ++emu->ncorrupt;
+    return ;
+  }
+
+  msg = snrf_frame_decode_msg(emu->in_buf, (uint8_t)emu->in_size);
+  if (msg == NULL)
+  {
+    ++emu->ncorrupt;
+    return ;
+  }
+
+  for (i = 0; (i != SNRF_WINDOW_MAX) && (emu->slot_ns[i] > now); ++i) ;
+  if (i != SNRF_WINDOW_MAX) slot = &emu->slot_ns[i];
+  else if ((msg->op == SNRF_OP_SYNC) && (emu->sync_ns <= now))
+    slot = &emu->sync_ns;
+  else
+  {
+    ++emu->ncorrupt;
+    return ;
+  }
+
+  /* messages are processed in order, after the radio is done */
+  ns = (emu->busy_ns > now) ? emu->busy_ns : now;
+  *slot = ns;
+
+  ns = handle_msg(emu, msg, ns);
+  emu->busy_ns = ns;
+
+  push_msg(emu, ns, msg);
+
+  /* the completion went at the previous rate */
+  emu->baud = emu->vals[SNRF_KEY_UART_BAUD];
+}
+
+
+/* exported */
+
+void snrf_emu_init_conf(snrf_emu_conf_t* conf)
+{
+  conf->chipset = SNRF_CHIPSET_NRF24L01P;
+  conf->uart_loss_ppm = 0;
+  conf->radio_loss_ppm = 0;
+  conf->is_loopback = 1;
+  conf->rx_rate = 0;
+  conf->is_peer_ns = 0;
+  conf->seed = 1;
+}
+
+void snrf_emu_init(snrf_emu_t* emu, const snrf_emu_conf_t* conf)
+{
+  /* the device as after a reset */
+
+  memset(emu, 0, sizeof(snrf_emu_t));
+
+  if (conf == NULL) snrf_emu_init_conf(&emu->conf);
+  else emu->conf = *conf;
+
+  emu->state = SNRF_STATE_CONF;
+  emu->vals[SNRF_KEY_STATE] = SNRF_STATE_CONF;
+  emu->vals[SNRF_KEY_CRC] = SNRF_CRC_16;
+  emu->vals[SNRF_KEY_RATE] = SNRF_RATE_1MBPS;
+  emu->vals[SNRF_KEY_CHAN] = 2;
+  emu->vals[SNRF_KEY_RX_ADDR] = 0xe7e7e7e7;
+  emu->vals[SNRF_KEY_TX_ADDR] = 0xe7e7e7e7;
+  emu->vals[SNRF_KEY_PAYLOAD_WIDTH] = SNRF_MAX_PAYLOAD_WIDTH;
+  emu->vals[SNRF_KEY_NRF_CHIPSET] = emu->conf.chipset;
+  emu->vals[SNRF_KEY_UART_BAUD] = SNRF_UART_BAUD_DEFAULT;
+  emu->baud = SNRF_UART_BAUD_DEFAULT;
+
+  if (emu->conf.chipset == SNRF_CHIPSET_NRF905)
+    emu->vals[SNRF_KEY_ADDR_WIDTH] = 4;
+  else
+    emu->vals[SNRF_KEY_ADDR_WIDTH] = 5;
+
+  emu->rand_state = emu->conf.seed ? emu->conf.seed : 1;
+  emu->master_fd = -1;
+  emu->slave_fd = -1;
+  emu->stop_fd = -1;
+}
+
+void snrf_emu_input(snrf_emu_t* emu, const uint8_t* buf, size_t size)
+{
+  /* bytes from the host, as USART_RX_vect. they are written */
+  /* at once, each is received one byte time after the other */
+
+  const uint64_t now = get_now_ns();
+  const uint64_t byte_ns = get_uart_ns(emu->baud, 1);
+  size_t i;
+
+  push_peers(emu, now);
+
+  if (emu->rx_ns < now) emu->rx_ns = now;
+
+  /* garbled, the device reads at another rate */
+  if (emu->host_baud && (emu->host_baud != emu->baud)) emu->in_skip = 1;
+
+  for (i = 0; i != size; ++i)
+  {
+    emu->rx_ns += byte_ns;
+
+    if (buf[i] == SNRF_FRAME_DELIM)
+    {
+      if (emu->in_skip) ++emu->ncorrupt;
+      else if (emu->in_size) handle_frame(emu, emu->rx_ns);
+      emu->in_size = 0;
+      emu->in_skip = 0;
+      continue ;
+    }
+
+    if (emu->in_skip) continue ;
+
+    /* too long, drop up to the next delimiter */
+    if (emu->in_size == SNRF_FRAME_SIZE_MAX)
+    {
+      emu->in_skip = 1;
+      continue ;
+    }
+
+    emu->in_buf[emu->in_size++] = buf[i];
+  }
+}
+
+size_t snrf_emu_output(snrf_emu_t* emu, uint8_t* buf, size_t size)
+{
+  /* bytes to the host whose time has come */
+
+  const uint64_t now = get_now_ns();
+  snrf_emu_frame_t* f;
+  uint64_t ns;
+  size_t n = 0;
+  size_t k;
+
+  push_peers(emu, now);
+
+  while ((emu->out_head != emu->out_tail) && (n != size))
+  {
+    f = &emu->out[emu->out_head & OUT_MASK];
+
+    /* a frame is read once fully sent */
+    if (emu->out_off == 0)
+    {
+      ns = get_tx_ns(emu, f);
+      if (ns > now) break ;
+      emu->tx_ns = ns;
+    }
+
+    k = f->size - emu->out_off;
+    if (k > (size - n)) k = size - n;
+    memcpy(buf + n, f->buf + emu->out_off, k);
+    n += k;
+    emu->out_off += k;
+
+    if (emu->out_off == f->size)
+    {
+      emu->out_off = 0;
+      ++emu->out_head;
+    }
+  }
+
+  return n;
+}
+
+int snrf_emu_next_ns(snrf_emu_t* emu, uint64_t* ns)
+{
+  /* time of the next output. return -1 if none is planned */
+
+  unsigned int is_set = 0;
+
+  if (emu->out_head != emu->out_tail)
+  {
+    if (emu->out_off) *ns = emu->tx_ns;
+    else *ns = get_tx_ns(emu, &emu->out[emu->out_head & OUT_MASK]);
+    is_set = 1;
+  }
+
+  if (emu->conf.rx_rate && (emu->state == SNRF_STATE_TXRX))
+  {
+    if ((is_set == 0) || (emu->peer_ns < *ns)) *ns = emu->peer_ns;
+    is_set = 1;
+  }
+
+  return is_set ? 0 : -1;
+}
+
+
+/* in process transport, no syscall but to wait for the */
+/* emulated time */
+
+static int emu_tr_read(void* opaque, void* buf, size_t size, size_t* nread)
+{
+  *nread = snrf_emu_output(opaque, buf, size);
+  return 0;
+}
+
+static int emu_tr_writev(void* opaque, struct iovec* iov, int count)
+{
+  int i;
+  for (i = 0; i != count; ++i)
+    snrf_emu_input(opaque, iov[i].iov_base, iov[i].iov_len);
+  return 0;
+}
+
+static int emu_tr_writev_nowait
+(void* opaque, const struct iovec* iov, int count, size_t* nwritten)
+{
+  int i;
+
+  *nwritten = 0;
+  for (i = 0; i != count; ++i)
+  {
+    snrf_emu_input(opaque, iov[i].iov_base, iov[i].iov_len);
+    *nwritten += iov[i].iov_len;
+  }
+
+  return 0;
+}
+
+static int emu_tr_wait(void* opaque, const struct timespec* deadline)
+{
+  /* nothing can arrive but the planned output, a wait with no */
+  /* output planned and no deadline returns at once */
+
+  snrf_emu_t* const emu = opaque;
+  struct timespec ts;
+  uint64_t deadline_ns = 0;
+  uint64_t now;
+  uint64_t ns;
+
+  if (deadline != NULL)
+  {
+    deadline_ns = (uint64_t)deadline->tv_sec * 1000000000 + (uint64_t)deadline->tv_nsec;
+  }
+
+  while (1)
+  {
+    now = get_now_ns();
+
+    if (snrf_emu_next_ns(emu, &ns))
+    {
+      if (deadline == NULL) return 0;
+      ns = deadline_ns;
+    }
+    else if (ns <= now)
+    {
+      return 1;
+    }
+
+    if ((deadline != NULL) && (ns > deadline_ns)) ns = deadline_ns;
+    if ((deadline != NULL) && (now >= deadline_ns)) return 0;
+
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+  }
+
+  /* not reached */
+  return 0;
+}
+
+static int emu_tr_set_bauds(void* opaque, uint32_t bauds)
+{
+  snrf_emu_t* const emu = opaque;
+  emu->host_baud = bauds;
+  return 0;
+}
+
+static int emu_tr_get_fd(void* opaque)
+{
+  return -1;
+}
+
+static void emu_tr_close(void* opaque)
+{
+  /* the emulator belongs to the caller */
+}
+
+const snrf_transport_ops_t snrf_emu_transport =
+{
+  emu_tr_read,
+  emu_tr_writev,
+  emu_tr_writev_nowait,
+  emu_tr_wait,
+  emu_tr_set_bauds,
+  emu_tr_get_fd,
+  emu_tr_close
+};
+
+
+/* pty mode */
+
+static int write_all(int fd, const uint8_t* buf, size_t size)
+{
+  ssize_t n;
+
+  while (size)
+  {
+    n = write(fd, buf, size);
+    if (n < 0)
+    {
+      if (errno == EINTR) continue ;
+      if (errno == EAGAIN)
+      {
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+	poll(&pfd, 1, -1);
+	continue ;
+      }
+      return -1;
+    }
+
+    buf += n;
+    size -= (size_t)n;
+  }
+
+  return 0;
+}
+
+static void* pty_main(void* arg)
+{
+  snrf_emu_t* const emu = arg;
+  uint8_t buf[1024];
+  struct pollfd pfds[2];
+  struct timespec ts;
+  struct timespec* tsp;
+  uint64_t now;
+  uint64_t ns;
+  ssize_t nread;
+  size_t n;
+
+  pfds[0].fd = emu->master_fd;
+  pfds[0].events = POLLIN;
+  pfds[1].fd = emu->stop_fd;
+  pfds[1].events = POLLIN;
+
+  while (1)
+  {
+    /* until the next output */
+    tsp = NULL;
+    if (snrf_emu_next_ns(emu, &ns) == 0)
+    {
+      now = get_now_ns();
+      if (ns < now) ns = now;
+      ns -= now;
+      ts.tv_sec = ns / 1000000000;
+      ts.tv_nsec = ns % 1000000000;
+      tsp = &ts;
+    }
+
+    if (ppoll(pfds, 2, tsp, NULL) < 0)
+    {
+      if (errno == EINTR) continue ;
+      SNRF_PERROR();
+      break ;
+    }
+
+    if (pfds[1].revents) break ;
+
+    if (pfds[0].revents & POLLIN)
+    {
+      nread = read(emu->master_fd, buf, sizeof(buf));
+      if (nread > 0) snrf_emu_input(emu, buf, (size_t)nread);
+    }
+
+    while ((n = snrf_emu_output(emu, buf, sizeof(buf))) != 0)
+    {
+      if (write_all(emu->master_fd, buf, n))
+      {
+	SNRF_PERROR();
+	return NULL;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+int snrf_emu_start_pty(snrf_emu_t* emu)
+{
+  /* serve the emulator on a pty, whose slave path is put in */
+  /* emu->pty_path. the emulator then belongs to a thread */
+
+  struct termios tio;
+
+  emu->master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (emu->master_fd == -1)
+  {
+    SNRF_PERROR();
+    goto on_error_0;
+  }
+
+  if (grantpt(emu->master_fd) || unlockpt(emu->master_fd) ||
+      ptsname_r(emu->master_fd, emu->pty_path, sizeof(emu->pty_path)))
+  {
+    SNRF_PERROR();
+    goto on_error_1;
+  }
+
+  emu->slave_fd = open(emu->pty_path, O_RDWR | O_NOCTTY);
+  if (emu->slave_fd == -1)
+  {
+    SNRF_PERROR();
+    goto on_error_1;
+  }
+
+  /* raw until the host opens it */
+  if (tcgetattr(emu->slave_fd, &tio) == 0)
+  {
+    cfmakeraw(&tio);
+    tcsetattr(emu->slave_fd, TCSANOW, &tio);
+  }
+
+  emu->stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (emu->stop_fd == -1)
+  {
+    SNRF_PERROR();
+    goto on_error_2;
+  }
+
+  if (pthread_create(&emu->pty_thread, NULL, pty_main, emu))
+  {
+    SNRF_PERROR();
+    goto on_error_3;
+  }
+
+  return 0;
+
+ on_error_3:
+  close(emu->stop_fd);
+  emu->stop_fd = -1;
+ on_error_2:
+  close(emu->slave_fd);
+  emu->slave_fd = -1;
+ on_error_1:
+  close(emu->master_fd);
+  emu->master_fd = -1;
+ on_error_0:
+  return -1;
+}
+
+void snrf_emu_stop_pty(snrf_emu_t* emu)
+{
+  const uint64_t one = 1;
+  ssize_t nwritten;
+
+  nwritten = write(emu->stop_fd, &one, sizeof(one));
+  (void)nwritten;
+  pthread_join(emu->pty_thread, NULL);
+
+  close(emu->stop_fd);
+  close(emu->slave_fd);
+  close(emu->master_fd);
+  emu->stop_fd = -1;
+  emu->slave_fd = -1;
+  emu->master_fd = -1;
+}
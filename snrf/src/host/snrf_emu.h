@@ -0,0 +1,117 @@
+#ifndef SNRF_EMU_H_INCLUDED
+#define SNRF_EMU_H_INCLUDED
+
+
+/* software stand-in for the bridge firmware. it implements */
+/* the set, get, payload and sync messages of dev/main.c, the */
+/* device window, the radio airtime at the configured rate and */
+/* the uart time of each frame, 10 bits a byte at the baud rate */
+/* it is used in process through snrf_emu_transport, without */
+/* any syscall, or through a pty by any program */
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "snrf_common.h"
+#include "snrf_frame.h"
+#include "snrf_transport.h"
+
+typedef struct snrf_emu_conf
+{
+  /* snrf_chipset_xxx */
+  uint32_t chipset;
+  /* frames lost on the uart, per million, in each direction */
+  uint32_t uart_loss_ppm;
+  /* payloads lost on the air, per million */
+  uint32_t radio_loss_ppm;
+  /* payloads sent are received back, as from a peer */
+  unsigned int is_loopback;
+  /* payloads received from peers per second, 0 for none */
+  unsigned int rx_rate;
+  /* peer payloads start with the CLOCK_MONOTONIC time they */
+  /* are received on the air, in ns, little endian */
+  unsigned int is_peer_ns;
+  unsigned int seed;
+} snrf_emu_conf_t;
+
+typedef struct snrf_emu_frame
+{
+  /* CLOCK_MONOTONIC time the device sends it, in ns */
+  uint64_t ns;
+  /* device uart rate when it is queued */
+  uint32_t baud;
+  uint8_t size;
+  uint8_t buf[SNRF_FRAME_SIZE_MAX];
+} snrf_emu_frame_t;
+
+typedef struct snrf_emu
+{
+  snrf_emu_conf_t conf;
+
+  /* device configuration, indexed by key */
+  uint32_t state;
+#define SNRF_EMU_KEY_COUNT 16
+  uint32_t vals[SNRF_EMU_KEY_COUNT];
+  /* frames dropped, as SNRF_KEY_UART_NCORRUPT */
+  uint32_t ncorrupt;
+
+  /* device uart rate. a SET applies it once its completion */
+  /* is sent, as uart_next_baud */
+  uint32_t baud;
+  /* host rate, cf. snrf_emu_transport. 0 if unknown, as with */
+  /* a pty. frames sent at another rate than baud are lost */
+  uint32_t host_baud;
+  /* the uart is busy receiving and sending until */
+  uint64_t rx_ns;
+  uint64_t tx_ns;
+
+  /* frame being received */
+  uint8_t in_buf[SNRF_FRAME_SIZE_MAX];
+  size_t in_size;
+  unsigned int in_skip;
+
+  /* time each device slot is released, when its message */
+  /* processing starts */
+  uint64_t slot_ns[SNRF_WINDOW_MAX];
+  /* same, for the slot reserved to a SYNC */
+  uint64_t sync_ns;
+  /* the device is busy sending until */
+  uint64_t busy_ns;
+
+  /* frames to the host, sorted by time */
+#define SNRF_EMU_OUT_COUNT 256
+  snrf_emu_frame_t out[SNRF_EMU_OUT_COUNT];
+  size_t out_head;
+  size_t out_tail;
+  /* bytes of the first frame already read */
+  size_t out_off;
+
+  /* next payload from a peer */
+  uint64_t peer_ns;
+  uint8_t peer_count;
+
+  uint32_t rand_state;
+
+  /* pty mode, cf. snrf_emu_start_pty */
+  int master_fd;
+  /* kept open so that the host can reopen the slave */
+  int slave_fd;
+  int stop_fd;
+  pthread_t pty_thread;
+  char pty_path[64];
+
+} snrf_emu_t;
+
+
+extern const snrf_transport_ops_t snrf_emu_transport;
+
+void snrf_emu_init_conf(snrf_emu_conf_t*);
+void snrf_emu_init(snrf_emu_t*, const snrf_emu_conf_t*);
+void snrf_emu_input(snrf_emu_t*, const uint8_t*, size_t);
+size_t snrf_emu_output(snrf_emu_t*, uint8_t*, size_t);
+int snrf_emu_next_ns(snrf_emu_t*, uint64_t*);
+int snrf_emu_start_pty(snrf_emu_t*);
+void snrf_emu_stop_pty(snrf_emu_t*);
+
+
+#endif /* SNRF_EMU_H_INCLUDED */
@@ -0,0 +1,710 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "snrf.h"
+#include "snrf_loop.h"
+#include "snrf_common.h"
+
+
+#define CONFIG_DEBUG 1
+#if CONFIG_DEBUG
+#include <stdio.h>
+#define SNRF_PERROR()					\
+do {							\
+printf("[!] %s, %u\n", __FILE__, __LINE__);		\
+} while (0)
+#else
+#define SNRF_PERROR()
+#endif
+
+
+/* epoll key of the timer fd, handles use their entry index */
+#define TIMER_KEY SNRF_LOOP_ENTRY_MAX
+/* then the foreign fds, by id */
+#define FD_KEY (TIMER_KEY + 1)
+/* then the transport fds of the handles whose reader thread */
+/* runs, by entry index, watched for EPOLLOUT only */
+#define OUT_KEY (FD_KEY + SNRF_LOOP_FD_MAX)
+#define EVENT_MAX (OUT_KEY + SNRF_LOOP_ENTRY_MAX)
+
+#define BACKLOG_MASK (SNRF_LOOP_BACKLOG_SIZE - 1)
+
+
+/* time */
+
+static inline void get_now(struct timespec* ts)
+{
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static inline int is_before(const struct timespec* a, const struct timespec* b)
+{
+  if (a->tv_sec != b->tv_sec) return a->tv_sec < b->tv_sec;
+  return a->tv_nsec < b->tv_nsec;
+}
+
+
+/* entries */
+
+static snrf_loop_entry_t* find_entry(snrf_loop_t* loop, snrf_handle_t* snrf)
+{
+  size_t i;
+
+  for (i = 0; i != SNRF_LOOP_ENTRY_MAX; ++i)
+  {
+    snrf_loop_entry_t* const e = &loop->entries[i];
+    if (e->is_used && (e->snrf == snrf)) return e;
+  }
+
+  return NULL;
+}
+
+static inline unsigned int is_same_entry
+(const snrf_loop_entry_t* e, const snrf_handle_t* snrf)
+{
+  /* a callback may have removed the entry */
+  return e->is_used && (e->snrf == snrf);
+}
+
+static inline int get_out_fd(snrf_handle_t* snrf)
+{
+  /* frames are written to the transport fd, snrf_get_fd is */
+  /* the reader eventfd when the reader thread runs */
+  return snrf->tr_ops->get_fd(snrf->tr_opaque);
+}
+
+static int set_pollout
+(snrf_loop_t* loop, snrf_loop_entry_t* e, unsigned int is_pollout)
+{
+  const int in_fd = snrf_get_fd(e->snrf);
+  const int out_fd = get_out_fd(e->snrf);
+  struct epoll_event ev;
+  int op;
+
+  if (e->is_pollout == is_pollout) return 0;
+
+  if (in_fd == out_fd)
+  {
+    ev.events = EPOLLIN | (is_pollout ? EPOLLOUT : 0);
+    ev.data.u32 = (uint32_t)(e - loop->entries);
+    op = EPOLL_CTL_MOD;
+  }
+  else
+  {
+    ev.events = EPOLLOUT;
+    ev.data.u32 = (uint32_t)(OUT_KEY + (e - loop->entries));
+    op = is_pollout ? EPOLL_CTL_ADD : EPOLL_CTL_DEL;
+  }
+
+  if (epoll_ctl(loop->epoll_fd, op, out_fd, &ev))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  e->is_pollout = is_pollout;
+
+  return 0;
+}
+
+static void send_backlog(snrf_loop_entry_t* e)
+{
+  /* move posted messages to the free window slots. they are */
+  /* written by flush_entry */
+
+  snrf_window_entry_t* w;
+  size_t i;
+
+  while ((e->backlog_tail != e->backlog_head) &&
+	 (e->pending_count != SNRF_WINDOW_MAX))
+  {
+    for (i = 0; e->pending[i].is_used; ++i) ;
+    w = &e->pending[i];
+
+    w->msg = e->backlog[e->backlog_tail & BACKLOG_MASK];
+
+    /* handle queue full, retried once flushed */
+    if (snrf_post_msg(e->snrf, &w->msg)) break ;
+
+    e->pending_tags[i] = e->backlog_tags[e->backlog_tail & BACKLOG_MASK];
+
+    ++e->backlog_tail;
+
+    snrf_get_deadline(&w->deadline, SNRF_COMPL_MS * 1000);
+    w->is_used = 1;
+    ++e->pending_count;
+
+    e->is_dirty = 1;
+  }
+}
+
+static int flush_entry(snrf_loop_t* loop, snrf_loop_entry_t* e)
+{
+  int err;
+
+  err = snrf_flush_nowait(e->snrf);
+  if (err == -1)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  e->is_dirty = 0;
+
+  /* wait for the fd to be writable if some frames are left */
+  return set_pollout(loop, e, err == -2);
+}
+
+static void fail_entry(snrf_loop_t* loop, snrf_loop_entry_t* e)
+{
+  snrf_handle_t* const snrf = e->snrf;
+  const snrf_loop_ops_t* const ops = e->ops;
+  void* const opaque = e->opaque;
+
+  snrf_loop_del(loop, snrf);
+
+  if (ops->on_error != NULL) ops->on_error(loop, snrf, opaque);
+}
+
+static void handle_compl
+(snrf_loop_t* loop, snrf_loop_entry_t* e, const snrf_msg_t* compl)
+{
+  snrf_msg_t msg;
+  uint64_t tag;
+  size_t i;
+
+  for (i = 0; i != SNRF_WINDOW_MAX; ++i)
+  {
+    if (e->pending[i].is_used == 0) continue ;
+    if (e->pending[i].msg.seq == compl->seq) break ;
+  }
+
+  if (i == SNRF_WINDOW_MAX)
+  {
+    /* stale completion of a message that timed out */
+    ++e->snrf->msg_ndrop;
+    return ;
+  }
+
+  msg = e->pending[i].msg;
+  tag = e->pending_tags[i];
+  e->pending[i].is_used = 0;
+  --e->pending_count;
+
+  send_backlog(e);
+
+  if (e->ops->on_compl != NULL)
+    e->ops->on_compl(loop, e->snrf, &msg, compl, tag, e->opaque);
+}
+
+static int read_entry(snrf_loop_t* loop, snrf_loop_entry_t* e)
+{
+  /* read the input, then dispatch all the pending messages */
+
+  snrf_handle_t* const snrf = e->snrf;
+  const snrf_loop_ops_t* const ops = e->ops;
+  snrf_msg_t msg;
+  int err;
+
+  err = snrf_read_msg(snrf, &msg);
+  if (err == -1)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  while (err == 0)
+  {
+    switch (msg.op)
+    {
+    case SNRF_OP_PAYLOAD:
+      if (ops->on_payload != NULL) ops->on_payload(loop, snrf, &msg, e->opaque);
+      break ;
+
+    case SNRF_OP_DEBUG:
+      if (ops->on_debug != NULL) ops->on_debug(loop, snrf, &msg, e->opaque);
+      break ;
+
+    case SNRF_OP_COMPL:
+      handle_compl(loop, e, &msg);
+      break ;
+
+    default:
+      ++snrf->msg_ndrop;
+      break ;
+    }
+
+    if (is_same_entry(e, snrf) == 0) break ;
+
+    err = snrf_get_pending_msg(snrf, &msg);
+  }
+
+  return 0;
+}
+
+static void expire(snrf_loop_t* loop)
+{
+  /* time out the completions and fire the timers */
+
+  struct timespec now;
+  snrf_loop_timer_t* t;
+  snrf_loop_entry_t* e;
+  snrf_handle_t* snrf;
+  snrf_msg_t msg;
+  uint64_t tag;
+  size_t i;
+  size_t j;
+
+  get_now(&now);
+
+  for (i = 0; i != SNRF_LOOP_ENTRY_MAX; ++i)
+  {
+    e = &loop->entries[i];
+    if (e->is_used == 0) continue ;
+
+    snrf = e->snrf;
+
+    for (j = 0; j != SNRF_WINDOW_MAX; ++j)
+    {
+      if (e->pending[j].is_used == 0) continue ;
+      if (is_before(&now, &e->pending[j].deadline)) continue ;
+
+      msg = e->pending[j].msg;
+      tag = e->pending_tags[j];
+      e->pending[j].is_used = 0;
+      --e->pending_count;
+
+      send_backlog(e);
+
+      if (e->ops->on_timeout != NULL)
+	e->ops->on_timeout(loop, snrf, &msg, tag, e->opaque);
+
+      if (is_same_entry(e, snrf) == 0) break ;
+    }
+  }
+
+  for (i = 0; i != SNRF_LOOP_TIMER_MAX; ++i)
+  {
+    t = &loop->timers[i];
+    if (t->is_used == 0) continue ;
+    if (is_before(&now, &t->deadline)) continue ;
+
+    /* one shot, the callback may add it again */
+    t->is_used = 0;
+    t->fn(loop, t->opaque);
+  }
+}
+
+static int arm_timer(snrf_loop_t* loop)
+{
+  /* arm the timer fd to the nearest deadline, or disarm it */
+
+  const struct timespec* deadline = NULL;
+  struct itimerspec its;
+  const snrf_loop_entry_t* e;
+  size_t i;
+  size_t j;
+
+  for (i = 0; i != SNRF_LOOP_ENTRY_MAX; ++i)
+  {
+    e = &loop->entries[i];
+    if (e->is_used == 0) continue ;
+
+    for (j = 0; j != SNRF_WINDOW_MAX; ++j)
+    {
+      if (e->pending[j].is_used == 0) continue ;
+      if ((deadline == NULL) || is_before(&e->pending[j].deadline, deadline))
+	deadline = &e->pending[j].deadline;
+    }
+  }
+
+  for (i = 0; i != SNRF_LOOP_TIMER_MAX; ++i)
+  {
+    if (loop->timers[i].is_used == 0) continue ;
+    if ((deadline == NULL) || is_before(&loop->timers[i].deadline, deadline))
+      deadline = &loop->timers[i].deadline;
+  }
+
+  memset(&its, 0, sizeof(its));
+  if (deadline != NULL) its.it_value = *deadline;
+
+  if (timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &its, NULL))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/* exported */
+
+int snrf_loop_init(snrf_loop_t* loop)
+{
+  struct epoll_event ev;
+
+  memset(loop->entries, 0, sizeof(loop->entries));
+  loop->entry_count = 0;
+  memset(loop->timers, 0, sizeof(loop->timers));
+  memset(loop->fds, 0, sizeof(loop->fds));
+  loop->is_done = 0;
+
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd == -1)
+  {
+    SNRF_PERROR();
+    goto on_error_0;
+  }
+
+  loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (loop->timer_fd == -1)
+  {
+    SNRF_PERROR();
+    goto on_error_1;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.u32 = TIMER_KEY;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &ev))
+  {
+    SNRF_PERROR();
+    goto on_error_2;
+  }
+
+  return 0;
+
+ on_error_2:
+  close(loop->timer_fd);
+ on_error_1:
+  close(loop->epoll_fd);
+ on_error_0:
+  return -1;
+}
+
+void snrf_loop_fini(snrf_loop_t* loop)
+{
+  /* the handles are not closed */
+
+  close(loop->timer_fd);
+  close(loop->epoll_fd);
+}
+
+int snrf_loop_add
+(snrf_loop_t* loop, snrf_handle_t* snrf, const snrf_loop_ops_t* ops, void* opaque)
+{
+  struct epoll_event ev;
+  snrf_loop_entry_t* e;
+  size_t i;
+
+  for (i = 0; i != SNRF_LOOP_ENTRY_MAX; ++i)
+  {
+    if (loop->entries[i].is_used == 0) break ;
+  }
+
+  if (i == SNRF_LOOP_ENTRY_MAX)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  e = &loop->entries[i];
+  memset(e, 0, sizeof(snrf_loop_entry_t));
+  e->snrf = snrf;
+  e->ops = ops;
+  e->opaque = opaque;
+
+  ev.events = EPOLLIN;
+  ev.data.u32 = (uint32_t)i;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, snrf_get_fd(snrf), &ev))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  e->is_used = 1;
+  ++loop->entry_count;
+
+  /* frames left by the blocking routines */
+  e->is_dirty = 1;
+
+  return 0;
+}
+
+int snrf_loop_del(snrf_loop_t* loop, snrf_handle_t* snrf)
+{
+  /* pending and posted messages are dropped */
+
+  snrf_loop_entry_t* const e = find_entry(loop, snrf);
+
+  if (e == NULL)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, snrf_get_fd(snrf), NULL);
+  if (e->is_pollout && (get_out_fd(snrf) != snrf_get_fd(snrf)))
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, get_out_fd(snrf), NULL);
+
+  e->is_used = 0;
+  --loop->entry_count;
+
+  return 0;
+}
+
+int snrf_loop_post_tag
+(snrf_loop_t* loop, snrf_handle_t* snrf, const snrf_msg_t* msg, uint64_t tag)
+{
+  /* msg is sent once the window allows, its completion is */
+  /* reported by on_compl or on_timeout, with tag. never */
+  /* block. return -2 if too many messages are posted */
+
+  snrf_loop_entry_t* const e = find_entry(loop, snrf);
+
+  if (e == NULL)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  if ((e->backlog_head - e->backlog_tail) == SNRF_LOOP_BACKLOG_SIZE)
+    return -2;
+
+  e->backlog[e->backlog_head & BACKLOG_MASK] = *msg;
+  e->backlog_tags[e->backlog_head & BACKLOG_MASK] = tag;
+  ++e->backlog_head;
+
+  send_backlog(e);
+
+  return 0;
+}
+
+int snrf_loop_post(snrf_loop_t* loop, snrf_handle_t* snrf, const snrf_msg_t* msg)
+{
+  return snrf_loop_post_tag(loop, snrf, msg, 0);
+}
+
+int snrf_loop_post_payload
+(snrf_loop_t* loop, snrf_handle_t* snrf, const uint8_t* buf, size_t size)
+{
+  snrf_msg_t msg;
+
+  if (size > SNRF_MAX_PAYLOAD_WIDTH)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  msg.op = SNRF_OP_PAYLOAD;
+  memcpy(msg.u.payload.data, buf, size);
+  msg.u.payload.size = (uint8_t)size;
+
+  return snrf_loop_post(loop, snrf, &msg);
+}
+
+int snrf_loop_add_timer
+(snrf_loop_t* loop, unsigned int us, snrf_loop_timer_fn_t fn, void* opaque)
+{
+  /* one shot timer, fired us microseconds from now */
+  /* return its id, or -1 if no timer is left */
+
+  snrf_loop_timer_t* t;
+  size_t i;
+
+  for (i = 0; i != SNRF_LOOP_TIMER_MAX; ++i)
+  {
+    if (loop->timers[i].is_used == 0) break ;
+  }
+
+  if (i == SNRF_LOOP_TIMER_MAX)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  t = &loop->timers[i];
+  snrf_get_deadline(&t->deadline, us);
+  t->fn = fn;
+  t->opaque = opaque;
+  t->is_used = 1;
+
+  return (int)i;
+}
+
+void snrf_loop_del_timer(snrf_loop_t* loop, int id)
+{
+  loop->timers[id].is_used = 0;
+}
+
+int snrf_loop_add_fd
+(snrf_loop_t* loop, int fd, uint32_t events, snrf_loop_fd_fn_t fn, void* opaque)
+{
+  /* fn called with the events that occurred, level triggered. */
+  /* return the watch id, or -1. the fd is not closed by the loop */
+
+  struct epoll_event ev;
+  size_t i;
+
+  for (i = 0; i != SNRF_LOOP_FD_MAX; ++i)
+  {
+    if (loop->fds[i].is_used == 0) break ;
+  }
+
+  if (i == SNRF_LOOP_FD_MAX)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  ev.events = events;
+  ev.data.u32 = (uint32_t)(FD_KEY + i);
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  loop->fds[i].fd = fd;
+  loop->fds[i].fn = fn;
+  loop->fds[i].opaque = opaque;
+  loop->fds[i].is_used = 1;
+
+  return (int)i;
+}
+
+int snrf_loop_mod_fd(snrf_loop_t* loop, int id, uint32_t events)
+{
+  /* 0 to stop watching, errors and hangups are still reported */
+
+  struct epoll_event ev;
+
+  ev.events = events;
+  ev.data.u32 = (uint32_t)(FD_KEY + id);
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, loop->fds[id].fd, &ev))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+void snrf_loop_del_fd(snrf_loop_t* loop, int id)
+{
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->fds[id].fd, NULL);
+  loop->fds[id].is_used = 0;
+}
+
+int snrf_loop_run_once(snrf_loop_t* loop)
+{
+  /* write the queued frames, then wait for and handle one */
+  /* batch of events */
+
+  struct epoll_event evs[EVENT_MAX];
+  snrf_loop_fd_t* f;
+  snrf_loop_entry_t* e;
+  ssize_t nread;
+  uint64_t x;
+  size_t i;
+  int n;
+
+  for (i = 0; i != SNRF_LOOP_ENTRY_MAX; ++i)
+  {
+    e = &loop->entries[i];
+    if ((e->is_used == 0) || (e->is_dirty == 0) || e->is_pollout) continue ;
+    if (flush_entry(loop, e)) fail_entry(loop, e);
+  }
+
+  if (arm_timer(loop))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  n = epoll_wait(loop->epoll_fd, evs, EVENT_MAX, -1);
+  if (n == -1)
+  {
+    if (errno == EINTR) return 0;
+    SNRF_PERROR();
+    return -1;
+  }
+
+  for (i = 0; i != (size_t)n; ++i)
+  {
+    if (evs[i].data.u32 == TIMER_KEY)
+    {
+      /* clear the expiration count, handled by expire */
+      nread = read(loop->timer_fd, &x, sizeof(x));
+      (void)nread;
+      continue ;
+    }
+
+    if (evs[i].data.u32 >= OUT_KEY)
+    {
+      /* removed by a previous callback */
+      e = &loop->entries[evs[i].data.u32 - OUT_KEY];
+      if ((e->is_used == 0) || (e->is_pollout == 0)) continue ;
+      if (flush_entry(loop, e)) fail_entry(loop, e);
+      continue ;
+    }
+
+    if (evs[i].data.u32 >= FD_KEY)
+    {
+      /* removed by a previous callback */
+      f = &loop->fds[evs[i].data.u32 - FD_KEY];
+      if (f->is_used) f->fn(loop, f->fd, evs[i].events, f->opaque);
+      continue ;
+    }
+
+    /* removed by a previous callback */
+    e = &loop->entries[evs[i].data.u32];
+    if (e->is_used == 0) continue ;
+
+    if (evs[i].events & (EPOLLERR | EPOLLHUP))
+    {
+      fail_entry(loop, e);
+      continue ;
+    }
+
+    if ((evs[i].events & EPOLLOUT) && flush_entry(loop, e))
+    {
+      fail_entry(loop, e);
+      continue ;
+    }
+
+    if ((evs[i].events & EPOLLIN) && read_entry(loop, e))
+    {
+      fail_entry(loop, e);
+      continue ;
+    }
+  }
+
+  expire(loop);
+
+  return 0;
+}
+
+int snrf_loop_run(snrf_loop_t* loop)
+{
+  /* until snrf_loop_stop is called */
+
+  loop->is_done = 0;
+
+  while (loop->is_done == 0)
+  {
+    if (snrf_loop_run_once(loop))
+    {
+      SNRF_PERROR();
+      return -1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,138 @@
+#ifndef SNRF_LOOP_H_INCLUDED
+#define SNRF_LOOP_H_INCLUDED
+
+
+/* event loop driving many handles from one thread. the loop */
+/* owns the handles it drives: their blocking routines must */
+/* not be used until they are removed from the loop */
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "snrf.h"
+#include "snrf_common.h"
+
+struct snrf_loop;
+
+typedef struct snrf_loop_ops
+{
+  /* any callback can be NULL. the handle can be removed */
+  /* and messages posted from any callback */
+
+  void (*on_payload)
+  (struct snrf_loop*, snrf_handle_t*, const snrf_msg_t*, void*);
+
+  void (*on_debug)
+  (struct snrf_loop*, snrf_handle_t*, const snrf_msg_t*, void*);
+
+  /* the posted message, its completion, then its tag, cf. */
+  /* snrf_loop_post_tag */
+  void (*on_compl)
+  (
+   struct snrf_loop*, snrf_handle_t*,
+   const snrf_msg_t*, const snrf_msg_t*, uint64_t, void*
+  );
+
+  /* the posted message was not completed in time */
+  void (*on_timeout)
+  (struct snrf_loop*, snrf_handle_t*, const snrf_msg_t*, uint64_t, void*);
+
+  /* read or write error, the handle is removed from the loop */
+  void (*on_error)(struct snrf_loop*, snrf_handle_t*, void*);
+
+} snrf_loop_ops_t;
+
+typedef struct snrf_loop_entry
+{
+  snrf_handle_t* snrf;
+  const snrf_loop_ops_t* ops;
+  void* opaque;
+
+  /* messages sent, waiting for their completion. at most */
+  /* the device window, so that its receive slots never fill */
+  snrf_window_entry_t pending[SNRF_WINDOW_MAX];
+  uint64_t pending_tags[SNRF_WINDOW_MAX];
+  size_t pending_count;
+
+  /* messages posted, not yet sent */
+#define SNRF_LOOP_BACKLOG_SIZE 64
+  snrf_msg_t backlog[SNRF_LOOP_BACKLOG_SIZE];
+  uint64_t backlog_tags[SNRF_LOOP_BACKLOG_SIZE];
+  size_t backlog_head;
+  size_t backlog_tail;
+
+  /* frames queued in the handle, not yet written */
+  unsigned int is_dirty;
+  /* waiting for the fd to be writable */
+  unsigned int is_pollout;
+
+  unsigned int is_used;
+
+} snrf_loop_entry_t;
+
+typedef void (*snrf_loop_timer_fn_t)(struct snrf_loop*, void*);
+
+typedef struct snrf_loop_timer
+{
+  struct timespec deadline;
+  snrf_loop_timer_fn_t fn;
+  void* opaque;
+  unsigned int is_used;
+} snrf_loop_timer_t;
+
+/* events the epoll_xxx ones, EPOLLIN and EPOLLOUT */
+typedef void (*snrf_loop_fd_fn_t)(struct snrf_loop*, int, uint32_t, void*);
+
+typedef struct snrf_loop_fd
+{
+  int fd;
+  snrf_loop_fd_fn_t fn;
+  void* opaque;
+  unsigned int is_used;
+} snrf_loop_fd_t;
+
+typedef struct snrf_loop
+{
+  int epoll_fd;
+  /* armed to the nearest timer or completion deadline */
+  int timer_fd;
+
+#define SNRF_LOOP_ENTRY_MAX 64
+  snrf_loop_entry_t entries[SNRF_LOOP_ENTRY_MAX];
+  size_t entry_count;
+
+#define SNRF_LOOP_TIMER_MAX 16
+  snrf_loop_timer_t timers[SNRF_LOOP_TIMER_MAX];
+
+  /* foreign fds, sockets or pipes served by the same thread */
+#define SNRF_LOOP_FD_MAX 128
+  snrf_loop_fd_t fds[SNRF_LOOP_FD_MAX];
+
+  unsigned int is_done;
+
+} snrf_loop_t;
+
+
+int snrf_loop_init(snrf_loop_t*);
+void snrf_loop_fini(snrf_loop_t*);
+int snrf_loop_add(snrf_loop_t*, snrf_handle_t*, const snrf_loop_ops_t*, void*);
+int snrf_loop_del(snrf_loop_t*, snrf_handle_t*);
+int snrf_loop_post(snrf_loop_t*, snrf_handle_t*, const snrf_msg_t*);
+int snrf_loop_post_tag
+(snrf_loop_t*, snrf_handle_t*, const snrf_msg_t*, uint64_t);
+int snrf_loop_post_payload(snrf_loop_t*, snrf_handle_t*, const uint8_t*, size_t);
+int snrf_loop_add_timer(snrf_loop_t*, unsigned int, snrf_loop_timer_fn_t, void*);
+void snrf_loop_del_timer(snrf_loop_t*, int);
+int snrf_loop_add_fd(snrf_loop_t*, int, uint32_t, snrf_loop_fd_fn_t, void*);
+int snrf_loop_mod_fd(snrf_loop_t*, int, uint32_t);
+void snrf_loop_del_fd(snrf_loop_t*, int);
+int snrf_loop_run_once(snrf_loop_t*);
+int snrf_loop_run(snrf_loop_t*);
+
+static inline void snrf_loop_stop(snrf_loop_t* loop)
+{
+  loop->is_done = 1;
+}
+
+
+#endif /* SNRF_LOOP_H_INCLUDED */
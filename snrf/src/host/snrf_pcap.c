@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include "snrf_common.h"
+#include "snrf_frame.h"
+#include "snrf_pcap.h"
+
+
+#define CONFIG_DEBUG 1
+#if CONFIG_DEBUG
+#define SNRF_PERROR()					\
+do {							\
+printf("[!] %s, %u\n", __FILE__, __LINE__);		\
+} while (0)
+#else
+#define SNRF_PERROR()
+#endif
+
+
+typedef struct pcap_header
+{
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+} __attribute__((packed)) pcap_header_t;
+
+typedef struct pcap_rec_header
+{
+  uint32_t ts_sec;
+  /* nanoseconds, cf. SNRF_PCAP_MAGIC_NS */
+  uint32_t ts_nsec;
+  uint32_t incl_len;
+  uint32_t orig_len;
+} __attribute__((packed)) pcap_rec_header_t;
+
+
+int snrf_pcap_create(snrf_pcap_t* pcap, const char* path)
+{
+  pcap_header_t h;
+
+  pcap->file = fopen(path, "w");
+  if (pcap->file == NULL)
+  {
+    SNRF_PERROR();
+    goto on_error_0;
+  }
+
+  /* unbuffered, a packet is in the file once written, even */
+  /* if the process dies. one write per packet */
+  setvbuf(pcap->file, NULL, _IONBF, 0);
+
+  h.magic = SNRF_PCAP_MAGIC_NS;
+  h.version_major = 2;
+  h.version_minor = 4;
+  h.thiszone = 0;
+  h.sigfigs = 0;
+  h.snaplen = SNRF_PCAP_SNAPLEN;
+  h.linktype = SNRF_PCAP_LINKTYPE;
+
+  if (fwrite(&h, sizeof(h), 1, pcap->file) != 1)
+  {
+    SNRF_PERROR();
+    goto on_error_1;
+  }
+
+  return 0;
+
+ on_error_1:
+  fclose(pcap->file);
+ on_error_0:
+  return -1;
+}
+
+int snrf_pcap_load(snrf_pcap_t* pcap, const char* path)
+{
+  /* only captures of the host byte order are read */
+
+  pcap_header_t h;
+
+  pcap->file = fopen(path, "r");
+  if (pcap->file == NULL)
+  {
+    SNRF_PERROR();
+    goto on_error_0;
+  }
+
+  if (fread(&h, sizeof(h), 1, pcap->file) != 1)
+  {
+    SNRF_PERROR();
+    goto on_error_1;
+  }
+
+  if ((h.magic != SNRF_PCAP_MAGIC_NS) || (h.linktype != SNRF_PCAP_LINKTYPE))
+  {
+    SNRF_PERROR();
+    goto on_error_1;
+  }
+
+  return 0;
+
+ on_error_1:
+  fclose(pcap->file);
+ on_error_0:
+  return -1;
+}
+
+void snrf_pcap_close(snrf_pcap_t* pcap)
+{
+  fclose(pcap->file);
+}
+
+int snrf_pcap_write
+(snrf_pcap_t* pcap, uint8_t dir, const snrf_msg_t* msg, size_t size)
+{
+  /* any thread, a packet is written with a single call so */
+  /* that the stream lock keeps packets whole */
+
+  uint8_t buf[sizeof(pcap_rec_header_t) + SNRF_PCAP_SNAPLEN];
+  pcap_rec_header_t* const h = (pcap_rec_header_t*)buf;
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  h->ts_sec = (uint32_t)ts.tv_sec;
+  h->ts_nsec = (uint32_t)ts.tv_nsec;
+  h->incl_len = (uint32_t)(1 + size);
+  h->orig_len = h->incl_len;
+
+  buf[sizeof(pcap_rec_header_t)] = dir;
+  memcpy(buf + sizeof(pcap_rec_header_t) + 1, msg, size);
+
+  if (fwrite(buf, sizeof(pcap_rec_header_t) + 1 + size, 1, pcap->file) != 1)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+int snrf_pcap_read(snrf_pcap_t* pcap, snrf_pcap_rec_t* rec)
+{
+  /* return -2 at the end of the capture */
+
+  uint8_t buf[SNRF_PCAP_SNAPLEN];
+  pcap_rec_header_t h;
+
+  if (fread(&h, sizeof(h), 1, pcap->file) != 1)
+  {
+    if (feof(pcap->file)) return -2;
+    SNRF_PERROR();
+    return -1;
+  }
+
+  if ((h.incl_len < (1 + SNRF_MSG_HEADER_SIZE)) || (h.incl_len > sizeof(buf)))
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  if (fread(buf, h.incl_len, 1, pcap->file) != 1)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  rec->ts.tv_sec = h.ts_sec;
+  rec->ts.tv_nsec = h.ts_nsec;
+  rec->dir = buf[0];
+  rec->size = h.incl_len - 1;
+  memset(&rec->msg, 0, sizeof(rec->msg));
+  memcpy(&rec->msg, buf + 1, rec->size);
+
+  if (snrf_msg_from_body((uint8_t*)&rec->msg, (uint8_t)rec->size) == NULL)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,47 @@
+#ifndef SNRF_PCAP_H_INCLUDED
+#define SNRF_PCAP_H_INCLUDED
+
+
+/* link traffic capture, in the pcap format with nanosecond */
+/* timestamps. a packet is a direction byte followed by the */
+/* message as sent on the link, op and seq included */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include "snrf_common.h"
+
+#define SNRF_PCAP_MAGIC_NS 0xa1b23c4d
+/* DLT_USER0, private use */
+#define SNRF_PCAP_LINKTYPE 147
+#define SNRF_PCAP_SNAPLEN (1 + sizeof(snrf_msg_t))
+
+/* direction byte, same values as snrf_trace_xxx */
+#define SNRF_PCAP_TX 0
+#define SNRF_PCAP_RX 1
+
+typedef struct snrf_pcap
+{
+  FILE* file;
+} snrf_pcap_t;
+
+typedef struct snrf_pcap_rec
+{
+  /* CLOCK_REALTIME of the capture */
+  struct timespec ts;
+  uint8_t dir;
+  snrf_msg_t msg;
+  /* message size on the link */
+  size_t size;
+} snrf_pcap_rec_t;
+
+
+int snrf_pcap_create(snrf_pcap_t*, const char*);
+int snrf_pcap_load(snrf_pcap_t*, const char*);
+void snrf_pcap_close(snrf_pcap_t*);
+int snrf_pcap_write(snrf_pcap_t*, uint8_t, const snrf_msg_t*, size_t);
+int snrf_pcap_read(snrf_pcap_t*, snrf_pcap_rec_t*);
+
+
+#endif /* SNRF_PCAP_H_INCLUDED */
@@ -0,0 +1,147 @@
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "snrf_trace.h"
+
+
+#define CONFIG_DEBUG 1
+#if CONFIG_DEBUG
+#include <stdio.h>
+#define SNRF_PERROR()					\
+do {							\
+printf("[!] %s, %u\n", __FILE__, __LINE__);		\
+} while (0)
+#else
+#define SNRF_PERROR()
+#endif
+
+
+static int map_file(snrf_trace_t* trace, int fd, size_t size, int prot)
+{
+  void* p;
+
+  p = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+  {
+    SNRF_PERROR();
+    return -1;
+  }
+
+  trace->header = p;
+  trace->recs = (snrf_trace_rec_t*)(trace->header + 1);
+  trace->map_size = size;
+
+  return 0;
+}
+
+int snrf_trace_create(snrf_trace_t* trace, const char* path, size_t count)
+{
+  /* count rounded up to a power of 2. an existing file is */
+  /* truncated */
+
+  size_t n;
+  size_t size;
+  int fd;
+  int err = -1;
+
+  for (n = 1; n < count; n <<= 1) ;
+  size = sizeof(snrf_trace_header_t) + n * sizeof(snrf_trace_rec_t);
+
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+  {
+    SNRF_PERROR();
+    goto on_error_0;
+  }
+
+  if (ftruncate(fd, (off_t)size))
+  {
+    SNRF_PERROR();
+    goto on_error_1;
+  }
+
+  if (map_file(trace, fd, size, PROT_READ | PROT_WRITE))
+  {
+    SNRF_PERROR();
+    goto on_error_1;
+  }
+
+  /* the file is zero filled, records are free */
+  trace->header->magic = SNRF_TRACE_MAGIC;
+  trace->header->version = SNRF_TRACE_VERSION;
+  trace->header->rec_size = sizeof(snrf_trace_rec_t);
+  trace->header->rec_count = (uint32_t)n;
+  trace->header->head = 0;
+  trace->mask = n - 1;
+
+  err = 0;
+
+ on_error_1:
+  /* the mapping holds its own reference */
+  close(fd);
+ on_error_0:
+  return err;
+}
+
+int snrf_trace_load(snrf_trace_t* trace, const char* path)
+{
+  /* map an existing trace, read only */
+
+  const snrf_trace_header_t* h;
+  struct stat st;
+  size_t size;
+  int fd;
+  int err = -1;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+  {
+    SNRF_PERROR();
+    goto on_error_0;
+  }
+
+  if (fstat(fd, &st) || ((size_t)st.st_size < sizeof(snrf_trace_header_t)))
+  {
+    SNRF_PERROR();
+    goto on_error_1;
+  }
+
+  if (map_file(trace, fd, (size_t)st.st_size, PROT_READ))
+  {
+    SNRF_PERROR();
+    goto on_error_1;
+  }
+
+  h = trace->header;
+  size = sizeof(snrf_trace_header_t) + (size_t)h->rec_count * sizeof(snrf_trace_rec_t);
+
+  if ((h->magic != SNRF_TRACE_MAGIC) ||
+      (h->version != SNRF_TRACE_VERSION) ||
+      (h->rec_size != sizeof(snrf_trace_rec_t)) ||
+      (h->rec_count == 0) ||
+      (h->rec_count & (h->rec_count - 1)) ||
+      (size > (size_t)st.st_size))
+  {
+    SNRF_PERROR();
+    snrf_trace_close(trace);
+    goto on_error_1;
+  }
+
+  trace->mask = h->rec_count - 1;
+
+  err = 0;
+
+ on_error_1:
+  close(fd);
+ on_error_0:
+  return err;
+}
+
+void snrf_trace_close(snrf_trace_t* trace)
+{
+  munmap(trace->header, trace->map_size);
+}
@@ -0,0 +1,92 @@
+#ifndef SNRF_TRACE_H_INCLUDED
+#define SNRF_TRACE_H_INCLUDED
+
+
+/* frame trace, a circular file of fixed size records mapped */
+/* in memory. recording is a clock read and a record copy, the */
+/* kernel writes the pages back. the file survives a crash */
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include "snrf_common.h"
+
+#define SNRF_TRACE_MAGIC 0x54524e53
+#define SNRF_TRACE_VERSION 1
+
+typedef struct snrf_trace_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t rec_size;
+  /* capacity, power of 2 */
+  uint32_t rec_count;
+  /* records written since creation, free running */
+  uint64_t head;
+  uint8_t pad[40];
+} __attribute__((packed)) snrf_trace_header_t;
+
+typedef struct snrf_trace_rec
+{
+  /* CLOCK_MONOTONIC, in nanoseconds */
+  uint64_t ns;
+  /* snrf_trace_xxx */
+#define SNRF_TRACE_TX 0
+#define SNRF_TRACE_RX 1
+  /* received frame dropped, op and seq unknown */
+#define SNRF_TRACE_RX_CORRUPT 2
+  uint8_t dir;
+  uint8_t op;
+  uint8_t seq;
+  /* message size on the link, header included */
+  uint8_t size;
+  /* first bytes of the message union */
+  uint8_t data[20];
+} __attribute__((packed)) snrf_trace_rec_t;
+
+typedef struct snrf_trace
+{
+  snrf_trace_header_t* header;
+  snrf_trace_rec_t* recs;
+  size_t mask;
+  size_t map_size;
+} snrf_trace_t;
+
+
+int snrf_trace_create(snrf_trace_t*, const char*, size_t);
+int snrf_trace_load(snrf_trace_t*, const char*);
+void snrf_trace_close(snrf_trace_t*);
+
+static inline void snrf_trace_msg
+(snrf_trace_t* trace, uint8_t dir, const snrf_msg_t* msg, uint8_t size)
+{
+  /* any thread, msg NULL for SNRF_TRACE_RX_CORRUPT */
+
+  struct timespec ts;
+  snrf_trace_rec_t* rec;
+  uint64_t i;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  i = __atomic_fetch_add(&trace->header->head, 1, __ATOMIC_RELAXED);
+  rec = &trace->recs[i & trace->mask];
+
+  rec->ns = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+  rec->dir = dir;
+  rec->size = size;
+
+  if (msg == NULL)
+  {
+    rec->op = 0xff;
+    rec->seq = 0;
+    return ;
+  }
+
+  rec->op = msg->op;
+  rec->seq = msg->seq;
+  memcpy(rec->data, &msg->u, sizeof(rec->data));
+}
+
+
+#endif /* SNRF_TRACE_H_INCLUDED */
@@ -0,0 +1,40 @@
+#ifndef SNRF_TRANSPORT_H_INCLUDED
+#define SNRF_TRANSPORT_H_INCLUDED
+
+
+/* byte stream between the host and the device. the serial */
+/* port is the default, cf. snrf_conf_t.transport */
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+typedef struct snrf_transport_ops
+{
+  /* the bytes available, never blocks. *nread 0 if none */
+  int (*read)(void*, void*, size_t, size_t*);
+
+  /* all the bytes, may block */
+  int (*writev)(void*, struct iovec*, int);
+
+  /* the bytes accepted without blocking, *nwritten may be 0 */
+  int (*writev_nowait)(void*, const struct iovec*, int, size_t*);
+
+  /* until bytes are available or the CLOCK_MONOTONIC deadline, */
+  /* NULL for none. return 1 if available, 0 at the deadline */
+  int (*wait)(void*, const struct timespec*);
+
+  /* drain the output, switch the rate, discard the input */
+  int (*set_bauds)(void*, uint32_t);
+
+  /* readable when bytes are available. -1 if the transport has */
+  /* no fd, the reader thread and snrf_loop are then unusable */
+  int (*get_fd)(void*);
+
+  void (*close)(void*);
+
+} snrf_transport_ops_t;
+
+
+#endif /* SNRF_TRANSPORT_H_INCLUDED */
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "snrf_emu.h"
+
+
+#define PERROR()				\
+do {						\
+printf("[!] %s, %u\n", __FILE__, __LINE__);	\
+} while (0)
+
+static volatile sig_atomic_t is_done = 0;
+
+static void on_signal(int sig)
+{
+  is_done = 1;
+}
+
+static int parse_opt(snrf_emu_conf_t* conf, const char* opt)
+{
+  /* name=value */
+
+  const char* const eq = strchr(opt, '=');
+  unsigned long val;
+  size_t len;
+
+  if (eq == NULL) return -1;
+
+  len = (size_t)(eq - opt);
+  val = strtoul(eq + 1, NULL, 0);
+
+#define OPT_IS(__s) ((len == strlen(__s)) && (memcmp(opt, __s, len) == 0))
+
+  if (OPT_IS("chipset"))
+  {
+    if (strcmp(eq + 1, "nrf905") == 0) conf->chipset = SNRF_CHIPSET_NRF905;
+    else if (strcmp(eq + 1, "nrf24l01p") == 0) conf->chipset = SNRF_CHIPSET_NRF24L01P;
+    else return -1;
+  }
+  else if (OPT_IS("uart_loss_ppm")) conf->uart_loss_ppm = (uint32_t)val;
+  else if (OPT_IS("radio_loss_ppm")) conf->radio_loss_ppm = (uint32_t)val;
+  else if (OPT_IS("loopback")) conf->is_loopback = (val != 0);
+  else if (OPT_IS("rx_rate")) conf->rx_rate = (unsigned int)val;
+  else if (OPT_IS("peer_ns")) conf->is_peer_ns = (val != 0);
+  else if (OPT_IS("seed")) conf->seed = (unsigned int)val;
+  else return -1;
+
+  return 0;
+}
+
+int main(int ac, char** av)
+{
+  /* [name=value ...], serve an emulated device on a pty */
+  /* until interrupted. the slave path is printed */
+
+  snrf_emu_conf_t conf;
+  snrf_emu_t emu;
+  int i;
+
+  snrf_emu_init_conf(&conf);
+
+  for (i = 1; i != ac; ++i)
+  {
+    if (parse_opt(&conf, av[i]))
+    {
+      PERROR();
+      return -1;
+    }
+  }
+
+  snrf_emu_init(&emu, &conf);
+
+  if (snrf_emu_start_pty(&emu))
+  {
+    PERROR();
+    return -1;
+  }
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+
+  printf("%s\n", emu.pty_path);
+  fflush(stdout);
+
+  while (is_done == 0) pause();
+
+  snrf_emu_stop_pty(&emu);
+
+  return 0;
+}
@@ -1,9 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
-#include <sys/time.h>
-#include <sys/select.h>
 #include <sys/types.h>
 #include "snrf.h"
 
@@ -60,6 +62,8 @@ static uint8_t str_to_key(const char* s)
   IF_STREQ_RETURN(s, "payload_width", PAYLOAD_WIDTH);
   IF_STREQ_RETURN(s, "uart_flags", UART_FLAGS);
   IF_STREQ_RETURN(s, "nrf_chipset", NRF_CHIPSET);
+  IF_STREQ_RETURN(s, "uart_baud", UART_BAUD);
+  IF_STREQ_RETURN(s, "uart_ncorrupt", UART_NCORRUPT);
 
   return (uint8_t)-1;
 }
@@ -116,6 +120,8 @@ static int str_to_keyval
   case SNRF_KEY_TX_ADDR:
   case SNRF_KEY_PAYLOAD_WIDTH:
   case SNRF_KEY_UART_FLAGS:
+  case SNRF_KEY_UART_BAUD:
+  case SNRF_KEY_UART_NCORRUPT:
     *val = get_uint32(val_str);
     break ;
 
@@ -146,7 +152,7 @@ static void print_keyval(uint8_t key, uint32_t val)
   case SNRF_KEY_STATE:
     key_str = "state";
     if (val == SNRF_STATE_CONF) val_str = "conf";
-    else if (val == SNRF_STATE_CONF) val_str = "conf";
+    else if (val == SNRF_STATE_TXRX) val_str = "txrx";
     else val_str = "invalid";
     break ;
 
@@ -210,6 +216,18 @@ static void print_keyval(uint8_t key, uint32_t val)
     val_str = val_buf;
     break ;
 
+  case SNRF_KEY_UART_BAUD:
+    key_str = "uart_baud";
+    sprintf(val_buf, "%u", val);
+    val_str = val_buf;
+    break ;
+
+  case SNRF_KEY_UART_NCORRUPT:
+    key_str = "uart_ncorrupt";
+    sprintf(val_buf, "%u", val);
+    val_str = val_buf;
+    break ;
+
   case SNRF_KEY_NRF_CHIPSET:
     key_str = "nrf_chipset";
     if (val == SNRF_CHIPSET_NRF24L01P) val_str = "nrf24l01p";
@@ -226,60 +244,331 @@ static void print_keyval(uint8_t key, uint32_t val)
   printf("%s = %s\n", key_str, val_str);
 }
 
-int main(int ac, char** av)
+static void print_hist(const char* name, const snrf_hist_t* h)
 {
-  const char* const op = av[1];
-  snrf_handle_t snrf;
-  int err = -1;
+  /* in microseconds */
 
-  if (snrf_open_with_path(&snrf, "/dev/ttyUSB0"))
+  if (h->count == 0)
   {
-    PERROR();
-    goto on_error_0;
+    printf("%-12s count 0\n", name);
+    return ;
+  }
+
+  printf
+  (
+   "%-12s count %llu min %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f mean %.1f\n",
+   name, (unsigned long long)h->count,
+   (double)h->min / 1000.0,
+   (double)snrf_hist_percentile(h, 50.0) / 1000.0,
+   (double)snrf_hist_percentile(h, 90.0) / 1000.0,
+   (double)snrf_hist_percentile(h, 99.0) / 1000.0,
+   (double)h->max / 1000.0,
+   ((double)h->sum / (double)h->count) / 1000.0
+  );
+}
+
+static void print_stats(const snrf_stats_t* stats)
+{
+  print_hist("rtt_us", &stats->rtt);
+  print_hist("gap_us", &stats->payload_gap);
+  print_hist("wait_us", &stats->read_wait);
+
+  printf("nsync %zu ntimeout %zu nretry %zu nfail %zu\n",
+	 stats->nsync, stats->ntimeout, stats->nretry, stats->nfail);
+  printf("ncorrupt %zu ndrop %zu noverflow %zu\n",
+	 stats->ncorrupt, stats->ndrop, stats->noverflow);
+  printf("hwm tx %zu window %zu payload %zu compl %zu debug %zu reader %zu\n",
+	 stats->tx_hwm, stats->window_hwm, stats->payload_ring_hwm,
+	 stats->compl_ring_hwm, stats->debug_ring_hwm, stats->reader_ring_hwm);
+}
+
+/* stream output, cf. do_stream */
+
+#define STREAM_FORMAT_HEX 0
+#define STREAM_FORMAT_BIN 1
+#define STREAM_FORMAT_JSON 2
+
+/* flush latency bound, in microseconds */
+#define STREAM_FLUSH_US_DEFAULT 10000
+
+typedef struct stream
+{
+  unsigned int format;
+  unsigned int is_ts;
+  /* CLOCK_REALTIME - CLOCK_MONOTONIC, in ns */
+  uint64_t ts_off;
+  uint8_t buf[64 * 1024];
+  size_t size;
+  /* deadline of the oldest buffered byte */
+  struct timespec deadline;
+} stream_t;
+
+static volatile sig_atomic_t is_stream_done = 0;
+
+static void on_stream_signal(int sig)
+{
+  is_stream_done = 1;
+}
+
+static int stream_flush(stream_t* stream)
+{
+  size_t off;
+  ssize_t n;
+
+  for (off = 0; off != stream->size; off += (size_t)n)
+  {
+    n = write(STDOUT_FILENO, stream->buf + off, stream->size - off);
+    if (n > 0) continue ;
+    if ((n < 0) && (errno == EINTR)) n = 0;
+    else return -1;
+  }
+
+  stream->size = 0;
+
+  return 0;
+}
+
+static size_t put_hex(uint8_t* p, const uint8_t* data, size_t size)
+{
+  static const char digits[] = "0123456789abcdef";
+  size_t i;
+
+  for (i = 0; i != size; ++i)
+  {
+    p[i * 2 + 0] = digits[data[i] >> 4];
+    p[i * 2 + 1] = digits[data[i] & 0xf];
   }
 
+  return size * 2;
+}
+
+static void stream_put(stream_t* stream, const snrf_payload_t* payload)
+{
+  /* room for the largest record left by the caller. binary */
+  /* records are the optional 8 bytes little endian timestamp, */
+  /* the size byte then the data */
+
+  uint8_t* const p = stream->buf + stream->size;
+  const uint64_t ts = payload->ns + stream->ts_off;
+  size_t n = 0;
+  size_t i;
+
+  switch (stream->format)
+  {
+  case STREAM_FORMAT_BIN:
+    if (stream->is_ts)
+    {
+      for (i = 0; i != 8; ++i) p[n++] = (uint8_t)(ts >> (i * 8));
+    }
+    p[n++] = (uint8_t)payload->size;
+    memcpy(p + n, payload->data, payload->size);
+    n += payload->size;
+    break ;
+
+  case STREAM_FORMAT_JSON:
+    n = (size_t)sprintf((char*)p, "{");
+    if (stream->is_ts)
+      n += (size_t)sprintf((char*)p + n, "\"ts_ns\": %llu, ",
+			   (unsigned long long)ts);
+    n += (size_t)sprintf((char*)p + n, "\"size\": %zu, \"data\": \"",
+			 payload->size);
+    n += put_hex(p + n, payload->data, payload->size);
+    n += (size_t)sprintf((char*)p + n, "\"}\n");
+    break ;
+
+  default:
+    if (stream->is_ts)
+      n = (size_t)sprintf((char*)p, "%llu ", (unsigned long long)ts);
+    n += put_hex(p + n, payload->data, payload->size);
+    p[n++] = '\n';
+    break ;
+  }
+
+  stream->size += n;
+}
+
+static int do_stream
+(snrf_handle_t* snrf, unsigned int format, unsigned int is_ts, unsigned int us)
+{
+  /* write the payloads received to stdout until interrupted or */
+  /* the reader goes away. the output is buffered and flushed */
+  /* when full, or at most us microseconds after the oldest */
+  /* buffered payload. the timestamp is the time the library */
+  /* read each payload from the device, as CLOCK_REALTIME ns */
+
+  /* largest record, json with a timestamp */
+#define STREAM_REC_MAX (64 + 2 * SNRF_MAX_PAYLOAD_WIDTH)
+
+  static stream_t stream;
+  snrf_payload_t payloads[64];
+  struct timespec now;
+  struct timespec mono;
+  size_t n;
+  size_t i;
+  int err = 0;
+
+  stream.format = format;
+  stream.is_ts = is_ts;
+  stream.ts_off = 0;
+  stream.size = 0;
+
+  /* the handle is closed on the way out, and the buffer flushed */
+  signal(SIGINT, on_stream_signal);
+  signal(SIGTERM, on_stream_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  while (is_stream_done == 0)
+  {
+    /* never wait longer than the bound, to notice the signals */
+    if (stream.size == 0) snrf_get_deadline(&stream.deadline, us);
+
+    err = snrf_read_payloads_until(snrf, payloads, 64, &n, &stream.deadline);
+
+    if (err == -2)
+    {
+      err = stream_flush(&stream);
+      if (err) break ;
+      continue ;
+    }
+    else if (err)
+    {
+      PERROR();
+      break ;
+    }
+
+    /* follow the realtime clock adjustments */
+    if (is_ts)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &mono);
+      clock_gettime(CLOCK_REALTIME, &now);
+      stream.ts_off =
+	((uint64_t)now.tv_sec - (uint64_t)mono.tv_sec) * 1000000000 +
+	(uint64_t)now.tv_nsec - (uint64_t)mono.tv_nsec;
+    }
+
+    /* the bound starts with the oldest buffered payload */
+    if (stream.size == 0) snrf_get_deadline(&stream.deadline, us);
+
+    for (i = 0; i != n; ++i)
+    {
+      if ((sizeof(stream.buf) - stream.size) < STREAM_REC_MAX)
+      {
+	err = stream_flush(&stream);
+	if (err) break ;
+	snrf_get_deadline(&stream.deadline, us);
+      }
+
+      stream_put(&stream, &payloads[i]);
+    }
+
+    if (err) break ;
+
+    /* the deadline may pass while payloads keep coming */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec > stream.deadline.tv_sec) ||
+	((now.tv_sec == stream.deadline.tv_sec) &&
+	 (now.tv_nsec >= stream.deadline.tv_nsec)))
+    {
+      err = stream_flush(&stream);
+      if (err) break ;
+    }
+  }
+
+  if (err == 0) err = stream_flush(&stream);
+
+  /* a closed pipe is the normal end */
+  if (err && (errno == EPIPE)) err = 0;
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  return err;
+}
+
+static int set_state(snrf_handle_t* snrf, uint32_t state)
+{
+  /* the handle tracks the device state, skip the round trip */
+  /* if already there */
+
+  if (snrf->state == state) return 0;
+  return snrf_set_keyval(snrf, SNRF_KEY_STATE, state);
+}
+
+static int do_cmd(snrf_handle_t* snrf, int ac, char** av)
+{
+  /* av[0] the op, then its arguments */
+
+  const char* const op = av[0];
+
   if (strcmp(op, "read") == 0)
   {
     /* read one payload */
 
-    const int fd = snrf_get_fd(&snrf);
-
     uint8_t buf[SNRF_MAX_PAYLOAD_WIDTH];
     size_t count;
     size_t size;
-    fd_set set;
 
-    if (snrf_set_keyval(&snrf, SNRF_KEY_STATE, SNRF_STATE_TXRX))
+    if (set_state(snrf, SNRF_STATE_TXRX))
     {
       PERROR();
-      goto on_error_1;
+      return -1;
     }
 
-    if (ac > 2) count = (size_t)get_uint32(av[2]);
+    if (ac > 1) count = (size_t)get_uint32(av[1]);
     else count = (size_t)-1;
 
     while (count)
     {
       memset(buf, 0x2a, sizeof(buf));
 
-      FD_ZERO(&set);
-      FD_SET(fd, &set);
-
-      if (select(fd + 1, &set, NULL, NULL, NULL) <= 0)
+      /* payloads may already be buffered, do not select the fd */
+      if (snrf_read_payload(snrf, buf, &size))
       {
 	PERROR();
-	goto on_error_1;
+	return -1;
       }
 
-      if (snrf_read_payload(&snrf, buf, &size))
+      print_buf(buf, size);
+
+      if (count != (size_t)-1) --count;
+    }
+  }
+  else if (strcmp(op, "stream") == 0)
+  {
+    /* stream [hex|bin|json [ts [flush_us]]] */
+
+    unsigned int format = STREAM_FORMAT_HEX;
+    unsigned int is_ts = 0;
+    unsigned int us = STREAM_FLUSH_US_DEFAULT;
+
+    if (ac > 1)
+    {
+      if (strcmp(av[1], "hex") == 0) format = STREAM_FORMAT_HEX;
+      else if (strcmp(av[1], "bin") == 0) format = STREAM_FORMAT_BIN;
+      else if (strcmp(av[1], "json") == 0) format = STREAM_FORMAT_JSON;
+      else
       {
 	PERROR();
-	goto on_error_1;
+	return -1;
       }
+    }
 
-      print_buf(buf, size);
+    if (ac > 2) is_ts = (strcmp(av[2], "ts") == 0);
+    if (ac > 3) us = get_uint32(av[3]);
 
-      if (count != (size_t)-1) --count;
+    if (set_state(snrf, SNRF_STATE_TXRX))
+    {
+      PERROR();
+      return -1;
+    }
+
+    /* flush the messages printed so far */
+    fflush(stdout);
+
+    if (do_stream(snrf, format, is_ts, us))
+    {
+      PERROR();
+      return -1;
     }
   }
   else if (strcmp(op, "write") == 0)
@@ -289,81 +578,243 @@ int main(int ac, char** av)
     uint8_t buf[SNRF_MAX_PAYLOAD_WIDTH];
     size_t size;
 
-    if (snrf_set_keyval(&snrf, SNRF_KEY_STATE, SNRF_STATE_TXRX))
+    if (ac < 2)
     {
       PERROR();
-      goto on_error_1;
+      return -1;
     }
 
-    size = strlen(av[2]);
+    if (set_state(snrf, SNRF_STATE_TXRX))
+    {
+      PERROR();
+      return -1;
+    }
+
+    size = strlen(av[1]);
     if (size > SNRF_MAX_PAYLOAD_WIDTH) size = SNRF_MAX_PAYLOAD_WIDTH;
-    memcpy(buf, av[2], size);
+    memcpy(buf, av[1], size);
 
-    if (snrf_write_payload(&snrf, buf, size))
+    if (snrf_write_payload(snrf, buf, size))
     {
       PERROR();
-      goto on_error_1;
+      return -1;
     }
   }
   else if (strcmp(op, "set") == 0)
   {
-    uint8_t key;
-    uint32_t val;
+    /* set key val [key val ...], in one message */
+
+    snrf_keyval_t kvs[SNRF_SET_MULTI_MAX];
+    size_t n = 0;
+    size_t first;
+    int i;
 
-    if (str_to_keyval(av[2], av[3], &key, &val))
+    /* the keys are applied in conf mode */
+    if (snrf->state != SNRF_STATE_CONF)
     {
-      PERROR();
-      goto on_error_1;
+      kvs[0].key = SNRF_KEY_STATE;
+      kvs[0].val = SNRF_STATE_CONF;
+      n = 1;
     }
+    first = n;
 
-    if (snrf_set_keyval(&snrf, SNRF_KEY_STATE, SNRF_STATE_CONF))
+    for (i = 1; (i + 1) < ac; i += 2, ++n)
+    {
+      if ((n == SNRF_SET_MULTI_MAX) ||
+	  str_to_keyval(av[i], av[i + 1], &kvs[n].key, &kvs[n].val))
+      {
+	PERROR();
+	return -1;
+      }
+    }
+
+    if ((n == first) || (i != ac))
     {
       PERROR();
-      goto on_error_1;
+      return -1;
     }
 
-    if (snrf_set_keyval(&snrf, key, val))
+    /* the rate is only changed alone, by its negotiation */
+    if ((n == (first + 1)) && (kvs[first].key == SNRF_KEY_UART_BAUD))
+    {
+      if (snrf_set_uart_baud(snrf, kvs[first].val))
+      {
+	PERROR();
+	return -1;
+      }
+    }
+    else if (snrf_set_keyvals(snrf, kvs, n))
     {
       PERROR();
-      goto on_error_1;
-    }    
+      return -1;
+    }
   }
   else if (strcmp(op, "get") == 0)
   {
     uint8_t key;
     uint32_t val;
 
-    if (str_to_keyval(av[2], NULL, &key, &val))
+    if ((ac < 2) || str_to_keyval(av[1], NULL, &key, &val))
     {
       PERROR();
-      goto on_error_1;
+      return -1;
     }
 
-    if (snrf_set_keyval(&snrf, SNRF_KEY_STATE, SNRF_STATE_CONF))
+    if (set_state(snrf, SNRF_STATE_CONF))
     {
       PERROR();
-      goto on_error_1;
+      return -1;
     }
 
-    if (snrf_get_keyval(&snrf, key, &val))
+    if (snrf_get_keyval(snrf, key, &val))
     {
       PERROR();
-      goto on_error_1;
+      return -1;
     }
 
     print_keyval(key, val);
   }
+  else if (strcmp(op, "sync") == 0)
+  {
+    /* resynchronize and report the cost */
+
+    if (snrf_sync(snrf))
+    {
+      PERROR();
+      return -1;
+    }
+
+    printf("sync = %llu us\n", (unsigned long long)snrf->sync_last_ns / 1000);
+  }
+  else if (strcmp(op, "stats") == 0)
+  {
+    /* probe the link with count round trips, then report */
+
+    snrf_stats_t stats;
+    uint32_t val;
+    size_t count;
+
+    if (ac > 1) count = (size_t)get_uint32(av[1]);
+    else count = 100;
+
+    /* the open time exchanges are not measured */
+    snrf_reset_stats(snrf);
+
+    for (; count; --count)
+    {
+      /* the state is never cached, each get is a round trip */
+      if (snrf_get_keyval(snrf, SNRF_KEY_STATE, &val))
+      {
+	PERROR();
+	return -1;
+      }
+    }
+
+    snrf_get_stats(snrf, &stats);
+    print_stats(&stats);
+  }
   else
+  {
+    PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+static uint64_t get_now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static int do_shell(snrf_handle_t* snrf, FILE* file)
+{
+  /* one command per line, with the command line syntax, all */
+  /* run over the same handle. blank lines and lines starting */
+  /* with # are skipped. the time of each command is reported */
+  /* after its output. stop at the first error */
+
+#define SHELL_ARG_MAX (1 + 2 * SNRF_SET_MULTI_MAX)
+  char* av[SHELL_ARG_MAX];
+  char line[512];
+  char* p;
+  size_t lineno;
+  uint64_t us;
+  int ac;
+
+  for (lineno = 1; fgets(line, sizeof(line), file) != NULL; ++lineno)
+  {
+    ac = 0;
+    for (p = strtok(line, " \t\r\n"); p != NULL; p = strtok(NULL, " \t\r\n"))
+    {
+      if (ac == SHELL_ARG_MAX)
+      {
+	printf("[!] line %zu, too many arguments\n", lineno);
+	return -1;
+      }
+      av[ac++] = p;
+    }
+
+    if ((ac == 0) || (av[0][0] == '#')) continue ;
+
+    us = get_now_us();
+
+    if (do_cmd(snrf, ac, av))
+    {
+      printf("[!] line %zu, %s failed\n", lineno, av[0]);
+      return -1;
+    }
+
+    us = get_now_us() - us;
+
+    printf("[%zu] %s %llu us\n", lineno, av[0], (unsigned long long)us);
+    fflush(stdout);
+  }
+
+  return 0;
+}
+
+int main(int ac, char** av)
+{
+  /* op [args], or shell [file] to run the commands of file, */
+  /* stdin by default */
+
+  snrf_handle_t snrf;
+  FILE* file = NULL;
+  int err = -1;
+
+  if (ac < 2)
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  if (strcmp(av[1], "shell") == 0)
+  {
+    if (ac > 2) file = fopen(av[2], "r");
+    else file = stdin;
+
+    if (file == NULL)
+    {
+      PERROR();
+      goto on_error_0;
+    }
+  }
+
+  if (snrf_open_with_path(&snrf, "/dev/ttyUSB0"))
   {
     PERROR();
     goto on_error_1;
   }
 
-  /* success */
-  err = 0;
+  if (file != NULL) err = do_shell(&snrf, file);
+  else err = do_cmd(&snrf, ac - 1, av + 1);
 
- on_error_1:
   snrf_close(&snrf);
+ on_error_1:
+  if ((file != NULL) && (file != stdin)) fclose(file);
  on_error_0:
   return err;
 }
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/types.h>
+#include "snrf.h"
+#include "snrf_pcap.h"
+
+
+#define PERROR()				\
+do {						\
+printf("[!] %s, %u\n", __FILE__, __LINE__);	\
+} while (0)
+
+
+typedef struct replay
+{
+  snrf_handle_t snrf;
+  /* messages sent, not yet completed */
+  size_t inflight;
+  size_t nsent;
+  size_t ncompl;
+  size_t nerr;
+  size_t nlost;
+  size_t nskip;
+  size_t npayload;
+  uint64_t lag_max_ns;
+  /* device state, and the one the captured traffic ran in */
+  uint32_t state;
+  uint32_t want_state;
+} replay_t;
+
+static inline void get_now(struct timespec* ts)
+{
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static inline int64_t diff_ns(const struct timespec* a, const struct timespec* b)
+{
+  return (int64_t)(a->tv_sec - b->tv_sec) * 1000000000 + (a->tv_nsec - b->tv_nsec);
+}
+
+static void add_ns(struct timespec* ts, uint64_t ns)
+{
+  ns += ts->tv_nsec;
+  ts->tv_sec += ns / 1000000000;
+  ts->tv_nsec = ns % 1000000000;
+}
+
+static int drain(replay_t* r)
+{
+  /* account for all the received messages */
+
+  snrf_msg_t msg;
+  int err;
+
+  while ((err = snrf_read_msg(&r->snrf, &msg)) == 0)
+  {
+    if (msg.op == SNRF_OP_PAYLOAD)
+    {
+      ++r->npayload;
+    }
+    else if (msg.op == SNRF_OP_COMPL)
+    {
+      ++r->ncompl;
+      if (msg.u.compl.err != SNRF_ERR_SUCCESS) ++r->nerr;
+      if (r->inflight) --r->inflight;
+    }
+  }
+
+  if (err == -1)
+  {
+    PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+static int wait_input(replay_t* r, const struct timespec* deadline)
+{
+  /* return -2 once deadline is reached */
+
+  struct pollfd pfd;
+  struct timespec now;
+  struct timespec ts;
+  int64_t ns;
+  int err;
+
+  get_now(&now);
+  ns = diff_ns(deadline, &now);
+  if (ns <= 0) return -2;
+
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+
+  pfd.fd = snrf_get_fd(&r->snrf);
+  pfd.events = POLLIN;
+  err = ppoll(&pfd, 1, &ts, NULL);
+  if (err < 0)
+  {
+    PERROR();
+    return -1;
+  }
+
+  return drain(r);
+}
+
+static int wait_window(replay_t* r, size_t count)
+{
+  /* wait until at most count messages are in flight. missing */
+  /* completions are counted as lost, and the link resynced */
+
+  struct timespec deadline;
+  int err;
+
+  get_now(&deadline);
+  add_ns(&deadline, (uint64_t)SNRF_COMPL_MS * 1000000);
+
+  while (r->inflight > count)
+  {
+    err = wait_input(r, &deadline);
+    if (err == -1)
+    {
+      PERROR();
+      return -1;
+    }
+    else if (err == -2)
+    {
+      r->nlost += r->inflight;
+      r->inflight = 0;
+      if (snrf_sync(&r->snrf))
+      {
+	PERROR();
+	return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static int send_msg(replay_t* r, snrf_msg_t* msg)
+{
+  /* the device buffers at most SNRF_WINDOW_MAX messages */
+
+  if (wait_window(r, SNRF_WINDOW_MAX - 1))
+  {
+    PERROR();
+    return -1;
+  }
+
+  if (snrf_post_msg(&r->snrf, msg))
+  {
+    PERROR();
+    return -1;
+  }
+
+  if (snrf_flush(&r->snrf))
+  {
+    PERROR();
+    return -1;
+  }
+
+  ++r->inflight;
+  ++r->nsent;
+
+  return 0;
+}
+
+static unsigned int is_link_msg(const snrf_msg_t* msg)
+{
+  /* link management, done by the replaying handle itself */
+
+  size_t i;
+
+  switch (msg->op)
+  {
+  case SNRF_OP_SYNC:
+    return 1;
+
+  case SNRF_OP_SET:
+    return msg->u.set.key == SNRF_KEY_UART_BAUD;
+
+  case SNRF_OP_GET:
+    return msg->u.get.key == SNRF_KEY_UART_BAUD;
+
+  case SNRF_OP_SET_MULTI:
+    for (i = 0; i != SNRF_SET_MULTI_MAX; ++i)
+    {
+      if (msg->u.set_multi.pairs[i].key == SNRF_KEY_NONE) break ;
+      if (msg->u.set_multi.pairs[i].key == SNRF_KEY_UART_BAUD) return 1;
+    }
+    return 0;
+
+  default:
+    return 0;
+  }
+}
+
+static void track_state(replay_t* r, const snrf_msg_t* msg)
+{
+  /* a set_multi is replayed as is, it may change the state */
+
+  size_t i;
+
+  if (msg->op != SNRF_OP_SET_MULTI) return ;
+
+  for (i = 0; i != SNRF_SET_MULTI_MAX; ++i)
+  {
+    if (msg->u.set_multi.pairs[i].key == SNRF_KEY_NONE) break ;
+    if (msg->u.set_multi.pairs[i].key != SNRF_KEY_STATE) continue ;
+    r->state = le32toh(msg->u.set_multi.pairs[i].val);
+    r->want_state = r->state;
+  }
+}
+
+static int apply_state(replay_t* r)
+{
+  /* the state toggles of the capture are applied once the */
+  /* traffic needs them, so that those done by its open and */
+  /* close are not replayed */
+
+  if (r->state == r->want_state) return 0;
+
+  if (wait_window(r, 0))
+  {
+    PERROR();
+    return -1;
+  }
+
+  if (snrf_set_keyval(&r->snrf, SNRF_KEY_STATE, r->want_state))
+  {
+    PERROR();
+    return -1;
+  }
+
+  r->state = r->want_state;
+
+  return 0;
+}
+
+int main(int ac, char** av)
+{
+  /* capture_path [device_path [speed]] */
+  /* speed the time scale, 2 replays twice as fast, 0 as */
+  /* fast as the window allows */
+
+  const char* dev_path = "/dev/ttyUSB0";
+  snrf_pcap_t pcap;
+  snrf_pcap_rec_t rec;
+  struct timespec first_ts;
+  struct timespec start;
+  struct timespec due;
+  struct timespec now;
+  replay_t r;
+  double speed = 1.0;
+  unsigned int is_first = 1;
+  int64_t ns;
+  int err = -1;
+
+  if (ac < 2)
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  if (ac > 2) dev_path = av[2];
+  if (ac > 3) speed = strtod(av[3], NULL);
+
+  if (snrf_pcap_load(&pcap, av[1]))
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  memset(&r, 0, sizeof(r));
+  memset(&first_ts, 0, sizeof(first_ts));
+
+  if (snrf_open_with_path(&r.snrf, dev_path))
+  {
+    PERROR();
+    goto on_error_1;
+  }
+
+  r.state = r.snrf.state;
+  r.want_state = r.state;
+
+  while ((err = snrf_pcap_read(&pcap, &rec)) == 0)
+  {
+    /* the device answers are not replayed */
+    if (rec.dir != SNRF_PCAP_TX) continue ;
+
+    /* link recovery and rate changes, not traffic */
+    if (is_link_msg(&rec.msg))
+    {
+      ++r.nskip;
+      continue ;
+    }
+
+    if ((rec.msg.op == SNRF_OP_SET) && (rec.msg.u.set.key == SNRF_KEY_STATE))
+    {
+      r.want_state = le32toh(rec.msg.u.set.val);
+      ++r.nskip;
+      continue ;
+    }
+
+    if (is_first)
+    {
+      first_ts = rec.ts;
+      get_now(&start);
+      is_first = 0;
+    }
+
+    if (speed > 0.0)
+    {
+      ns = diff_ns(&rec.ts, &first_ts);
+      due = start;
+      add_ns(&due, (uint64_t)((double)ns / speed));
+
+      while ((err = wait_input(&r, &due)) == 0) ;
+      if (err == -1)
+      {
+	PERROR();
+	goto on_error_2;
+      }
+
+      /* late when the window or the link could not keep up */
+      get_now(&now);
+      ns = diff_ns(&now, &due);
+      if ((ns > 0) && ((uint64_t)ns > r.lag_max_ns)) r.lag_max_ns = (uint64_t)ns;
+    }
+
+    if (apply_state(&r) || send_msg(&r, &rec.msg))
+    {
+      PERROR();
+      err = -1;
+      goto on_error_2;
+    }
+
+    track_state(&r, &rec.msg);
+  }
+
+  if (err == -1)
+  {
+    PERROR();
+    goto on_error_2;
+  }
+
+  /* the last completions */
+  if (wait_window(&r, 0))
+  {
+    PERROR();
+    err = -1;
+    goto on_error_2;
+  }
+
+  get_now(&now);
+
+  printf("sent %zu compl %zu err %zu lost %zu skipped %zu payloads %zu\n",
+	 r.nsent, r.ncompl, r.nerr, r.nlost, r.nskip, r.npayload);
+
+  if (is_first == 0)
+  {
+    printf("duration %.6f s, max lag %.1f us\n",
+	   (double)diff_ns(&now, &start) / 1000000000.0,
+	   (double)r.lag_max_ns / 1000.0);
+  }
+
+  err = 0;
+
+ on_error_2:
+  snrf_close(&r.snrf);
+ on_error_1:
+  snrf_pcap_close(&pcap);
+ on_error_0:
+  return err;
+}
@@ -0,0 +1,775 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <endian.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include "snrf.h"
+#include "snrf_loop.h"
+#include "snrf_client.h"
+
+
+#define PERROR()				\
+do {						\
+printf("[!] %s, %u\n", __FILE__, __LINE__);	\
+} while (0)
+
+/* requests read from a client before serving the others */
+#define REQ_BATCH 8
+
+/* payloads posted to the loop and not completed. below the */
+/* loop backlog, so that posting never fails */
+#define TX_INFLIGHT_MAX SNRF_LOOP_BACKLOG_SIZE
+
+/* loop tag of a payload: the request seq, the client index */
+/* and its generation, so that the completion of a client */
+/* gone is not sent to the next one in the same slot */
+#define TAG_ID_SHIFT 32
+#define TAG_GEN_SHIFT 38
+#define TAG_GEN_MASK ((1 << (64 - TAG_GEN_SHIFT)) - 1)
+
+typedef struct client
+{
+  int fd;
+  /* snrf_loop fd watch, -1 once the client hung up */
+  int watch;
+  /* own wake word, cf. snrf_client_wake_t */
+  snrf_client_wake_t* wake;
+  /* incremented each time the slot is used */
+  uint32_t gen;
+  snrf_client_filter_t filter;
+  /* hung up while the requests were not read */
+  unsigned int is_closing;
+  unsigned int is_used;
+} client_t;
+
+typedef struct snrfd
+{
+  snrf_loop_t loop;
+  snrf_handle_t snrf;
+
+  int listen_fd;
+
+  /* shared payload ring, cf. snrf_client.h. head is private, */
+  /* published to the header once the record is written */
+  int ring_fd;
+  snrf_client_ring_header_t* header;
+  snrf_client_rec_t* recs;
+  size_t mask;
+  size_t map_size;
+  uint64_t head;
+
+  client_t clients[SNRF_CLIENT_MAX];
+
+  size_t ninflight;
+  /* the clients are not read until the device catches up */
+  unsigned int is_tx_blocked;
+
+  size_t nrx;
+  size_t ntx;
+  size_t nfail;
+  size_t ntimeout;
+  int err;
+} snrfd_t;
+
+static snrfd_t snrfd;
+
+
+/* payload ring */
+
+static int create_ring(snrfd_t* d, size_t count)
+{
+  /* anonymous file, passed to the clients over the socket. */
+  /* sealed once mapped here: the clients can only map it read */
+  /* only, and can not shrink it under the daemon */
+
+  size_t n;
+  void* p;
+
+  for (n = 1; n < count; n <<= 1) ;
+
+  d->map_size = sizeof(snrf_client_ring_header_t) + n * sizeof(snrf_client_rec_t);
+
+  d->ring_fd = memfd_create("snrfd", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (d->ring_fd == -1)
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  if (ftruncate(d->ring_fd, (off_t)d->map_size))
+  {
+    PERROR();
+    goto on_error_1;
+  }
+
+  p = mmap(NULL, d->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, d->ring_fd, 0);
+  if (p == MAP_FAILED)
+  {
+    PERROR();
+    goto on_error_1;
+  }
+
+  if (fcntl(d->ring_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+	    F_SEAL_FUTURE_WRITE | F_SEAL_SEAL))
+  {
+    PERROR();
+    goto on_error_2;
+  }
+
+  d->header = p;
+  d->recs = (snrf_client_rec_t*)(d->header + 1);
+  d->mask = n - 1;
+  d->head = 0;
+
+  d->header->magic = SNRF_CLIENT_MAGIC;
+  d->header->version = SNRF_CLIENT_VERSION;
+  d->header->rec_size = sizeof(snrf_client_rec_t);
+  d->header->rec_count = (uint32_t)n;
+
+  return 0;
+
+ on_error_2:
+  munmap(p, d->map_size);
+ on_error_1:
+  close(d->ring_fd);
+ on_error_0:
+  return -1;
+}
+
+static int create_wake(snrf_client_wake_t** wake)
+{
+  /* return the fd of a client wake word, mapped to wake. */
+  /* the client writes it, but can not shrink it */
+
+  void* p;
+  int fd;
+
+  fd = memfd_create("snrfd_wake", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  if (ftruncate(fd, sizeof(snrf_client_wake_t)) ||
+      fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL))
+  {
+    PERROR();
+    goto on_error_1;
+  }
+
+  p = mmap(NULL, sizeof(snrf_client_wake_t), PROT_READ | PROT_WRITE,
+	   MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+  {
+    PERROR();
+    goto on_error_1;
+  }
+
+  *wake = p;
+
+  return fd;
+
+ on_error_1:
+  close(fd);
+ on_error_0:
+  return -1;
+}
+
+static void publish(snrfd_t* d, const uint8_t* data, size_t size)
+{
+  /* write the record once, with the bits of the matching */
+  /* clients, then wake the sleeping ones */
+
+  snrf_client_rec_t* rec;
+  struct timespec ts;
+  uint64_t mask = 0;
+  uint64_t i;
+  size_t j;
+
+  for (j = 0; j != SNRF_CLIENT_MAX; ++j)
+  {
+    const client_t* const c = &d->clients[j];
+    if (c->is_used && snrf_client_match(&c->filter, data, size))
+      mask |= (uint64_t)1 << j;
+  }
+
+  if (mask == 0) return ;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  i = d->head++;
+  rec = &d->recs[i & d->mask];
+
+  /* seqlock, readers of the previous record see it change */
+  __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  rec->mask = mask;
+  rec->ns = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+  rec->size = (uint8_t)size;
+  memcpy(rec->data, data, size);
+
+  __atomic_store_n(&rec->seq, i + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&d->header->head, i + 1, __ATOMIC_RELEASE);
+
+  /* no syscall while the clients keep up */
+  for (j = 0; j != SNRF_CLIENT_MAX; ++j)
+  {
+    snrf_client_wake_t* w;
+
+    if ((mask & ((uint64_t)1 << j)) == 0) continue ;
+
+    w = d->clients[j].wake;
+    __atomic_add_fetch(&w->wake, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->nwaiters, __ATOMIC_SEQ_CST))
+      syscall(SYS_futex, &w->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+
+/* clients */
+
+static int send_hello(snrfd_t* d, int fd, uint32_t id, int wake_fd)
+{
+  const int fds[2] = { d->ring_fd, wake_fd };
+  char cbuf[CMSG_SPACE(sizeof(fds))];
+  snrf_client_hello_t hello;
+  struct cmsghdr* cmsg;
+  struct msghdr mh;
+  struct iovec iov;
+
+  hello.magic = SNRF_CLIENT_MAGIC;
+  hello.version = SNRF_CLIENT_VERSION;
+  hello.id = id;
+
+  iov.iov_base = &hello;
+  iov.iov_len = sizeof(hello);
+
+  memset(&mh, 0, sizeof(mh));
+  memset(cbuf, 0, sizeof(cbuf));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = cbuf;
+  mh.msg_controllen = sizeof(cbuf);
+
+  cmsg = CMSG_FIRSTHDR(&mh);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(fd, &mh, MSG_NOSIGNAL) != (ssize_t)sizeof(hello))
+  {
+    PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+static void drop_client(snrfd_t* d, client_t* c)
+{
+  if (c->watch != -1) snrf_loop_del_fd(&d->loop, c->watch);
+  close(c->fd);
+  munmap(c->wake, sizeof(snrf_client_wake_t));
+  c->is_used = 0;
+}
+
+static int send_compl
+(client_t* c, uint32_t seq, uint8_t status, uint8_t err)
+{
+  /* return -1 if the client does not read its completions. */
+  /* a client that hung up still has its requests served */
+
+  snrf_client_compl_t compl;
+  ssize_t n;
+
+  compl.seq = seq;
+  compl.status = status;
+  compl.err = err;
+
+  n = send(c->fd, &compl, sizeof(compl), MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (n == (ssize_t)sizeof(compl)) return 0;
+  if ((n == -1) && ((errno == EPIPE) || (errno == ECONNRESET))) return 0;
+
+  return -1;
+}
+
+static inline uint64_t make_tag(snrfd_t* d, client_t* c, uint32_t seq)
+{
+  return ((uint64_t)(c->gen & TAG_GEN_MASK) << TAG_GEN_SHIFT) |
+    ((uint64_t)(c - d->clients) << TAG_ID_SHIFT) | seq;
+}
+
+static client_t* get_tag_client(snrfd_t* d, uint64_t tag)
+{
+  /* NULL if the client is gone */
+
+  client_t* const c =
+    &d->clients[(tag >> TAG_ID_SHIFT) & (SNRF_CLIENT_MAX - 1)];
+
+  if (c->is_used == 0) return NULL;
+  if ((c->gen & TAG_GEN_MASK) != (tag >> TAG_GEN_SHIFT)) return NULL;
+
+  return c;
+}
+
+static void compl_tag(snrfd_t* d, uint64_t tag, uint8_t status, uint8_t err)
+{
+  client_t* const c = get_tag_client(d, tag);
+
+  if (c == NULL) return ;
+
+  if (send_compl(c, (uint32_t)tag, status, err))
+  {
+    PERROR();
+    drop_client(d, c);
+  }
+}
+
+static void set_tx_blocked(snrfd_t* d, unsigned int is_blocked)
+{
+  /* stop or resume reading the clients */
+
+  const uint32_t events = is_blocked ? 0 : EPOLLIN;
+  size_t i;
+
+  d->is_tx_blocked = is_blocked;
+
+  for (i = 0; i != SNRF_CLIENT_MAX; ++i)
+  {
+    client_t* const c = &d->clients[i];
+    if ((c->is_used == 0) || (c->watch == -1)) continue ;
+    snrf_loop_mod_fd(&d->loop, c->watch, events);
+  }
+}
+
+static int check_filter(const snrf_client_filter_t* filter)
+{
+  const snrf_client_rule_t* rule;
+  size_t i;
+
+  if (filter->nrules > SNRF_CLIENT_RULE_MAX) return -1;
+
+  for (i = 0; i != filter->nrules; ++i)
+  {
+    rule = &filter->rules[i];
+    if (rule->size > SNRF_CLIENT_RULE_SIZE_MAX) return -1;
+    if (((size_t)rule->off + rule->size) > SNRF_MAX_PAYLOAD_WIDTH) return -1;
+  }
+
+  return 0;
+}
+
+static int handle_req(snrfd_t* d, client_t* c, const snrf_client_req_t* req)
+{
+  /* return -1 if malformed */
+
+  snrf_msg_t msg;
+
+  switch (req->op)
+  {
+  case SNRF_CLIENT_OP_FILTER:
+    if (check_filter(&req->u.filter)) return -1;
+    c->filter = req->u.filter;
+    return send_compl(c, req->seq, SNRF_CLIENT_STATUS_SUCCESS, 0) ? -2 : 0;
+
+  case SNRF_CLIENT_OP_WRITE:
+    if (req->size > SNRF_MAX_PAYLOAD_WIDTH) return -1;
+    msg.op = SNRF_OP_PAYLOAD;
+    memcpy(msg.u.payload.data, req->u.data, req->size);
+    msg.u.payload.size = req->size;
+    break ;
+
+  case SNRF_CLIENT_OP_WRITE_TO:
+    if (req->size > SNRF_MAX_PAYLOAD_WIDTH) return -1;
+    msg.op = SNRF_OP_PAYLOAD_TO;
+    msg.u.payload_to.addr = htole32(req->addr);
+    memcpy(msg.u.payload_to.data, req->u.data, req->size);
+    msg.u.payload_to.size = req->size;
+    break ;
+
+  default:
+    return -1;
+  }
+
+  /* one stream, in the order the requests are read */
+  if (snrf_loop_post_tag(&d->loop, &d->snrf, &msg, make_tag(d, c, req->seq)))
+  {
+    PERROR();
+    return -2;
+  }
+
+  ++d->ninflight;
+
+  return 0;
+}
+
+static int read_reqs(snrfd_t* d, client_t* c)
+{
+  /* return -1 if the client is to be dropped */
+
+  snrf_client_req_t req;
+  ssize_t n;
+  size_t i;
+  int err;
+
+  for (i = 0; i != REQ_BATCH; ++i)
+  {
+    if (d->ninflight == TX_INFLIGHT_MAX)
+    {
+      if (d->is_tx_blocked == 0) set_tx_blocked(d, 1);
+      return 0;
+    }
+
+    n = recv(c->fd, &req, sizeof(req), MSG_DONTWAIT);
+    if (n == -1)
+    {
+      if (errno == EINTR) continue ;
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+	return c->is_closing ? -1 : 0;
+      return -1;
+    }
+
+    /* hung up, all the requests read */
+    if (n == 0) return -1;
+
+    err = (n == (ssize_t)sizeof(req)) ? handle_req(d, c, &req) : -1;
+    if (err == 0) continue ;
+
+    /* told before hanging up, seq 0 if it was not read */
+    if (err == -1)
+    {
+      if (n < (ssize_t)sizeof(req.seq)) req.seq = 0;
+      send_compl(c, req.seq, SNRF_CLIENT_STATUS_MALFORMED, 0);
+    }
+
+    return -1;
+  }
+
+  return 0;
+}
+
+static void on_client(snrf_loop_t* loop, int fd, uint32_t events, void* opaque)
+{
+  client_t* const c = opaque;
+  snrfd_t* const d = &snrfd;
+
+  if (d->is_tx_blocked)
+  {
+    /* readable before blocking, in the same batch */
+    if ((events & (EPOLLHUP | EPOLLERR)) == 0) return ;
+
+    /* read the requests left once unblocked */
+    snrf_loop_del_fd(loop, c->watch);
+    c->watch = -1;
+    c->is_closing = 1;
+    return ;
+  }
+
+  if (read_reqs(d, c)) drop_client(d, c);
+}
+
+static void unblock_tx(snrfd_t* d)
+{
+  size_t i;
+
+  if (d->is_tx_blocked == 0) return ;
+  if (d->ninflight > (TX_INFLIGHT_MAX / 2)) return ;
+
+  set_tx_blocked(d, 0);
+
+  for (i = 0; i != SNRF_CLIENT_MAX; ++i)
+  {
+    client_t* const c = &d->clients[i];
+    if ((c->is_used == 0) || (c->is_closing == 0)) continue ;
+
+    /* no watch left, read until the end */
+    while (d->is_tx_blocked == 0)
+    {
+      if (read_reqs(d, c))
+      {
+	drop_client(d, c);
+	break ;
+      }
+    }
+
+    if (d->is_tx_blocked) break ;
+  }
+}
+
+static void on_accept(snrf_loop_t* loop, int fd, uint32_t events, void* opaque)
+{
+  snrfd_t* const d = opaque;
+  client_t* c;
+  size_t i;
+  int wake_fd;
+  int cfd;
+
+  cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+  if (cfd == -1) return ;
+
+  for (i = 0; i != SNRF_CLIENT_MAX; ++i)
+  {
+    if (d->clients[i].is_used == 0) break ;
+  }
+
+  if (i == SNRF_CLIENT_MAX)
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  c = &d->clients[i];
+
+  wake_fd = create_wake(&c->wake);
+  if (wake_fd == -1)
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  /* the mapping holds the file */
+  if (send_hello(d, cfd, (uint32_t)i, wake_fd))
+  {
+    PERROR();
+    close(wake_fd);
+    goto on_error_1;
+  }
+
+  close(wake_fd);
+
+  ++c->gen;
+  c->fd = cfd;
+  c->is_closing = 0;
+  snrf_client_init_filter(&c->filter);
+
+  c->watch = snrf_loop_add_fd
+    (loop, cfd, d->is_tx_blocked ? 0 : EPOLLIN, on_client, c);
+  if (c->watch == -1)
+  {
+    PERROR();
+    goto on_error_1;
+  }
+
+  c->is_used = 1;
+
+  return ;
+
+ on_error_1:
+  munmap(c->wake, sizeof(snrf_client_wake_t));
+ on_error_0:
+  close(cfd);
+}
+
+
+/* device */
+
+static void on_payload
+(snrf_loop_t* loop, snrf_handle_t* snrf, const snrf_msg_t* msg, void* opaque)
+{
+  snrfd_t* const d = opaque;
+
+  ++d->nrx;
+
+  if (msg->u.payload.size > SNRF_MAX_PAYLOAD_WIDTH) return ;
+  publish(d, msg->u.payload.data, msg->u.payload.size);
+}
+
+static void on_compl
+(
+ snrf_loop_t* loop, snrf_handle_t* snrf,
+ const snrf_msg_t* msg, const snrf_msg_t* compl, uint64_t tag, void* opaque
+)
+{
+  snrfd_t* const d = opaque;
+  const uint8_t err = compl->u.compl.err;
+
+  --d->ninflight;
+  if (err == SNRF_ERR_SUCCESS) ++d->ntx;
+  else ++d->nfail;
+
+  if (err == SNRF_ERR_SUCCESS)
+    compl_tag(d, tag, SNRF_CLIENT_STATUS_SUCCESS, 0);
+  else
+    compl_tag(d, tag, SNRF_CLIENT_STATUS_DEVICE, err);
+
+  unblock_tx(d);
+}
+
+static void on_timeout
+(
+ snrf_loop_t* loop, snrf_handle_t* snrf,
+ const snrf_msg_t* msg, uint64_t tag, void* opaque
+)
+{
+  snrfd_t* const d = opaque;
+
+  --d->ninflight;
+  ++d->ntimeout;
+
+  compl_tag(d, tag, SNRF_CLIENT_STATUS_TIMEOUT, 0);
+
+  unblock_tx(d);
+}
+
+static void on_error(snrf_loop_t* loop, snrf_handle_t* snrf, void* opaque)
+{
+  snrfd_t* const d = opaque;
+
+  PERROR();
+  d->err = -1;
+  snrf_loop_stop(loop);
+}
+
+static const snrf_loop_ops_t snrfd_ops =
+{
+  on_payload,
+  NULL,
+  on_compl,
+  on_timeout,
+  on_error
+};
+
+
+static void on_signal(int sig)
+{
+  snrf_loop_stop(&snrfd.loop);
+}
+
+static int listen_unix(const char* path)
+{
+  struct sockaddr_un sa;
+  int fd;
+
+  if (strlen(path) >= sizeof(sa.sun_path))
+  {
+    PERROR();
+    return -1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+  {
+    PERROR();
+    return -1;
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, path);
+
+  /* left by a previous instance */
+  unlink(path);
+
+  if (bind(fd, (const struct sockaddr*)&sa, sizeof(sa)) || listen(fd, 16))
+  {
+    PERROR();
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int main(int ac, char** av)
+{
+  /* [device [socket [ring_count]]], serve the bridge to the */
+  /* local clients until interrupted */
+
+  const char* const dev_path = (ac > 1) ? av[1] : "/dev/ttyUSB0";
+  const char* const sock_path = (ac > 2) ? av[2] : SNRF_CLIENT_PATH_DEFAULT;
+  const size_t ring_count = (ac > 3) ? (size_t)strtoul(av[3], NULL, 0) : 4096;
+  snrfd_t* const d = &snrfd;
+  size_t i;
+  int err = -1;
+
+  if (create_ring(d, ring_count))
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  if (snrf_open_with_path(&d->snrf, dev_path))
+  {
+    PERROR();
+    goto on_error_1;
+  }
+
+  if (snrf_set_keyval(&d->snrf, SNRF_KEY_STATE, SNRF_STATE_TXRX))
+  {
+    PERROR();
+    goto on_error_2;
+  }
+
+  if (snrf_loop_init(&d->loop))
+  {
+    PERROR();
+    goto on_error_2;
+  }
+
+  if (snrf_loop_add(&d->loop, &d->snrf, &snrfd_ops, d))
+  {
+    PERROR();
+    goto on_error_3;
+  }
+
+  d->listen_fd = listen_unix(sock_path);
+  if (d->listen_fd == -1)
+  {
+    PERROR();
+    goto on_error_3;
+  }
+
+  if (snrf_loop_add_fd(&d->loop, d->listen_fd, EPOLLIN, on_accept, d) == -1)
+  {
+    PERROR();
+    goto on_error_4;
+  }
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("%s\n", sock_path);
+  fflush(stdout);
+
+  err = snrf_loop_run(&d->loop);
+  if (d->err) err = d->err;
+
+  printf("rx %zu tx %zu fail %zu timeout %zu\n",
+	 d->nrx, d->ntx, d->nfail, d->ntimeout);
+
+  for (i = 0; i != SNRF_CLIENT_MAX; ++i)
+  {
+    if (d->clients[i].is_used) drop_client(d, &d->clients[i]);
+  }
+
+ on_error_4:
+  close(d->listen_fd);
+  unlink(sock_path);
+ on_error_3:
+  snrf_loop_fini(&d->loop);
+ on_error_2:
+  snrf_close(&d->snrf);
+ on_error_1:
+  munmap(d->header, d->map_size);
+  close(d->ring_fd);
+ on_error_0:
+  return err;
+}
@@ -0,0 +1,310 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "snrf.h"
+#include "snrf_emu.h"
+#include "snrf_client.h"
+
+
+#define PERROR()				\
+do {						\
+printf("[!] %s, %u\n", __FILE__, __LINE__);	\
+} while (0)
+
+/* filtered clients, payloads written by each */
+#define CLIENT_COUNT 2
+#define PAYLOAD_COUNT 16
+
+/* bound of every wait, in microseconds */
+#define WAIT_US (10 * 1000000)
+
+typedef struct daemon
+{
+  pid_t pid;
+  FILE* out;
+} daemon_t;
+
+static int start_daemon
+(daemon_t* d, const char* exe, const char* dev_path, const char* sock_path)
+{
+  /* return once the socket is listening, as snrfd prints its */
+  /* path then */
+
+  char line[256];
+  int fds[2];
+
+  if (pipe(fds))
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  d->pid = fork();
+  if (d->pid == -1)
+  {
+    PERROR();
+    goto on_error_1;
+  }
+
+  if (d->pid == 0)
+  {
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    execl(exe, exe, dev_path, sock_path, (char*)NULL);
+    _exit(1);
+  }
+
+  close(fds[1]);
+
+  d->out = fdopen(fds[0], "r");
+  if (d->out == NULL)
+  {
+    PERROR();
+    goto on_error_2;
+  }
+
+  if ((fgets(line, sizeof(line), d->out) == NULL) ||
+      (strncmp(line, sock_path, strlen(sock_path))))
+  {
+    PERROR();
+    goto on_error_3;
+  }
+
+  return 0;
+
+ on_error_3:
+  /* closes fds[0] */
+  fclose(d->out);
+  kill(d->pid, SIGKILL);
+  waitpid(d->pid, NULL, 0);
+  return -1;
+ on_error_2:
+  kill(d->pid, SIGKILL);
+  waitpid(d->pid, NULL, 0);
+  close(fds[0]);
+  return -1;
+ on_error_1:
+  close(fds[0]);
+  close(fds[1]);
+ on_error_0:
+  return -1;
+}
+
+static int stop_daemon(daemon_t* d)
+{
+  /* return -1 unless it exits cleanly */
+
+  char line[256];
+  int status;
+
+  kill(d->pid, SIGTERM);
+
+  /* counters, then the end of file */
+  while (fgets(line, sizeof(line), d->out) != NULL) printf("snrfd: %s", line);
+  fclose(d->out);
+
+  if (waitpid(d->pid, &status, 0) != d->pid) return -1;
+  if ((WIFEXITED(status) == 0) || WEXITSTATUS(status)) return -1;
+
+  return 0;
+}
+
+static int check_compl(snrf_client_t* c, uint32_t seq, uint8_t status)
+{
+  snrf_client_compl_t compl;
+  struct timespec deadline;
+
+  snrf_get_deadline(&deadline, WAIT_US);
+
+  if (snrf_client_read_compl_until(c, &compl, &deadline))
+  {
+    PERROR();
+    return -1;
+  }
+
+  if ((compl.seq != seq) || (compl.status != status))
+  {
+    printf("seq %u status %u, expected %u %u\n",
+	   compl.seq, compl.status, seq, status);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int run(snrf_client_t* clients)
+{
+  snrf_client_filter_t filter;
+  snrf_client_req_t req;
+  struct timespec deadline;
+  uint8_t buf[SNRF_MAX_PAYLOAD_WIDTH];
+  uint8_t tag;
+  uint32_t seqs[CLIENT_COUNT][PAYLOAD_COUNT];
+  uint32_t seq;
+  size_t size;
+  size_t i;
+  size_t j;
+
+  /* client j only receives the payloads starting with 0xa0 + j */
+  for (j = 0; j != CLIENT_COUNT; ++j)
+  {
+    tag = (uint8_t)(0xa0 + j);
+    snrf_client_init_filter(&filter);
+    if (snrf_client_add_rule(&filter, 0, &tag, NULL, 1) ||
+	snrf_client_set_filter(&clients[j], &filter, &seq) ||
+	check_compl(&clients[j], seq, SNRF_CLIENT_STATUS_SUCCESS))
+    {
+      PERROR();
+      return -1;
+    }
+  }
+
+  /* interleaved, the device loops them back */
+  for (i = 0; i != PAYLOAD_COUNT; ++i)
+  {
+    for (j = 0; j != CLIENT_COUNT; ++j)
+    {
+      buf[0] = (uint8_t)(0xa0 + j);
+      buf[1] = (uint8_t)i;
+      if (snrf_client_write_payload(&clients[j], buf, 2, &seqs[j][i]))
+      {
+	PERROR();
+	return -1;
+      }
+    }
+  }
+
+  /* each client gets the completions of its own requests */
+  for (j = 0; j != CLIENT_COUNT; ++j)
+  {
+    for (i = 0; i != PAYLOAD_COUNT; ++i)
+    {
+      if (check_compl(&clients[j], seqs[j][i], SNRF_CLIENT_STATUS_SUCCESS))
+      {
+	PERROR();
+	return -1;
+      }
+    }
+  }
+
+  /* and only the payloads its filter matches, in order */
+  for (j = 0; j != CLIENT_COUNT; ++j)
+  {
+    for (i = 0; i != PAYLOAD_COUNT; ++i)
+    {
+      snrf_get_deadline(&deadline, WAIT_US);
+      if (snrf_client_read_payload_until
+	  (&clients[j], buf, &size, NULL, &deadline))
+      {
+	PERROR();
+	return -1;
+      }
+
+      if ((size < 2) || (buf[0] != (0xa0 + j)) || (buf[1] != i))
+      {
+	printf("client %zu payload %zu: %02x %02x\n", j, i, buf[0], buf[1]);
+	return -1;
+      }
+    }
+
+    if (clients[j].nlost)
+    {
+      PERROR();
+      return -1;
+    }
+  }
+
+  /* the shared ring can not be written */
+  if (mprotect((void*)clients[0].header, clients[0].map_size,
+	       PROT_READ | PROT_WRITE) == 0)
+  {
+    PERROR();
+    return -1;
+  }
+
+  /* a malformed request is answered before hanging up */
+  memset(&req, 0, sizeof(req));
+  req.seq = 0x2a;
+  req.op = 0xff;
+  if ((send(clients[0].sock_fd, &req, sizeof(req), 0) != (ssize_t)sizeof(req)) ||
+      check_compl(&clients[0], req.seq, SNRF_CLIENT_STATUS_MALFORMED))
+  {
+    PERROR();
+    return -1;
+  }
+
+  /* the other client is still served */
+  buf[0] = 0xa1;
+  buf[1] = 0xff;
+  if (snrf_client_write_payload(&clients[1], buf, 2, &seq) ||
+      check_compl(&clients[1], seq, SNRF_CLIENT_STATUS_SUCCESS))
+  {
+    PERROR();
+    return -1;
+  }
+
+  return 0;
+}
+
+int main(int ac, char** av)
+{
+  /* [snrfd], serve the pty emulator with snrfd and check its */
+  /* clients. the exit status is 0 if all the checks pass */
+
+  const char* const exe = (ac > 1) ? av[1] : "../snrfd/a.out";
+  snrf_client_t clients[CLIENT_COUNT];
+  char sock_path[64];
+  snrf_emu_t emu;
+  daemon_t d;
+  size_t j;
+  int err = -1;
+
+  snprintf(sock_path, sizeof(sock_path), "/tmp/snrfd_test.%d.sock", (int)getpid());
+
+  snrf_emu_init(&emu, NULL);
+  if (snrf_emu_start_pty(&emu))
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  if (start_daemon(&d, exe, emu.pty_path, sock_path))
+  {
+    PERROR();
+    goto on_error_1;
+  }
+
+  for (j = 0; j != CLIENT_COUNT; ++j)
+  {
+    if (snrf_client_open(&clients[j], sock_path))
+    {
+      PERROR();
+      goto on_error_3;
+    }
+  }
+
+  err = run(clients);
+
+ on_error_3:
+  while (j--) snrf_client_close(&clients[j]);
+  if (stop_daemon(&d))
+  {
+    PERROR();
+    err = -1;
+  }
+ on_error_1:
+  snrf_emu_stop_pty(&emu);
+ on_error_0:
+  printf("snrfd_test: %s\n", err ? "fail" : "pass");
+  return err ? 1 : 0;
+}
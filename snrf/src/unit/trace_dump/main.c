@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "snrf.h"
+#include "snrf_trace.h"
+
+
+#define PERROR()				\
+do {						\
+printf("[!] %s, %u\n", __FILE__, __LINE__);	\
+} while (0)
+
+static uint32_t get_le32(const uint8_t* p)
+{
+  return
+    (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static const char* op_to_str(uint8_t op)
+{
+  static const char* const strs[] =
+  {
+    "set", "get", "payload", "compl", "debug", "sync", "set_multi", "payload_to"
+  };
+
+  if (op == 0xff) return "corrupt";
+  if (op >= (sizeof(strs) / sizeof(strs[0]))) return "unknown";
+  return strs[op];
+}
+
+static const char* key_to_str(uint8_t key)
+{
+  static const char* const strs[] =
+  {
+    "info", "state", "crc", "rate", "chan", "addr_width", "rx_addr",
+    "tx_addr", "tx_ack", "payload_width", "uart_flags", "nrf_chipset",
+    "uart_baud", "uart_ncorrupt"
+  };
+
+  if (key >= (sizeof(strs) / sizeof(strs[0]))) return "unknown";
+  return strs[key];
+}
+
+static void print_hex(const uint8_t* buf, size_t size)
+{
+  size_t i;
+  for (i = 0; i != size; ++i) printf("%02x", buf[i]);
+}
+
+static void print_rec(const snrf_trace_rec_t* rec, uint64_t origin_ns)
+{
+  /* the record holds the first bytes of the union only */
+
+  const uint8_t* const data = rec->data;
+  size_t size;
+  size_t i;
+
+  printf
+  (
+   "%12.6f %s %-10s seq %3u size %2u ",
+   (double)(rec->ns - origin_ns) / 1000000000.0,
+   rec->dir == SNRF_TRACE_TX ? "tx" : "rx",
+   op_to_str(rec->op), rec->seq, rec->size
+  );
+
+  if (rec->dir == SNRF_TRACE_RX_CORRUPT)
+  {
+    printf("\n");
+    return ;
+  }
+
+  size = 0;
+  if (rec->size > SNRF_MSG_HEADER_SIZE) size = rec->size - SNRF_MSG_HEADER_SIZE;
+  if (size > sizeof(rec->data)) size = sizeof(rec->data);
+
+  switch (rec->op)
+  {
+  case SNRF_OP_SET:
+    printf("%s = 0x%08x", key_to_str(data[0]), get_le32(data + 1));
+    break ;
+
+  case SNRF_OP_GET:
+    printf("%s", key_to_str(data[0]));
+    break ;
+
+  case SNRF_OP_COMPL:
+  case SNRF_OP_SYNC:
+    printf("err %u val 0x%08x", data[0], get_le32(data + 1));
+    break ;
+
+  case SNRF_OP_DEBUG:
+    printf("data 0x%08x line %u", get_le32(data), get_le32(data + 4));
+    break ;
+
+  case SNRF_OP_SET_MULTI:
+    for (i = 0; (i + 5) <= size; i += 5)
+      printf("%s = 0x%08x ", key_to_str(data[i]), get_le32(data + i + 1));
+    break ;
+
+  case SNRF_OP_PAYLOAD_TO:
+    /* a corrupted size may not even hold the addr */
+    if (size < 4) break ;
+    printf("addr 0x%08x ", get_le32(data));
+    print_hex(data + 4, size - 4);
+    break ;
+
+  case SNRF_OP_PAYLOAD:
+  default:
+    print_hex(data, size);
+    break ;
+  }
+
+  printf("\n");
+}
+
+
+/* per op timing summary */
+
+/* all the latencies go in one array, the op in the high */
+/* bits. once sorted, those of an op are contiguous */
+#define LAT_OP_SHIFT 56
+#define LAT_NS_MASK (((uint64_t)1 << LAT_OP_SHIFT) - 1)
+
+typedef struct op_stats
+{
+  size_t ntx;
+  size_t nrx;
+  /* completion latencies, in the shared array */
+  const uint64_t* lats;
+  size_t nlat;
+} op_stats_t;
+
+static int cmp_uint64(const void* a, const void* b)
+{
+  const uint64_t x = *(const uint64_t*)a;
+  const uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static void print_summary
+(const snrf_trace_t* trace, uint64_t first, uint64_t last)
+{
+  /* a message is matched with the next completion of the */
+  /* same seq, or the next sync answer for a sync */
+
+  op_stats_t ops[256];
+  /* index of the pending message of a seq, plus 1 */
+  uint64_t pending[256];
+  const snrf_trace_rec_t* rec;
+  const snrf_trace_rec_t* prev = NULL;
+  const snrf_trace_rec_t* tx;
+  uint64_t* lats;
+  uint64_t lat;
+  size_t nlat = 0;
+  uint64_t gap_ns = 0;
+  uint64_t gap_at = 0;
+  size_t ncorrupt = 0;
+  size_t count;
+  size_t i;
+  uint64_t x;
+  uint64_t sum;
+
+  count = (size_t)(last - first);
+  memset(ops, 0, sizeof(ops));
+  memset(pending, 0, sizeof(pending));
+
+  /* at most a latency per record */
+  lats = malloc((count + 1) * sizeof(uint64_t));
+  if (lats == NULL)
+  {
+    PERROR();
+    return ;
+  }
+
+  for (x = first; x != last; ++x)
+  {
+    rec = &trace->recs[x & trace->mask];
+
+    /* longest silence on the link */
+    if ((prev != NULL) && ((rec->ns - prev->ns) > gap_ns))
+    {
+      gap_ns = rec->ns - prev->ns;
+      gap_at = prev->ns;
+    }
+    prev = rec;
+
+    if (rec->dir == SNRF_TRACE_RX_CORRUPT)
+    {
+      ++ncorrupt;
+      continue ;
+    }
+
+    if (rec->dir == SNRF_TRACE_TX)
+    {
+      ++ops[rec->op].ntx;
+      pending[rec->seq] = x + 1;
+      continue ;
+    }
+
+    ++ops[rec->op].nrx;
+
+    if ((rec->op != SNRF_OP_COMPL) && (rec->op != SNRF_OP_SYNC)) continue ;
+    if (pending[rec->seq] == 0) continue ;
+
+    tx = &trace->recs[(pending[rec->seq] - 1) & trace->mask];
+    pending[rec->seq] = 0;
+
+    /* a sync answer only completes a sync */
+    if ((rec->op == SNRF_OP_SYNC) != (tx->op == SNRF_OP_SYNC)) continue ;
+
+    lat = rec->ns - tx->ns;
+    if (lat > LAT_NS_MASK) lat = LAT_NS_MASK;
+    lats[nlat++] = ((uint64_t)tx->op << LAT_OP_SHIFT) | lat;
+    ++ops[tx->op].nlat;
+  }
+
+  qsort(lats, nlat, sizeof(uint64_t), cmp_uint64);
+
+  for (nlat = 0, i = 0; i != 256; ++i)
+  {
+    ops[i].lats = lats + nlat;
+    nlat += ops[i].nlat;
+  }
+
+  printf("\n%-10s %8s %8s %8s %10s %10s %10s %10s\n",
+	 "op", "tx", "rx", "compl", "min_us", "p50_us", "p99_us", "max_us");
+
+  for (i = 0; i != 256; ++i)
+  {
+    op_stats_t* const o = &ops[i];
+
+    if ((o->ntx == 0) && (o->nrx == 0)) continue ;
+
+    printf("%-10s %8zu %8zu %8zu", op_to_str((uint8_t)i), o->ntx, o->nrx, o->nlat);
+
+    if (o->nlat)
+    {
+      printf(" %10.1f %10.1f %10.1f %10.1f",
+	     (double)(o->lats[0] & LAT_NS_MASK) / 1000.0,
+	     (double)(o->lats[o->nlat / 2] & LAT_NS_MASK) / 1000.0,
+	     (double)(o->lats[(o->nlat * 99) / 100] & LAT_NS_MASK) / 1000.0,
+	     (double)(o->lats[o->nlat - 1] & LAT_NS_MASK) / 1000.0);
+    }
+
+    printf("\n");
+  }
+
+  printf("\nrecords %zu corrupt %zu resyncs %zu\n", count, ncorrupt, ops[SNRF_OP_SYNC].ntx);
+
+  if (count)
+  {
+    rec = &trace->recs[first & trace->mask];
+    sum = prev->ns - rec->ns;
+    printf("span %.6f s, longest gap %.6f s at %.6f s\n",
+	   (double)sum / 1000000000.0,
+	   (double)gap_ns / 1000000000.0,
+	   (double)(gap_at - rec->ns) / 1000000000.0);
+  }
+
+  free(lats);
+}
+
+int main(int ac, char** av)
+{
+  /* trace_path [summary] */
+
+  snrf_trace_t trace;
+  uint64_t first;
+  uint64_t last;
+  uint64_t x;
+  unsigned int is_summary_only;
+
+  if (ac < 2)
+  {
+    PERROR();
+    return -1;
+  }
+
+  is_summary_only = ((ac > 2) && (strcmp(av[2], "summary") == 0));
+
+  if (snrf_trace_load(&trace, av[1]))
+  {
+    PERROR();
+    return -1;
+  }
+
+  /* the oldest records were overwritten once the ring wrapped */
+  last = trace.header->head;
+  first = 0;
+  if (last > trace.header->rec_count) first = last - trace.header->rec_count;
+
+  if (is_summary_only == 0)
+  {
+    for (x = first; x != last; ++x)
+      print_rec(&trace.recs[x & trace.mask], trace.recs[first & trace.mask].ns);
+  }
+
+  print_summary(&trace, first, last);
+
+  snrf_trace_close(&trace);
+
+  return 0;
+}
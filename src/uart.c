@@ -12,6 +12,17 @@ static inline void set_baud_rate(long baud)
   UBRR0L = x;
 }
 
+static inline void set_baud_rate_x2(long baud)
+{
+  /* double speed mode. 250k, 500k and 1M are exact at 16MHz */
+
+  uint16_t x = ((F_CPU / (8UL * CLK_PRESCAL) + baud / 2) / baud - 1);
+  UBRR0H = x >> 8;
+  UBRR0L = x;
+
+  UCSR0A |= 1 << U2X0;
+}
+
 static void uart_setup(void)
 {
 #if (CLK_PRESCAL == 1UL)
@@ -31,6 +42,10 @@ static void uart_setup(void)
 
 static void uart_write(const uint8_t* s, uint8_t n)
 {
+  /* TXC0 is cleared by writing one, so that the last wait */
+  /* below is for this write. the error flags are written 0 */
+  UCSR0A = (UCSR0A & ((1 << U2X0) | (1 << MPCM0))) | (1 << TXC0);
+
   for (; n; --n, ++s)
   {
     /* wait for transmit buffer to be empty */